@@ -0,0 +1,176 @@
+#!/usr/bin/env python
+
+# Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""A persistent index of a corpus directory, so that training data can be
+loaded without re-reading every log each time.
+
+Usage as a script: $0 <directory> ...
+Updates (or creates) the index of each directory and prints its statistics.
+
+The index is kept in the file rfindex.npz inside the corpus directory.  It holds
+the location dictionary (the same indexes that rfutils.count_locpos() would
+make), each log's name, label, length, and SHA-1 digest, and all the logs'
+location indexes and values, concatenated.  Updating the index only reads logs
+that are new or have changed since the last update.
+
+"""
+
+import glob
+import hashlib
+import numpy as np
+import os
+import rfutils
+import sys
+
+INDEX_NAME = 'rfindex.npz'
+
+
+class corpus_index:
+    """The index of one corpus directory.  See the module documentation."""
+
+    def __init__(self, directory):
+        self.directory = directory
+        self.path = os.path.join(directory, INDEX_NAME)
+        self.files = []  # Log names, relative to directory.
+        self.labels = []  # True for '.s', false for '.f'.
+        self.lengths = []  # How many entries each log has.
+        self.stamps = []  # (size, mtime) of each log when it was indexed.
+        self.digests = []  # SHA-1 hex digest of each log's contents.
+        self.locs = []  # Location dictionary: locs[i] has index i+1.
+        self.flat_locs = np.zeros(0, np.uint64)  # All logs' location indexes.
+        self.flat_vals = np.zeros(0, np.float64)  # All logs' values.
+        if os.path.exists(self.path):
+            self._load()
+        self._make_locidx()
+
+    def _load(self):
+        z = np.load(self.path)
+        self.files = list(z['files'])
+        self.labels = list(z['labels'])
+        self.lengths = list(z['lengths'])
+        self.stamps = [tuple(s) for s in z['stamps']]
+        self.digests = list(z['digests'])
+        self.locs = [int(l) for l in z['locs']]
+        self.flat_locs = z['flat_locs']
+        self.flat_vals = z['flat_vals']
+
+    def _make_locidx(self):
+        self.locidx = rfutils.indexes()
+        for l in self.locs:
+            self.locidx.make_index(l)
+
+    def save(self):
+        """Writes the index to its file atomically."""
+        tmp = self.path + '.tmp.npz'
+        np.savez(
+            tmp,
+            files=np.array(self.files, dtype=str),
+            labels=np.array(self.labels, dtype=bool),
+            lengths=np.array(self.lengths, dtype=np.int64),
+            stamps=np.array(self.stamps, dtype=np.float64).reshape(-1, 2),
+            digests=np.array(self.digests, dtype=str),
+            locs=np.array(self.locs, dtype=np.uint64),
+            flat_locs=self.flat_locs,
+            flat_vals=self.flat_vals)
+        os.rename(tmp, self.path)
+
+    def _drop(self, keep):
+        """Drops the logs whose elements in the keep list are false."""
+        ends = np.cumsum(self.lengths)
+        mask = np.ones(len(self.flat_locs), bool)
+        for i, k in enumerate(keep):
+            if not k:
+                mask[ends[i] - self.lengths[i]:ends[i]] = False
+        self.flat_locs = self.flat_locs[mask]
+        self.flat_vals = self.flat_vals[mask]
+        for lst in (self.files, self.labels, self.lengths, self.stamps,
+                    self.digests):
+            lst[:] = [x for x, k in zip(lst, keep) if k]
+
+    def update(self):
+        """Brings the index up to date with the directory contents.
+
+        Returns how many logs were added to or dropped from the index.  Doesn't
+        save the index.
+        """
+        current = dict()
+        for path in glob.glob(os.path.join(self.directory, '*.[sf]')):
+            st = os.stat(path)
+            current[os.path.basename(path)] = (float(st.st_size), st.st_mtime)
+        keep = [current.get(f) == s for f, s in zip(self.files, self.stamps)]
+        dropped = keep.count(False)
+        if dropped:
+            self._drop(keep)
+        known = set(self.files)
+        new_locs = []
+        new_vals = []
+        for name in sorted(current):
+            if name in known:
+                continue
+            flocs = []
+            fvals = []
+            with open(os.path.join(self.directory, name), 'rb') as f:
+                digest = hashlib.sha1(f.read()).hexdigest()
+                f.seek(0)
+                for (v, l) in rfutils.logparse(f):
+                    if self.locidx.get_index(l) is None:
+                        self.locs.append(l)
+                    flocs.append(self.locidx.make_index(l))
+                    fvals.append(v)
+            new_locs.append(np.array(flocs, np.uint64))
+            new_vals.append(np.array(fvals, np.float64))
+            self.files.append(name)
+            self.labels.append(name.endswith('.s'))
+            self.lengths.append(len(flocs))
+            self.stamps.append(current[name])
+            self.digests.append(digest)
+        if new_locs:
+            self.flat_locs = np.concatenate([self.flat_locs] + new_locs)
+            self.flat_vals = np.concatenate([self.flat_vals] + new_vals)
+        return dropped + len(new_locs)
+
+    def poscount(self):
+        """The length of the longest log."""
+        return max(self.lengths) if self.lengths else 0
+
+    def data(self, poscount=None):
+        """Returns (locs, vals, labels), just like rfutils.read_data(), but
+        built from the index instead of the logs.
+
+        The default poscount is self.poscount().
+        """
+        if poscount is None:
+            poscount = self.poscount()
+        n = len(self.files)
+        locs = np.zeros((n, poscount), np.uint64)
+        vals = np.zeros((n, poscount, 1), np.float64)
+        start = 0
+        for i, length in enumerate(self.lengths):
+            k = min(length, poscount)
+            locs[i, :k] = self.flat_locs[start:start + k]
+            vals[i, :k, 0] = self.flat_vals[start:start + k]
+            start += length
+        return locs, vals, np.array(self.labels, dtype=bool)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        sys.exit('usage: %s <directory> ...' % sys.argv[0])
+    for d in sys.argv[1:]:
+        idx = corpus_index(d)
+        changed = idx.update()
+        idx.save()
+        print '%s: %d logs (%d changed), %d locations, %d entries' % (
+            d, len(idx.files), changed, len(idx.locs), len(idx.flat_locs))
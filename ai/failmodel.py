@@ -0,0 +1,114 @@
+#!/usr/bin/env python
+
+# Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Trains a compact model of test failure that tests can evaluate themselves
+while they run, so they can quit early when they're likely to fail.
+
+Usage: $0 <corpus directory> <model file> [epochs] [l2]
+Defaults: epochs=200, l2=1e-4
+
+Trains logistic regression on the corpus (as generated by gencorp.py and indexed
+by corpusindex.py).  Each logged value is a feature: its location and its
+magnitude bucket (see ramfuzz::runtime::failure_model).  The model's score for
+a run is the sum of the weights of the run's features, so it can be computed
+incrementally as values are generated.
+
+Writes the model in the text format that ramfuzz::runtime::failure_model reads.
+Tests run with RAMFUZZ_MODEL=<model file> then exit with status
+ramfuzz::runtime::predicted_failure_exit as soon as their predicted failure
+probability reaches RAMFUZZ_MODEL_THRESHOLD (default: 0.95), and gencorp.py
+names their logs *.p.
+
+Unlike the deep models in sample-model*.py, this model ignores the position of
+each value in the log, which is what makes incremental scoring possible.
+
+"""
+
+import corpusindex
+import numpy as np
+import sys
+
+
+def magnitude_buckets(vals):
+    """Vectorized ramfuzz::runtime::failure_model bucket computation."""
+    _, exp = np.frexp(vals)
+    b = np.where(exp > 0, exp + 1, 1)
+    b = np.where(vals < 0, -b, b)
+    b[(vals == 0) | np.isnan(vals)] = 0
+    return b
+
+
+def features(idx):
+    """Returns (rows, cols, keys): for each logged value in the corpus index
+    idx, the log it's from and its feature's column; and each column's
+    (location, bucket) pair.
+    """
+    rows = np.repeat(np.arange(len(idx.files)), idx.lengths)
+    locmap = np.array([0] + idx.locs, np.uint64)
+    locs = locmap[idx.flat_locs.astype(np.int64)]
+    buckets = magnitude_buckets(idx.flat_vals)
+    pairs = np.zeros(len(locs), [('loc', '<u8'), ('bucket', '<i8')])
+    pairs['loc'] = locs
+    pairs['bucket'] = buckets
+    keys, cols = np.unique(pairs, return_inverse=True)
+    return rows, cols, keys
+
+
+def train(rows, cols, ncols, failed, epochs, l2, rate=0.5):
+    """Fits logistic regression by full-batch gradient descent with Adagrad.
+    Returns (bias, weights)."""
+    n = len(failed)
+    y = failed.astype(np.float64)
+    w = np.zeros(ncols)
+    bias = 0.
+    gw2 = np.full(ncols, 1e-8)
+    gb2 = 1e-8
+    for _ in range(epochs):
+        z = bias + np.bincount(rows, weights=w[cols], minlength=n)
+        err = 1. / (1. + np.exp(-z)) - y
+        gw = np.bincount(cols, weights=err[rows], minlength=ncols) / n + l2 * w
+        gb = err.mean()
+        gw2 += gw * gw
+        gb2 += gb * gb
+        w -= rate * gw / np.sqrt(gw2)
+        bias -= rate * gb / np.sqrt(gb2)
+    return bias, w
+
+
+def write_model(fname, bias, keys, w):
+    """Writes the model in ramfuzz::runtime::failure_model's format."""
+    with open(fname, 'w') as f:
+        f.write('# Written by failmodel.py: %d weights.\n' % len(w))
+        f.write('bias %.17g\n' % bias)
+        for loc, bucket, weight in zip(keys['loc'], keys['bucket'], w):
+            if weight != 0.:
+                f.write('%d %d %.17g\n' % (loc, bucket, weight))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        sys.exit('usage: %s <corpus directory> <model file> [epochs] [l2]' %
+                 sys.argv[0])
+    idx = corpusindex.corpus_index(sys.argv[1])
+    if idx.update():
+        idx.save()
+    epochs = int(sys.argv[3]) if len(sys.argv) > 3 else 200
+    l2 = float(sys.argv[4]) if len(sys.argv) > 4 else 1e-4
+    rows, cols, keys = features(idx)
+    failed = ~np.array(idx.labels, bool)
+    bias, w = train(rows, cols, len(keys), failed, epochs, l2)
+    z = bias + np.bincount(rows, weights=w[cols], minlength=len(failed))
+    print 'training accuracy: %.3f' % np.mean((z > 0) == failed)
+    write_model(sys.argv[2], bias, keys, w)
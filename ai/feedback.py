@@ -0,0 +1,160 @@
+#!/usr/bin/env python
+
+# Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Learns from test runs while they happen and feeds what it learned back into
+the tests that are still running.
+
+Usage: $0 [-i <seconds>] [-r <runs>] [-e <exploration>] [--once] \\
+          <guidance> <source>
+
+<source> is either a corpus directory that gencorp.py is filling, or shm:<ring>
+for a shared-memory ring that tests are publishing into (see
+ramfuzz.shm_create() and gencorp.py).  Corpus directories are polled every
+<seconds> (default: 5) and indexed incrementally with corpusindex.py; rings are
+consumed continuously, and guidance is republished every <runs> runs (default:
+100).  With --once, publishes guidance from the corpus directory's current
+contents and exits.
+
+The guidance goes into file <guidance>, which tests read when run with
+RAMFUZZ_GUIDANCE=<guidance> (see ramfuzz::runtime::guidance).  For each
+location, it advises generating values in the range that successful runs had
+there.  The advice is weighted by how many failing runs' values at that
+location fell outside the range, ie, by how much following it would have
+avoided failures -- but never more than 1-<exploration> (default: 0.1), so
+tests keep exploring.  Every publication atomically replaces the file and
+increments its version, and running tests pick it up without restarting.
+
+"""
+
+import argparse
+import corpusindex
+import numpy as np
+import os
+import rfutils
+import sys
+import time
+
+# Must match ramfuzz::runtime::guidance.
+GUIDANCE_MAGIC = 0x3165646975676672
+GUIDANCE_DTYPE = np.dtype([('loc', '<u8'), ('lo', '<f8'), ('hi', '<f8'),
+                           ('weight', '<f8')])
+
+
+def learn(locs, vals, success, exploration):
+    """Returns advice (a GUIDANCE_DTYPE array sorted by loc) from logged
+    values.
+
+    locs, vals, and success are parallel arrays: one element per logged value,
+    giving its location, the value, and whether its run succeeded.
+    """
+    if not len(locs):
+        return np.zeros(0, GUIDANCE_DTYPE)
+    ulocs, inv = np.unique(locs, return_inverse=True)
+    n = len(ulocs)
+    lo = np.full(n, np.inf)
+    hi = np.full(n, -np.inf)
+    np.minimum.at(lo, inv[success], vals[success])
+    np.maximum.at(hi, inv[success], vals[success])
+    failed = ~success
+    finv = inv[failed]
+    fvals = vals[failed]
+    outside = (fvals < lo[finv]) | (fvals > hi[finv])
+    nfail = np.bincount(finv, minlength=n)
+    nout = np.bincount(finv[outside], minlength=n)
+    weight = np.minimum(nout / np.maximum(nfail, 1.), 1. - exploration)
+    keep = np.isfinite(lo) & (weight > 0)
+    advice = np.zeros(keep.sum(), GUIDANCE_DTYPE)
+    advice['loc'] = ulocs[keep]
+    advice['lo'] = lo[keep]
+    advice['hi'] = hi[keep]
+    advice['weight'] = weight[keep]
+    return advice
+
+
+def current_version(fname):
+    """Returns the version of guidance file fname, or 0 if there is none."""
+    try:
+        with open(fname, 'rb') as f:
+            hdr = np.fromfile(f, '<u8', 4)
+    except IOError:
+        return 0
+    return int(hdr[1]) if len(hdr) == 4 and hdr[0] == GUIDANCE_MAGIC else 0
+
+
+def publish(fname, advice):
+    """Atomically replaces guidance file fname with advice.  Returns the new
+    version."""
+    version = current_version(fname) + 1
+    tmp = '%s.tmp%d' % (fname, os.getpid())
+    with open(tmp, 'wb') as f:
+        np.array([GUIDANCE_MAGIC, version, len(advice), 0], '<u8').tofile(f)
+        advice.tofile(f)
+    os.rename(tmp, fname)
+    return version
+
+
+def from_corpus(directory, args):
+    """Yields (locs, vals, success) arrays each time the corpus changes."""
+    idx = corpusindex.corpus_index(directory)
+    changed = True
+    while True:
+        changed = idx.update() or changed
+        if changed:
+            idx.save()
+            locmap = np.array([0] + idx.locs, np.uint64)
+            success = np.repeat(np.array(idx.labels, bool), idx.lengths)
+            yield (locmap[idx.flat_locs.astype(np.int64)], idx.flat_vals,
+                   success)
+            changed = False
+        if args.once:
+            return
+        time.sleep(args.interval)
+
+
+def from_ring(ring, args):
+    """Yields (locs, vals, success) arrays every args.runs runs."""
+    locs, vals, success = [], [], []
+    for (l, v, status) in rfutils.shm_runs(ring):
+        locs.append(l)
+        vals.append(v)
+        success.append(np.full(len(l), status == 0, bool))
+        if len(locs) % args.runs == 0:
+            yield (np.concatenate(locs), np.concatenate(vals),
+                   np.concatenate(success))
+
+
+def main():
+    p = argparse.ArgumentParser(
+        description='Feed guidance learned from test runs back into tests.')
+    p.add_argument('-i', dest='interval', type=float, default=5.)
+    p.add_argument('-r', dest='runs', type=int, default=100)
+    p.add_argument('-e', dest='exploration', type=float, default=0.1)
+    p.add_argument('--once', action='store_true')
+    p.add_argument('guidance')
+    p.add_argument('source')
+    args = p.parse_args()
+    if args.source.startswith('shm:'):
+        batches = from_ring(args.source[4:], args)
+    else:
+        batches = from_corpus(args.source, args)
+    for (locs, vals, success) in batches:
+        advice = learn(locs, vals, success, args.exploration)
+        version = publish(args.guidance, advice)
+        sys.stderr.write('%s: version %d, %d locations advised (%d values)\n' %
+                         (args.guidance, version, len(advice), len(locs)))
+
+
+if __name__ == '__main__':
+    main()
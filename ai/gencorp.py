@@ -15,16 +15,25 @@
 # limitations under the License.
 """Generates a RamFuzz training corpus.
 
-Usage: $0 <executable> <count>
+Usage: $0 <executable> <count> [<ring>]
 
 Runs <executable> and assumes it creates a file named fuzzlog (which is where
 ramfuzz::runtime::gen logs generated values).  If the executable's exit status
-is 0, renames fuzzlog to 1.s.  Otherwise, renames fuzzlog to 1.f.  Repeats
-<count> times, incrementing the number in the .s/.f file name.
+is 0, renames fuzzlog to 1.s.  If the executable abandoned the run because it
+was predicted to fail (see failmodel.py), renames fuzzlog to 1.p.  Otherwise,
+renames fuzzlog to 1.f.  Repeats <count> times, incrementing the number in the
+.s/.f/.p file name.
 
 After <count> runs, this leaves a set of .s (for success) and .f (for failure)
 files in the current directory.  These files now represents a corpus on which
-AI can be trained (using rfutils.logparse() to read the generated values).
+AI can be trained (using rfutils.logparse() to read the generated values).  The
+.p files are incomplete and aren't part of the corpus proper.
+
+If <ring> is given, it must name a shared-memory ring created by
+ramfuzz.shm_create().  The executable is then run with RAMFUZZ_SHM=<ring>, so it
+publishes its values into the ring, and each run's outcome is published there,
+too.  A consumer (eg, one using rfutils.shm_runs()) can then learn from the runs
+as they happen.  No .s/.f files are kept in this mode.
 
 """
 
@@ -33,15 +42,34 @@ import subprocess
 import sys
 
 argc = len(sys.argv)
-if argc != 3:
-    sys.exit('usage: %s <executable> <count>' % sys.argv[0])
+if argc not in (3, 4):
+    sys.exit('usage: %s <executable> <count> [<ring>]' % sys.argv[0])
+
+if argc == 4:
+    import ramfuzz
+    ring = sys.argv[3]
+    env = dict(os.environ, RAMFUZZ_SHM=ring)
+    for _ in xrange(int(sys.argv[2])):
+        p = subprocess.Popen(sys.argv[1], env=env)
+        ramfuzz.shm_outcome(ring, p.pid, p.wait())
+    if os.path.exists('fuzzlog'):
+        os.remove('fuzzlog')
+    sys.exit(0)
+
+# Must match ramfuzz::runtime::predicted_failure_exit.
+PREDICTED_FAILURE_EXIT = 125
 
 succ = 0
 fail = 0
+pred = 0
 for _ in xrange(int(sys.argv[2])):
-    if (subprocess.call(sys.argv[1]) == 0):
+    status = subprocess.call(sys.argv[1])
+    if status == 0:
         os.rename('fuzzlog', '%d.s' % succ)
         succ += 1
+    elif status == PREDICTED_FAILURE_EXIT:
+        os.rename('fuzzlog', '%d.p' % pred)
+        pred += 1
     else:
         os.rename('fuzzlog', '%d.f' % fail)
         fail += 1
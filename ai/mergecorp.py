@@ -0,0 +1,113 @@
+#!/usr/bin/env python
+
+# Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Merges corpora generated on different machines into one.
+
+Usage: $0 <output directory> <shard directory> ...
+
+Each shard is a corpus directory (as generated by gencorp.py) copied from one
+machine, or a directory on a shared filesystem where a machine writes its
+corpus.  The output directory receives every log that isn't byte-identical to a
+log already there or in an earlier shard; logs are hard-linked (or copied, if
+that fails) and named <shard>-<original name>.
+
+The merge works on corpusindex.py indexes: each shard's index is brought up to
+date (which only reads the shard's new logs), and then the shard's location
+indexes are translated into the output's global location dictionary with one
+lookup table per shard.  So no log is decoded twice, and the output directory
+ends up with an up-to-date index that training scripts can load right away.
+Merging more shards into the same output later only adds the new logs.
+
+"""
+
+import corpusindex
+import numpy as np
+import os
+import shutil
+import sys
+
+
+def place(src, dst_dir, name):
+    """Links or copies file src into dst_dir under name, or a variant of it if
+    name is taken.  Returns the name used."""
+    base, ext = os.path.splitext(name)
+    n = 0
+    while os.path.exists(os.path.join(dst_dir, name)):
+        n += 1
+        name = '%s~%d%s' % (base, n, ext)
+    dst = os.path.join(dst_dir, name)
+    try:
+        os.link(src, dst)
+    except OSError:
+        shutil.copy2(src, dst)
+    return name
+
+
+def absorb(merged, shard, prefix):
+    """Adds to index merged the logs of index shard that merged doesn't have,
+    placing them in merged's directory.  Returns how many logs were added."""
+    # remap[i] is the merged index of the shard's location index i.
+    remap = np.zeros(len(shard.locs) + 1, np.uint64)
+    for i, l in enumerate(shard.locs):
+        if merged.locidx.get_index(l) is None:
+            merged.locs.append(l)
+        remap[i + 1] = merged.locidx.make_index(l)
+    known = set(merged.digests)
+    ends = np.cumsum(shard.lengths, dtype=np.int64)
+    keep = np.zeros(len(shard.flat_locs), bool)
+    added = 0
+    for i, name in enumerate(shard.files):
+        if shard.digests[i] in known:
+            continue
+        known.add(shard.digests[i])
+        keep[ends[i] - shard.lengths[i]:ends[i]] = True
+        newname = place(
+            os.path.join(shard.directory, name), merged.directory,
+            '%s-%s' % (prefix, name))
+        st = os.stat(os.path.join(merged.directory, newname))
+        merged.files.append(newname)
+        merged.labels.append(shard.labels[i])
+        merged.lengths.append(shard.lengths[i])
+        merged.stamps.append((float(st.st_size), st.st_mtime))
+        merged.digests.append(shard.digests[i])
+        added += 1
+    merged.flat_locs = np.concatenate([
+        merged.flat_locs,
+        np.take(remap, shard.flat_locs[keep].astype(np.int64))
+    ])
+    merged.flat_vals = np.concatenate([merged.flat_vals,
+                                       shard.flat_vals[keep]])
+    return added
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        sys.exit('usage: %s <output directory> <shard directory> ...' %
+                 sys.argv[0])
+    out = sys.argv[1]
+    if not os.path.isdir(out):
+        os.makedirs(out)
+    merged = corpusindex.corpus_index(out)
+    merged.update()
+    for d in sys.argv[2:]:
+        shard = corpusindex.corpus_index(d)
+        if shard.update():
+            shard.save()
+        prefix = os.path.basename(os.path.normpath(d))
+        added = absorb(merged, shard, prefix)
+        print '%s: %d logs, %d added' % (d, len(shard.files), added)
+    merged.save()
+    print '%s: %d logs, %d locations' % (out, len(merged.files),
+                                         len(merged.locs))
@@ -17,6 +17,7 @@
 
 import numpy as np
 import ramfuzz
+import time
 
 
 def logparse(f):
@@ -60,6 +61,51 @@ class indexes:
         return self.d[x]
 
 
+class hashed_indexes:
+    """Assigns indexes to input values by hashing them into a fixed number of
+    buckets.
+
+    Can be used instead of indexes where there's no chance (or no time) to see
+    all values in advance: get_index() gives every value an index, even one
+    never seen before.  Indexes range from 1 to buckets, inclusive, leaving 0
+    free for padding, just like indexes does.  Distinct values can get the same
+    index; if track_collisions is true, collisions() reports how often that
+    happened.  That takes memory for every distinct value, so it's off by
+    default.
+    """
+
+    def __init__(self, buckets, track_collisions=False):
+        self.buckets = buckets
+        self.watermark = buckets + 1
+        # Value -> index, for collision statistics; None when not tracking.
+        self.seen = dict() if track_collisions else None
+
+    def get_index(self, x):
+        """Returns x's index."""
+        # Fibonacci hashing: the top bits of x times 2^64/phi (mod 2^64) are
+        # spread out even for sequential x.  Scaling the product by buckets and
+        # keeping the top 64 bits picks them for any bucket count.
+        idx = 1 + ((((x * 0x9E3779B97F4A7C15) & 0xFFFFFFFFFFFFFFFF) *
+                    self.buckets) >> 64)
+        if self.seen is not None:
+            self.seen[x] = idx
+        return idx
+
+    def make_index(self, x):
+        """Same as get_index; for compatibility with indexes."""
+        return self.get_index(x)
+
+    def collisions(self):
+        """Returns a triple: (distinct values indexed so far, distinct indexes
+        given out, values that got an index already given to another value).
+        Requires track_collisions.
+        """
+        if self.seen is None:
+            raise ValueError('collisions not tracked')
+        used = len(set(self.seen.itervalues()))
+        return len(self.seen), used, len(self.seen) - used
+
+
 def count_locpos(files):
     """Counts distinct positions and locations in a list of files.
 
@@ -76,20 +122,83 @@ def count_locpos(files):
 
 
 def read_data(files, poscount, locidx):
-    """Builds input data from a files list."""
+    """Builds input data from a files list.
+
+    Each file's data is padded with zeros to poscount positions; positions
+    beyond poscount are ignored.  If poscount is None, it becomes the length of
+    the longest file.  That way, a hashed_indexes locidx lets the data be built
+    in a single pass over the files, without count_locpos().
+    """
     locs = []  # One element per file; each is a list of location indexes.
     vals = []  # One element per file; each is a parallel list of values.
     labels = []  # One element per file: true for '.s', false for '.f'.
     for fname in files:
-        flocs = np.zeros(poscount, np.uint64)
-        fvals = np.zeros((poscount, 1), np.float64)
+        flocs = []
+        fvals = []
         with open(fname) as f:
             for (p, (v, l)) in enumerate(logparse(f)):
+                if poscount is not None and p >= poscount:
+                    break
                 idx = locidx.get_index(l)
-                if idx:
-                    flocs[p] = idx
-                    fvals[p] = v
+                flocs.append(idx if idx else 0)
+                fvals.append(v if idx else 0.)
         locs.append(flocs)
         vals.append(fvals)
         labels.append(fname.endswith('.s'))
-    return np.array(locs), np.array(vals), np.array(labels)
+    if poscount is None:
+        poscount = max(len(l) for l in locs) if locs else 0
+    alocs = np.zeros((len(files), poscount), np.uint64)
+    avals = np.zeros((len(files), poscount, 1), np.float64)
+    for i in range(len(files)):
+        alocs[i, :len(locs[i])] = locs[i]
+        avals[i, :len(vals[i]), 0] = vals[i]
+    return alocs, avals, np.array(labels)
+
+
+# Layout of the records that ramfuzz.shm_read() returns.
+SHM_DTYPE = np.dtype([('pid', '<u4'), ('kind', 'u1'), ('tag', 'u1'),
+                      ('pad', '<u2'), ('loc', '<u8'), ('val', '<f8')])
+
+# Record kinds in a shared-memory ring.
+SHM_VALUE, SHM_BEGIN, SHM_END, SHM_OUTCOME = range(4)
+
+
+def shm_batches(name, batch=65536, poll=0.001):
+    """Consumes the shared-memory ring named name (see ramfuzz.shm_create())
+    and yields its records as SHM_DTYPE arrays of up to batch elements.
+
+    Waits poll seconds whenever the ring is empty.  Never stops on its own.
+    """
+    while True:
+        buf = ramfuzz.shm_read(name, batch)
+        if buf:
+            yield np.frombuffer(buf, SHM_DTYPE)
+        else:
+            time.sleep(poll)
+
+
+def shm_runs(name, **kwargs):
+    """Assembles the records from the ring named name into runs and yields each
+    run as (locs, vals, status) when its outcome arrives.
+
+    locs and vals are arrays of the run's locations and values, in logging
+    order; status is the run's exit status (or minus the signal that killed
+    it).  Extra arguments are passed to shm_batches().
+    """
+    pending = dict()  # pid -> list of value-record arrays.
+    for b in shm_batches(name, **kwargs):
+        # Runs' records interleave, so split the batch at each pid change.
+        for chunk in np.split(b, np.flatnonzero(np.diff(b['pid'])) + 1):
+            pid = int(chunk['pid'][0])
+            run = pending.setdefault(pid, [])
+            start = 0
+            for i in np.flatnonzero(chunk['kind'] != SHM_VALUE):
+                run.append(chunk[start:i])
+                start = i + 1
+                if chunk['kind'][i] == SHM_BEGIN:
+                    run = pending[pid] = []
+                elif chunk['kind'][i] == SHM_OUTCOME:
+                    recs = np.concatenate(pending.pop(pid))
+                    run = pending[pid] = []
+                    yield recs['loc'], recs['val'], int(chunk['val'][i])
+            run.append(chunk[start:])
@@ -19,10 +19,15 @@ the test run.  Using a simple CNN, it can achieve >99% accuracy.  The model is
 adapted from Alexander Rakhlin's sample implementation of NLP CNN:
 https://github.com/alexander-rakhlin/CNN-for-Sentence-Classification-in-Keras
 
-Usage: $0 [epochs] [batch_size]
+Usage: $0 [epochs] [batch_size] [hash_buckets]
 Defaults: epochs=1, batch_size=50
 
-Expects a train/ subdirectory containing the output of ./gencorp.py.  If there
+If hash_buckets is given, locations are hashed into that many buckets (see
+rfutils.hashed_indexes), so the corpus is read in a single pass, and locations
+in valn/ that never appear in train/ still get meaningful indexes.
+
+Expects a train/ subdirectory containing the output of ./gencorp.py, which is
+indexed by ./corpusindex.py so later runs only read newly added logs.  If there
 is also a valn/ subdirectory with output of another ./gencorp.py run, validates
 the model against its contents.
 
@@ -35,6 +40,7 @@ from keras.layers.merge import concatenate
 from keras.metrics import binary_crossentropy
 from keras.models import Model
 from keras.optimizers import Adam
+import corpusindex
 import glob
 import keras.backend as K
 import numpy as np
@@ -43,7 +49,17 @@ import rfutils
 import sys
 
 gl = glob.glob(os.path.join('train', '*.[sf]'))
-poscount, locidx = rfutils.count_locpos(gl)
+if len(sys.argv) > 3:
+    locidx = rfutils.hashed_indexes(int(sys.argv[3]), track_collisions=True)
+    locs, vals, labels = rfutils.read_data(gl, None, locidx)
+    poscount = locs.shape[1]
+    print '%d locations in %d buckets, %d collisions' % locidx.collisions()
+else:
+    corpus = corpusindex.corpus_index('train')
+    if corpus.update():
+        corpus.save()
+    poscount, locidx = corpus.poscount(), corpus.locidx
+    locs, vals, labels = corpus.data()
 
 embedding_dim = 4
 filter_sizes = (3, 8)
@@ -72,7 +88,6 @@ out = Dense(
         dropout_prob[1])(concatenate(conv_list))))
 ml = Model(inputs=[in_locs, in_vals], outputs=out)
 ml.compile(Adam(lr=0.01), metrics=['acc'], loss=binary_crossentropy)
-locs, vals, labels = rfutils.read_data(gl, poscount, locidx)
 
 
 def fit(eps, bsz):
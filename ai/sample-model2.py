@@ -24,7 +24,8 @@ Unfortunately, this model can currently only reach ~56% accuracy.
 
 Usage: $0 [epochs] [batch_size] [N]
 Defaults: epochs=1, batch_size=50, N=50
-Expects a train/ subdirectory containing the output of ./gencorp.py.
+Expects a train/ subdirectory containing the output of ./gencorp.py, which is
+indexed by ./corpusindex.py so later runs only read newly added logs.
 
 """
 
@@ -35,14 +36,14 @@ from keras.layers.merge import concatenate, multiply
 from keras.metrics import mse
 from keras.models import Model
 from keras.optimizers import Adam
-import glob
+import corpusindex
 import keras.backend as K
-import os.path
-import rfutils
 import sys
 
-gl = glob.glob(os.path.join('train', '*.[sf]'))
-poscount, locidx = rfutils.count_locpos(gl)
+corpus = corpusindex.corpus_index('train')
+if corpus.update():
+    corpus.save()
+poscount, locidx = corpus.poscount(), corpus.locidx
 
 embedding_dim = 4
 dropout_prob = 0.4
@@ -68,7 +69,7 @@ mult = multiply(dense_list)
 ml = Model(inputs=[in_locs, in_vals], outputs=mult)
 ml.compile(optr, metrics=['acc'], loss=mse)
 
-locs, vals, labels = rfutils.read_data(gl, poscount, locidx)
+locs, vals, labels = corpus.data()
 
 
 def fit(
@@ -0,0 +1,216 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "benchmark/benchmark.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "ramfuzz-rt.hpp"
+
+unsigned ramfuzz::runtime::spinlimit = 3;
+
+namespace ramfuzz {
+namespace runtime {
+
+/// Exposes gen's private hot paths, so they can be measured in isolation.
+struct bench_access {
+  static size_t valueid(gen &g) { return g.valueid().id; }
+  template <typename T> static void output(gen &g, T val, size_t id) {
+    g.output(val, gen::location{id, 0});
+  }
+  template <typename T> static void input(gen &g, T &val) { g.input(val); }
+  template <typename T> static T *makenew(gen &g) { return g.makenew<T>(); }
+};
+
+} // namespace runtime
+} // namespace ramfuzz
+
+namespace {
+
+using namespace ramfuzz::runtime;
+using std::numeric_limits;
+using std::string;
+
+/// Discards records, so benchmarks measure gen rather than file I/O.
+class null_sink : public log_sink {
+public:
+  void write(const char *rec, size_t len) override {
+    benchmark::DoNotOptimize(rec);
+  }
+};
+
+std::unique_ptr<gen> quiet_gen() {
+  return std::unique_ptr<gen>(new gen(std::make_shared<null_sink>()));
+}
+
+/// A temporary file name, removed when the object is destroyed.
+class temp_file {
+public:
+  temp_file() {
+    char tmpl[] = "/tmp/ramfuzz-bench.XXXXXX";
+    const int fd = mkstemp(tmpl);
+    if (fd >= 0)
+      close(fd);
+    name = tmpl;
+  }
+  ~temp_file() { unlink(name.c_str()); }
+  string name;
+};
+
+/// The size of a logged value of type T in a log file.
+template <typename T> constexpr int64_t record_size() {
+  return 1 + sizeof(T) + sizeof(uint32_t);
+}
+
+template <typename T> void BM_between(benchmark::State &state) {
+  auto g = quiet_gen();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(
+        g->between(numeric_limits<T>::lowest(), numeric_limits<T>::max()));
+}
+BENCHMARK_TEMPLATE(BM_between, bool);
+BENCHMARK_TEMPLATE(BM_between, char);
+BENCHMARK_TEMPLATE(BM_between, unsigned char);
+BENCHMARK_TEMPLATE(BM_between, short);
+BENCHMARK_TEMPLATE(BM_between, unsigned short);
+BENCHMARK_TEMPLATE(BM_between, int);
+BENCHMARK_TEMPLATE(BM_between, unsigned int);
+BENCHMARK_TEMPLATE(BM_between, long);
+BENCHMARK_TEMPLATE(BM_between, unsigned long);
+BENCHMARK_TEMPLATE(BM_between, long long);
+BENCHMARK_TEMPLATE(BM_between, unsigned long long);
+BENCHMARK_TEMPLATE(BM_between, float);
+BENCHMARK_TEMPLATE(BM_between, double);
+
+/// between<int> locating values by source position instead of unwinding.
+void BM_between_source_ids(benchmark::State &state) {
+  auto g = quiet_gen();
+  g->use_source_ids();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(g->between(0, 1000));
+}
+BENCHMARK(BM_between_source_ids);
+
+/// make<int> as tests call it: once the first int exists, each call reuses an
+/// earlier one half the time.
+void BM_make_int_reuse(benchmark::State &state) {
+  auto g = quiet_gen();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(g->make<int>());
+}
+BENCHMARK(BM_make_int_reuse);
+
+/// make<int> that always creates a new int.
+void BM_make_int_fresh(benchmark::State &state) {
+  auto g = quiet_gen();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(bench_access::makenew<int>(*g));
+}
+BENCHMARK(BM_make_int_fresh);
+
+/// make<int> locating values by source position, without streams (Arg 0) and
+/// with them (Arg 1), where each new int opens a stream.
+void BM_make_int_source_ids(benchmark::State &state) {
+  auto g = quiet_gen();
+  g->use_source_ids();
+  if (state.range(0))
+    g->use_streams();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(g->make<int>());
+}
+BENCHMARK(BM_make_int_source_ids)->Arg(0)->Arg(1);
+
+void BM_make_vector_int(benchmark::State &state) {
+  auto g = quiet_gen();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(g->make<std::vector<int>>());
+}
+BENCHMARK(BM_make_vector_int);
+
+void BM_make_string(benchmark::State &state) {
+  auto g = quiet_gen();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(g->make<string>());
+}
+BENCHMARK(BM_make_string);
+
+void BM_make_char_ptr(benchmark::State &state) {
+  auto g = quiet_gen();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(g->make<char *>());
+}
+BENCHMARK(BM_make_char_ptr);
+
+/// Calls valueid() from depth more nested frames.
+__attribute__((noinline)) void valueid_at(benchmark::State &state, gen &g,
+                                          int depth) {
+  if (depth > 0) {
+    valueid_at(state, g, depth - 1);
+    benchmark::ClobberMemory(); // Prevents tail calls.
+    return;
+  }
+  for (auto _ : state)
+    benchmark::DoNotOptimize(bench_access::valueid(g));
+}
+
+void BM_valueid(benchmark::State &state) {
+  auto g = quiet_gen();
+  valueid_at(state, *g, state.range(0));
+}
+BENCHMARK(BM_valueid)->Arg(5)->Arg(20)->Arg(50);
+
+/// Logging to a file, without generating values, directly (Arg 0) or through
+/// gen::write_async() (Arg 1).
+void BM_output(benchmark::State &state) {
+  temp_file log;
+  gen g(log.name);
+  if (state.range(0))
+    g.write_async();
+  int val = 0;
+  for (auto _ : state) {
+    ++val;
+    bench_access::output(g, val, size_t(val) * 0x9e3779b9);
+  }
+  state.SetBytesProcessed(state.iterations() * record_size<int>());
+}
+BENCHMARK(BM_output)->Arg(0)->Arg(1);
+
+/// Reading a replayed log, without logging values.
+void BM_input(benchmark::State &state) {
+  temp_file ilog, olog;
+  {
+    gen w(ilog.name);
+    for (int64_t i = 0; i < int64_t(state.max_iterations); ++i)
+      bench_access::output(w, int(i), size_t(i));
+  }
+  gen g(ilog.name, olog.name);
+  int val;
+  for (auto _ : state) {
+    bench_access::input(g, val);
+    benchmark::DoNotOptimize(val);
+  }
+  state.SetBytesProcessed(state.iterations() * record_size<int>());
+}
+BENCHMARK(BM_input);
+
+} // anonymous namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,284 @@
+#!/usr/bin/python
+
+# Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Measures end-to-end fuzzing throughput and how it scales across cores.
+
+Usage: $0 [-d <seconds>] [-p <processes>] [-m <methods>] [-o <json>]
+          <llvm-build-dir> [<case> ...]
+
+where <llvm-build-dir> is as for ../test/test.py.  Each case is a test case
+from ../test, built the way test.py builds it, or "large": a synthetic class
+with <methods> methods (default: 300).  The default cases are inh-deep,
+vec-cls, the abstr-* cases, tmpl, and large.
+
+For each case, the test executable is run over and over for <seconds>
+(default: 10) by 1, 2, 4, ... up to <processes> (default: the number of
+cores) concurrent workers, first generating values and then replaying logs
+generated beforehand.  (Cases whose main() doesn't build its gen from argc
+and argv can't replay and are only measured generating.)  Each measurement
+yields a line of CSV on standard output:
+
+case,mode,processes,runs/s,values/s,log bytes/s,peak RSS (KiB),speedup
+
+where speedup is runs/s relative to one process.  Reading down the lines of a
+case and mode gives its scaling curve: where speedup stops tracking the
+process count, workers have started contending for something, typically the
+disk the logs go to.  With -o, the measurements are also written to file
+<json> as a list of objects with the same fields.
+"""
+
+from multiprocessing import cpu_count
+from os import path
+import argparse
+import imp
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+scriptdir = path.dirname(path.realpath(__file__))
+e2e = imp.load_source('e2e', path.join(scriptdir, '..', 'test', 'test.py'))
+
+DEFAULT_CASES = [
+    'inh-deep', 'vec-cls', 'abstr', 'abstr-inh', 'abstr-ns', 'abstr-ptr',
+    'abstr-ref', 'abstr-str', 'abstr-vec', 'tmpl', 'large'
+]
+
+# Value sizes by type tag (see typetag() in ../runtime/ramfuzz-rt.cpp), for an
+# LP64 platform.
+VALUE_SIZES = [1, 1, 1, 2, 2, 4, 4, 8, 8, 8, 8, 4, 8]
+ID_SIZE = 8
+# Record flags and sizes; see the log format in ../runtime/ramfuzz-rt.hpp.
+COMPACT_FLAG, NODE_SIZE = 0x20, 4
+META_TAG, META_LEN_SIZE = 0x40, 4
+
+LARGE_CPP = '''#include "fuzz.hpp"
+
+int main(int argc, char *argv[]) {
+  ramfuzz::runtime::gen g(argc, argv);
+  ramfuzz::harness<Large> h(g);
+  for (auto m : h.mroulette)
+    (h.*m)();
+  return 0;
+}
+
+unsigned ::ramfuzz::runtime::spinlimit = 3;
+'''
+
+
+def large_hpp(methods):
+    """Returns the source of a class with the given number of methods, whose
+    parameters cycle through several kinds of types."""
+    params = [
+        'int a', 'double a, bool b', 'unsigned a, char b, long c',
+        'const std::vector<int> &v', 'float a, short b', 'const std::string &s'
+    ]
+    uses = ['a', 'a * b', 'a + b + c', 'v.size()', 'a - b', 's.size()']
+    lines = ['#include <string>', '#include <vector>', '', 'class Large {',
+             '  double sum = 0;', '', 'public:']
+    for i in range(methods):
+        k = i % len(params)
+        lines.append('  void m%d(%s) { sum += %s; }' % (i, params[k], uses[k]))
+    lines += ['  double get() const { return sum; }', '};', '']
+    return '\n'.join(lines)
+
+
+def count_values(fname):
+    """Returns the number of values in log fname."""
+    with open(fname, 'rb') as f:
+        data = bytearray(f.read())
+    n = pos = 0
+    while pos < len(data):
+        tag = data[pos]
+        if tag >= META_TAG:
+            length = data[pos + 1:pos + 1 + META_LEN_SIZE]
+            pos += 1 + META_LEN_SIZE + sum(b << 8 * i
+                                           for i, b in enumerate(length))
+            continue
+        pos += 1 + VALUE_SIZES[tag & ~COMPACT_FLAG] + (
+            NODE_SIZE if tag & COMPACT_FLAG else ID_SIZE)
+        n += 1
+    return n
+
+
+def build_case(name, args, bindir, rtobj):
+    """Builds case name in a new directory.  Returns (directory, executable,
+    whether it can replay)."""
+    temp = tempfile.mkdtemp()
+    hfile, cfile = name + '.hpp', name + '.cpp'
+    if name == 'large':
+        with open(path.join(temp, hfile), 'w') as f:
+            f.write(large_hpp(args.methods))
+        with open(path.join(temp, cfile), 'w') as f:
+            f.write(LARGE_CPP)
+    else:
+        shutil.copy(path.join(e2e.scriptdir, hfile), temp)
+        shutil.copy(path.join(e2e.scriptdir, cfile), temp)
+    e2e.run([path.join(bindir, 'ramfuzz'), hfile, '--', '-std=c++11'], temp)
+    build_cmd = [
+        path.join(bindir, 'clang++'), '-std=c++11', '-O2', '-or',
+        '-I' + path.dirname(rtobj), cfile, 'fuzz.cpp', rtobj
+    ]
+    if sys.platform != 'darwin':
+        build_cmd += ['-lunwind', '-lrt', '-pthread']
+    e2e.run(build_cmd, temp)
+    return temp, path.join(temp, 'r'), e2e.uses_argv(path.join(temp, cfile))
+
+
+def run_once(cmd, cwd):
+    """Runs cmd in cwd, ignoring its exit status.  Returns its peak RSS in
+    KiB."""
+    with open(os.devnull, 'w') as null:
+        proc = subprocess.Popen(cmd, cwd=cwd, stdout=null, stderr=null)
+        _, _, usage = os.wait4(proc.pid, 0)
+    # ru_maxrss is in bytes on macOS.
+    return usage.ru_maxrss // 1024 if sys.platform == 'darwin' else \
+        usage.ru_maxrss
+
+
+class worker(threading.Thread):
+    """Runs exe in its own directory until the deadline, generating values if
+    logs is empty, else replaying logs in turn."""
+
+    def __init__(self, exe, logs):
+        threading.Thread.__init__(self)
+        self.exe, self.deadline = exe, 0
+        self.dir = tempfile.mkdtemp()
+        self.logs = []
+        for i, (log, _, _) in enumerate(logs):
+            self.logs.append(path.join(self.dir, 'log%d' % i))
+            shutil.copy(log, self.logs[-1])
+        self.sizes = [(size, values) for _, size, values in logs]
+        self.runs = self.values = self.bytes = self.rss = 0
+
+    def run(self):
+        while time.time() < self.deadline:
+            if self.logs:
+                i = self.runs % len(self.logs)
+                rss = run_once([self.exe, self.logs[i]], self.dir)
+                size, values = self.sizes[i]
+            else:
+                rss = run_once([self.exe], self.dir)
+                log = path.join(self.dir, 'fuzzlog')
+                size, values = 0, 0
+                if path.exists(log):
+                    size, values = path.getsize(log), count_values(log)
+            self.runs += 1
+            self.values += values
+            self.bytes += size
+            self.rss = max(self.rss, rss)
+        shutil.rmtree(self.dir)
+
+
+def measure(exe, logs, procs, seconds):
+    """Runs procs workers for the given number of seconds.  Returns (runs/s,
+    values/s, bytes/s, peak RSS)."""
+    workers = [worker(exe, logs) for _ in range(procs)]
+    start = time.time()
+    for w in workers:
+        w.deadline = start + seconds
+        w.start()
+    for w in workers:
+        w.join()
+    elapsed = time.time() - start
+    return (sum(w.runs for w in workers) / elapsed,
+            sum(w.values for w in workers) / elapsed,
+            sum(w.bytes for w in workers) / elapsed,
+            max(w.rss for w in workers))
+
+
+def sample_logs(exe, cwd, count=50):
+    """Generates count logs to replay.  Returns a list of (log, size,
+    values)."""
+    logs = []
+    for i in range(count):
+        run_once([exe], cwd)
+        log = path.join(cwd, 'sample%d' % i)
+        os.rename(path.join(cwd, 'fuzzlog'), log)
+        logs.append((log, path.getsize(log), count_values(log)))
+    return logs
+
+
+def process_counts(most):
+    """1, 2, 4, ... up to and including most."""
+    counts = []
+    n = 1
+    while n < most:
+        counts.append(n)
+        n *= 2
+    return counts + [most]
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+        description='Measures end-to-end fuzzing throughput.')
+    parser.add_argument('-d', '--seconds', type=float, default=10)
+    parser.add_argument('-p', '--processes', type=int, default=cpu_count())
+    parser.add_argument('-m', '--methods', type=int, default=300)
+    parser.add_argument('-o', '--json')
+    parser.add_argument('llvm_build_dir')
+    parser.add_argument('cases', nargs='*')
+    args = parser.parse_args()
+    bindir = path.join(args.llvm_build_dir, 'bin')
+    rttemp = tempfile.mkdtemp()
+    try:
+        rtobj = e2e.build_runtime(bindir, rttemp)
+    except e2e.StepError as e:
+        sys.exit('error building the runtime ({}): {}'.format(rttemp, e))
+    results = []
+    print 'case,mode,processes,runs/s,values/s,log bytes/s,peak RSS (KiB),' \
+        'speedup'
+    for case in args.cases or DEFAULT_CASES:
+        try:
+            temp, exe, replays = build_case(case, args, bindir, rtobj)
+        except e2e.StepError as e:
+            sys.stderr.write('error building {}: {}\n'.format(case, e))
+            continue
+        modes = [('generate', [])]
+        if replays:
+            modes.append(('replay', sample_logs(exe, temp)))
+        else:
+            sys.stderr.write('{} can\'t replay; measuring generation only\n'.
+                             format(case))
+        for mode, logs in modes:
+            base = None
+            for procs in process_counts(max(args.processes, 1)):
+                runs, values, nbytes, rss = measure(exe, logs, procs,
+                                                    args.seconds)
+                base = base or runs
+                r = {
+                    'case': case,
+                    'mode': mode,
+                    'processes': procs,
+                    'runs_per_sec': runs,
+                    'values_per_sec': values,
+                    'log_bytes_per_sec': nbytes,
+                    'peak_rss_kib': rss,
+                    'speedup': runs / base if base else 0.
+                }
+                results.append(r)
+                print '%s,%s,%d,%.1f,%.0f,%.0f,%d,%.2f' % (
+                    case, mode, procs, runs, values, nbytes, rss,
+                    r['speedup'])
+                sys.stdout.flush()
+        shutil.rmtree(temp)
+    shutil.rmtree(rttemp)
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=1)
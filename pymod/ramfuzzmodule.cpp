@@ -14,71 +14,332 @@
 
 #include <Python.h>
 
+#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 using namespace std;
 
+/// Log format constants; must match ../runtime/ramfuzz-rt.hpp.
+constexpr char compact_flag = 0x20;
+constexpr unsigned char meta_tag = 0x40, cct_tag = meta_tag;
+
+/// Location IDs of the calling-context-tree nodes read so far, by log file
+/// descriptor.  Must match ramfuzz::runtime::cct_id().  A log's entry is erased
+/// when load() reaches its end or fails on it.
+static map<int, vector<uint64_t>> ccts;
+
 /// Reads a T value from RamFuzz log opened under the file descriptor fd.  After
-/// reading the value, reads its id and returns a Python tuple (value, id).
-template <typename T> PyObject *logread(int fd) {
+/// reading the value, reads its id (or, if cct isn't null, the index in cct of
+/// its id) and returns a Python tuple (value, id).
+template <typename T>
+PyObject *logread(int fd, const vector<uint64_t> *cct) {
   T val;
   if (size_t(read(fd, &val, sizeof(val))) < sizeof(val))
     return Py_BuildValue("");
-  size_t id;
-  if (size_t(read(fd, &id, sizeof(id))) < sizeof(id))
+  uint64_t id;
+  if (cct) {
+    uint32_t node;
+    if (size_t(read(fd, &node, sizeof(node))) < sizeof(node))
+      return Py_BuildValue("");
+    if (node >= cct->size())
+      return PyErr_Format(PyExc_ValueError, "undefined CCT node %u", node);
+    id = (*cct)[node];
+  } else if (size_t(read(fd, &id, sizeof(id))) < sizeof(id))
     return Py_BuildValue("");
   unsigned long long lid(id);
   return Py_BuildValue("d K", double(val), lid);
 }
 
-/// Implements Python's ramfuzz.load(), which is documented below in \c methods.
-static PyObject *ramfuzz_load(PyObject *self, PyObject *args) {
-  int fd;
-  if (!PyArg_ParseTuple(args, "i", &fd) || fd < 0)
-    return NULL;
+/// Reads the body of a metadata record with the given tag from fd, adding any
+/// CCT node it defines to cct.  Returns false if the log is truncated.
+static bool metaread(int fd, unsigned char tag, vector<uint64_t> &cct) {
+  uint32_t len;
+  if (size_t(read(fd, &len, sizeof(len))) < sizeof(len))
+    return false;
+  string body(len, '\0');
+  if (size_t(read(fd, &body[0], len)) < len)
+    return false;
+  uint32_t parent;
+  uint64_t site;
+  if (tag == cct_tag && len >= sizeof(parent) + sizeof(site)) {
+    memcpy(&parent, &body[0], sizeof(parent));
+    memcpy(&site, &body[sizeof(parent)], sizeof(site));
+    const uint64_t p = parent < cct.size() ? cct[parent] : 0;
+    cct.push_back(p ^ (site + 0x9e3779b9 + (p << 6) + (p >> 2)));
+  }
+  return true;
+}
+
+/// Reads the next value from the log under fd, as ramfuzz_load() returns it.
+static PyObject *next_value(int fd) {
+  auto &cct = ccts[fd];
+  // A new log (or the same one, rewound) starts a new tree.
+  if (lseek(fd, 0, SEEK_CUR) == 0)
+    cct.assign(1, 0);
   char tag;
-  if (read(fd, &tag, 1) < 1)
-    return Py_BuildValue("");
-  switch (tag) {
+  for (;;) {
+    if (read(fd, &tag, 1) < 1)
+      return Py_BuildValue("");
+    if (static_cast<unsigned char>(tag) < meta_tag)
+      break;
+    if (!metaread(fd, tag, cct))
+      return Py_BuildValue("");
+  }
+  const vector<uint64_t> *nodes = (tag & compact_flag) ? &cct : nullptr;
+  switch (tag & ~compact_flag) {
   // The following must match the specializations of
   // ramfuzz::runtime::typetag.
   case 0:
-    return logread<bool>(fd);
+    return logread<bool>(fd, nodes);
   case 1:
-    return logread<char>(fd);
+    return logread<char>(fd, nodes);
   case 2:
-    return logread<unsigned char>(fd);
+    return logread<unsigned char>(fd, nodes);
   case 3:
-    return logread<short>(fd);
+    return logread<short>(fd, nodes);
   case 4:
-    return logread<unsigned short>(fd);
+    return logread<unsigned short>(fd, nodes);
   case 5:
-    return logread<int>(fd);
+    return logread<int>(fd, nodes);
   case 6:
-    return logread<unsigned int>(fd);
+    return logread<unsigned int>(fd, nodes);
   case 7:
-    return logread<long>(fd);
+    return logread<long>(fd, nodes);
   case 8:
-    return logread<unsigned long>(fd);
+    return logread<unsigned long>(fd, nodes);
   case 9:
-    return logread<long long>(fd);
+    return logread<long long>(fd, nodes);
   case 10:
-    return logread<unsigned long long>(fd);
+    return logread<unsigned long long>(fd, nodes);
   case 11:
-    return logread<float>(fd);
+    return logread<float>(fd, nodes);
   case 12:
-    return logread<double>(fd);
+    return logread<double>(fd, nodes);
   default:
+    return PyErr_Format(PyExc_ValueError, "unknown tag %d",
+                        static_cast<unsigned char>(tag));
+  }
+}
+
+/// Implements Python's ramfuzz.load(), which is documented below in \c methods.
+static PyObject *ramfuzz_load(PyObject *self, PyObject *args) {
+  int fd;
+  if (!PyArg_ParseTuple(args, "i", &fd))
+    return NULL;
+  if (fd < 0) {
+    PyErr_SetString(PyExc_ValueError, "negative file descriptor");
+    return NULL;
+  }
+  PyObject *val = next_value(fd);
+  // Done with this log; fd may be reused for another.
+  if (!val || val == Py_None)
+    ccts.erase(fd);
+  return val;
+}
+
+/// The shared-memory ring that ramfuzz::runtime::shm_sink publishes into.  The
+/// following must match ../runtime/ramfuzz-rt.cpp.
+struct shm_slot {
+  atomic<uint64_t> seq;
+  uint32_t pid;
+  unsigned char kind;
+  char tag;
+  uint16_t pad;
+  uint64_t id;
+  double value;
+};
+
+struct shm_ring {
+  uint64_t magic;
+  uint64_t capacity;
+  alignas(64) atomic<uint64_t> head;
+  alignas(64) uint64_t tail;
+
+  shm_slot *slots() { return reinterpret_cast<shm_slot *>(this + 1); }
+};
+
+constexpr uint64_t shm_magic = 0x31676e6972667172;
+
+/// Bytes of a slot that shm_read() returns: everything but seq.
+constexpr size_t shm_recsize = sizeof(shm_slot) - sizeof(atomic<uint64_t>);
+
+/// Rings this process has mapped, by name.
+static map<string, shm_ring *> shm_rings;
+
+/// Maps the ring named name, or returns the existing mapping.  On failure, sets
+/// the Python exception and returns NULL.
+static shm_ring *shm_map(const char *name) {
+  const auto found = shm_rings.find(name);
+  if (found != shm_rings.end())
+    return found->second;
+  const int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, const_cast<char *>(name));
+    return NULL;
+  }
+  struct stat st;
+  void *p = MAP_FAILED;
+  if (!fstat(fd, &st) && size_t(st.st_size) > sizeof(shm_ring))
+    p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  auto r = static_cast<shm_ring *>(p);
+  if (p == MAP_FAILED || r->magic != shm_magic) {
+    if (p != MAP_FAILED)
+      munmap(p, st.st_size);
+    PyErr_Format(PyExc_ValueError, "not a RamFuzz ring: %s", name);
+    return NULL;
+  }
+  return shm_rings[name] = r;
+}
+
+/// Publishes a slot into r, waiting while r is full.
+static void shm_publish(shm_ring *r, uint32_t pid, unsigned char kind,
+                        double value) {
+  const uint64_t mask = r->capacity - 1;
+  uint64_t pos = r->head.load(memory_order_relaxed);
+  shm_slot *slot;
+  for (;;) {
+    slot = &r->slots()[pos & mask];
+    const auto seq = slot->seq.load(memory_order_acquire);
+    if (seq == pos) {
+      if (r->head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+        break;
+    } else if (seq < pos) {
+      this_thread::yield();
+      pos = r->head.load(memory_order_relaxed);
+    } else
+      pos = r->head.load(memory_order_relaxed);
+  }
+  slot->pid = pid;
+  slot->kind = kind;
+  slot->tag = 0;
+  slot->id = 0;
+  slot->value = value;
+  slot->seq.store(pos + 1, memory_order_release);
+}
+
+/// Implements Python's ramfuzz.shm_create(), documented below in \c methods.
+static PyObject *ramfuzz_shm_create(PyObject *self, PyObject *args) {
+  const char *name;
+  unsigned long capacity;
+  if (!PyArg_ParseTuple(args, "sk", &name, &capacity))
+    return NULL;
+  if (!capacity || capacity & (capacity - 1)) {
+    PyErr_SetString(PyExc_ValueError, "capacity must be a power of two");
+    return NULL;
+  }
+  const size_t size = sizeof(shm_ring) + capacity * sizeof(shm_slot);
+  const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    return PyErr_SetFromErrnoWithFilename(PyExc_OSError,
+                                          const_cast<char *>(name));
+  void *p = MAP_FAILED;
+  if (!ftruncate(fd, size))
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    shm_unlink(name);
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+  auto r = static_cast<shm_ring *>(p);
+  r->capacity = capacity;
+  r->head = 0;
+  r->tail = 0;
+  for (uint64_t i = 0; i < capacity; ++i)
+    r->slots()[i].seq.store(i, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  r->magic = shm_magic;
+  shm_rings[name] = r;
+  return Py_BuildValue("");
+}
+
+/// Implements Python's ramfuzz.shm_read(), documented below in \c methods.
+static PyObject *ramfuzz_shm_read(PyObject *self, PyObject *args) {
+  const char *name;
+  unsigned long maxcount;
+  if (!PyArg_ParseTuple(args, "sk", &name, &maxcount))
+    return NULL;
+  shm_ring *r = shm_map(name);
+  if (!r)
+    return NULL;
+  const uint64_t mask = r->capacity - 1;
+  string out;
+  while (out.size() / shm_recsize < maxcount) {
+    shm_slot &slot = r->slots()[r->tail & mask];
+    if (slot.seq.load(memory_order_acquire) != r->tail + 1)
+      break;
+    out.append(reinterpret_cast<const char *>(&slot.pid), shm_recsize);
+    slot.seq.store(r->tail + r->capacity, memory_order_release);
+    ++r->tail;
+  }
+  return PyString_FromStringAndSize(out.data(), out.size());
+}
+
+/// Implements Python's ramfuzz.shm_outcome(), documented below in \c methods.
+static PyObject *ramfuzz_shm_outcome(PyObject *self, PyObject *args) {
+  const char *name;
+  unsigned int pid;
+  int status;
+  if (!PyArg_ParseTuple(args, "sIi", &name, &pid, &status))
+    return NULL;
+  shm_ring *r = shm_map(name);
+  if (!r)
+    return NULL;
+  shm_publish(r, pid, 3, status);
+  return Py_BuildValue("");
+}
+
+/// Implements Python's ramfuzz.shm_unlink(), documented below in \c methods.
+static PyObject *ramfuzz_shm_unlink(PyObject *self, PyObject *args) {
+  const char *name;
+  if (!PyArg_ParseTuple(args, "s", &name))
     return NULL;
+  const auto found = shm_rings.find(name);
+  if (found != shm_rings.end()) {
+    munmap(found->second,
+           sizeof(shm_ring) + found->second->capacity * sizeof(shm_slot));
+    shm_rings.erase(found);
   }
+  if (shm_unlink(name))
+    return PyErr_SetFromErrnoWithFilename(PyExc_OSError,
+                                          const_cast<char *>(name));
+  return Py_BuildValue("");
 }
 
 /// A list of all methods in this module.
 static PyMethodDef methods[] = {
     {"load", ramfuzz_load, METH_VARARGS,
      "Return the next value from the RamFuzz log whose file descriptor is "
-     "passed as the sole (int) argument."},
+     "passed as the sole (int) argument, or None at the end of the log.  "
+     "Raises ValueError if the log is malformed."},
+    {"shm_create", ramfuzz_shm_create, METH_VARARGS,
+     "Create a shared-memory ring (named by the first argument, as in "
+     "shm_open) with room for as many records as the second argument, which "
+     "must be a power of two.  Tests run with the environment variable "
+     "RAMFUZZ_SHM set to the ring's name will publish their logs into it."},
+    {"shm_read", ramfuzz_shm_read, METH_VARARGS,
+     "Consume up to the second argument's count of records from the ring "
+     "named by the first argument.  Doesn't wait for records to arrive.  "
+     "Returns a string of 24-byte records (pid, kind, tag, padding, location, "
+     "value), as described by rfutils.SHM_DTYPE.  The ring must have a single "
+     "consumer."},
+    {"shm_outcome", ramfuzz_shm_outcome, METH_VARARGS,
+     "Publish, into the ring named by the first argument, the outcome of the "
+     "run whose pid is the second argument: its exit status, or minus the "
+     "signal that killed it."},
+    {"shm_unlink", ramfuzz_shm_unlink, METH_VARARGS,
+     "Remove the ring named by the sole argument."},
     {NULL, NULL, 0, NULL} /* Sentinel */
 };
 
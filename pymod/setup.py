@@ -22,7 +22,11 @@ the module:
 
 from distutils.core import setup, Extension
 
-module1 = Extension('ramfuzz', sources=['ramfuzzmodule.cpp'])
+module1 = Extension(
+    'ramfuzz',
+    sources=['ramfuzzmodule.cpp'],
+    extra_compile_args=['-std=c++11'],
+    libraries=['rt'])
 
 setup(
     name='ramfuzz',
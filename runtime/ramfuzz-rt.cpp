@@ -15,25 +15,46 @@
 #include "ramfuzz-rt.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
 #include <cstddef>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <thread>
+
+#include <fcntl.h>
+#include <link.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using std::cout;
 using std::endl;
 using std::generate;
 using std::hex;
 using std::isprint;
+using std::ifstream;
 using std::istream;
+using std::istringstream;
 using std::numeric_limits;
 using std::ofstream;
+using std::pair;
+using std::shared_ptr;
 using std::ranlux24;
 using std::size_t;
 using std::streamsize;
 using std::string;
 using std::vector;
+using std::uint64_t;
 using std::uniform_int_distribution;
 using std::uniform_real_distribution;
 
@@ -65,6 +86,56 @@ unw_word_t get_pc() {
   return pc;
 }
 
+/// Returns the body of a module_tag record (see gen) for the loaded binary
+/// containing pc, or an empty string if there's no such binary.
+string module_record(unw_word_t pc) {
+  struct query {
+    unw_word_t pc;
+    string body;
+  } q{pc, string()};
+  dl_iterate_phdr(
+      [](dl_phdr_info *info, size_t, void *data) {
+        auto &q = *static_cast<query *>(data);
+        const uint64_t vaddr = q.pc - info->dlpi_addr;
+        bool found = false;
+        string build_id;
+        for (int i = 0; i < info->dlpi_phnum; ++i) {
+          const auto &ph = info->dlpi_phdr[i];
+          if (ph.p_type == PT_LOAD && vaddr - ph.p_vaddr < ph.p_memsz)
+            found = true;
+          if (ph.p_type != PT_NOTE)
+            continue;
+          // Notes are a header, a name, and a description, each 4-aligned.
+          auto p = reinterpret_cast<const char *>(info->dlpi_addr + ph.p_vaddr);
+          const auto end = p + ph.p_memsz;
+          while (p + sizeof(ElfW(Nhdr)) <= end) {
+            const auto n = reinterpret_cast<const ElfW(Nhdr) *>(p);
+            const auto name = p + sizeof(*n);
+            const auto desc = name + ((n->n_namesz + 3) & ~3);
+            if (n->n_type == NT_GNU_BUILD_ID && n->n_namesz == 4 &&
+                !memcmp(name, "GNU", 4))
+              build_id.assign(desc, n->n_descsz);
+            p = desc + ((n->n_descsz + 3) & ~3);
+          }
+        }
+        if (!found)
+          return 0;
+        string path(info->dlpi_name);
+        if (path.empty()) { // The executable itself.
+          char buf[4096];
+          const auto len = readlink("/proc/self/exe", buf, sizeof(buf));
+          path.assign(buf, len > 0 ? len : 0);
+        }
+        const uint32_t idlen = build_id.size();
+        q.body.assign(reinterpret_cast<const char *>(&vaddr), sizeof(vaddr));
+        q.body.append(reinterpret_cast<const char *>(&idlen), sizeof(idlen));
+        q.body += build_id + path;
+        return 1;
+      },
+      &q);
+  return q.body;
+}
+
 /// True iff the frame *curs is for the procedure named exp_name.
 bool name_is(unw_cursor_t *curs, const char *exp_name) {
   char name[256];
@@ -73,57 +144,1198 @@ bool name_is(unw_cursor_t *curs, const char *exp_name) {
          !strcmp(exp_name, name);
 }
 
+/// Returns the value of type T at p, converted to double.
+template <typename T> double as_double(const char *p) {
+  T val;
+  memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+/// Returns the value of a log record's type tag at p, converted to double.
+double decode_value(char tag, const char *p) {
+  switch (tag) {
+  case 0:
+    return as_double<bool>(p);
+  case 1:
+    return as_double<char>(p);
+  case 2:
+    return as_double<unsigned char>(p);
+  case 3:
+    return as_double<short>(p);
+  case 4:
+    return as_double<unsigned short>(p);
+  case 5:
+    return as_double<int>(p);
+  case 6:
+    return as_double<unsigned int>(p);
+  case 7:
+    return as_double<long>(p);
+  case 8:
+    return as_double<unsigned long>(p);
+  case 9:
+    return as_double<long long>(p);
+  case 10:
+    return as_double<unsigned long long>(p);
+  case 11:
+    return as_double<float>(p);
+  case 12:
+    return as_double<double>(p);
+  default:
+    return 0.;
+  }
+}
+
+/// Size of the value in a log record with type tag tag, or 0 if tag is unknown.
+size_t value_size(char tag) {
+  switch (tag) {
+  case 0:
+    return sizeof(bool);
+  case 1:
+    return sizeof(char);
+  case 2:
+    return sizeof(unsigned char);
+  case 3:
+    return sizeof(short);
+  case 4:
+    return sizeof(unsigned short);
+  case 5:
+    return sizeof(int);
+  case 6:
+    return sizeof(unsigned int);
+  case 7:
+    return sizeof(long);
+  case 8:
+    return sizeof(unsigned long);
+  case 9:
+    return sizeof(long long);
+  case 10:
+    return sizeof(unsigned long long);
+  case 11:
+    return sizeof(float);
+  case 12:
+    return sizeof(double);
+  default:
+    return 0;
+  }
+}
+
+/// The value bucket of val, as described in failure_model.
+int magnitude_bucket(double val) {
+  if (val == 0. || std::isnan(val))
+    return 0;
+  int exp;
+  std::frexp(val, &exp);
+  const int b = exp > 0 ? exp + 1 : 1;
+  return val < 0 ? -b : b;
+}
+
+/// One slot of the shared-memory ring.  Must match ../pymod/ramfuzzmodule.cpp.
+struct shm_slot {
+  /// Vyukov's bounded-queue sequence number: equals the slot's position when
+  /// the slot is free for a producer, and position+1 when it's full.
+  std::atomic<uint64_t> seq;
+  uint32_t pid;
+  unsigned char kind;
+  char tag;
+  uint16_t pad;
+  uint64_t id;
+  double value;
+};
+
+/// Magic number at the start of every ring.
+constexpr uint64_t shm_magic = 0x31676e6972667172; // "rqfring1"
+
+/// Magic number at the start of every guidance file.
+constexpr uint64_t guidance_magic = 0x3165646975676672; // "rfguide1"
+
+/// Magic number at the start of every value_table file.
+constexpr uint64_t dists_magic = 0x3173747369646672; // "rfdists1"
+
+/// Magic number at the start of every log trie.
+constexpr uint64_t trie_magic = 0x3165697274667200; // "\0rftrie1"
+
 } // anonymous namespace
 
 namespace ramfuzz {
 namespace runtime {
 
-gen::gen(const string &ologname)
-    : runmode(generate), olog(ologname), base_pc(get_pc()) {
-  if (!olog)
-    throw file_error("Cannot open " + ologname);
+/// Maps file fname, which must start with a four-word header whose first word
+/// is magic.  Returns the mapping and fills sb with the file's status.  Throws
+/// file_error on failure.
+static const uint64_t *map_table(const string &fname, uint64_t magic,
+                                 struct stat &sb) {
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw file_error("Cannot open " + fname);
+  void *p = MAP_FAILED;
+  if (!fstat(fd, &sb) && sb.st_size >= 4 * 8)
+    p = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    throw file_error("Cannot map " + fname);
+  const auto hdr = static_cast<const uint64_t *>(p);
+  if (hdr[0] != magic) {
+    munmap(p, sb.st_size);
+    throw file_error("Wrong file type: " + fname);
+  }
+  return hdr;
+}
+
+/// Header of the shared-memory ring; the slots follow it.  Must match
+/// ../pymod/ramfuzzmodule.cpp.
+struct shm_sink::ring {
+  uint64_t magic;
+  uint64_t capacity; ///< Slot count; a power of two.
+  alignas(64) std::atomic<uint64_t> head; ///< Next position to publish into.
+  alignas(64) uint64_t tail;              ///< Next position to consume.
+
+  shm_slot *slots() { return reinterpret_cast<shm_slot *>(this + 1); }
+};
+
+shm_sink::shm_sink(const string &name) {
+  const int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd < 0)
+    throw file_error("Cannot open shared memory " + name);
+  struct stat st;
+  void *p = MAP_FAILED;
+  if (!fstat(fd, &st) && size_t(st.st_size) > sizeof(ring))
+    p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    throw file_error("Cannot map shared memory " + name);
+  r = static_cast<ring *>(p);
+  mapsize = st.st_size;
+  if (r->magic != shm_magic ||
+      sizeof(ring) + r->capacity * sizeof(shm_slot) > mapsize) {
+    munmap(p, mapsize);
+    throw file_error("Not a RamFuzz ring: " + name);
+  }
+  publish(1, 0, 0, 0.);
+}
+
+shm_sink::~shm_sink() {
+  publish(2, 0, 0, 0.);
+  munmap(r, mapsize);
+}
+
+void shm_sink::write(const char *rec, size_t len) {
+  const char tag = rec[0];
+  size_t id;
+  memcpy(&id, rec + len - sizeof(id), sizeof(id));
+  publish(0, tag, id, decode_value(tag, rec + 1));
+}
+
+void shm_sink::publish(unsigned char kind, char tag, size_t id,
+                       double value) {
+  const uint64_t mask = r->capacity - 1;
+  uint64_t pos = r->head.load(std::memory_order_relaxed);
+  shm_slot *slot;
+  for (;;) {
+    slot = &r->slots()[pos & mask];
+    const auto seq = slot->seq.load(std::memory_order_acquire);
+    if (seq == pos) {
+      if (r->head.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed))
+        break;
+    } else if (seq < pos) {
+      // The ring is full; wait for the consumer.
+      std::this_thread::yield();
+      pos = r->head.load(std::memory_order_relaxed);
+    } else
+      pos = r->head.load(std::memory_order_relaxed);
+  }
+  slot->pid = getpid();
+  slot->kind = kind;
+  slot->tag = tag;
+  slot->id = id;
+  slot->value = value;
+  slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+guidance::guidance(const string &fname) {
+  struct stat sb;
+  hdr = map_table(fname, guidance_magic, sb);
+  mapsize = sb.st_size;
+  st = {sb.st_ino, sb.st_mtime};
+  begin = reinterpret_cast<const advice *>(hdr + 4);
+  end = begin + hdr[2];
+  if (hdr[2] > (mapsize - 4 * sizeof(*hdr)) / sizeof(advice)) {
+    munmap(const_cast<uint64_t *>(hdr), mapsize);
+    throw file_error("Truncated " + fname);
+  }
+}
+
+guidance::~guidance() { munmap(const_cast<uint64_t *>(hdr), mapsize); }
+
+const guidance::advice *guidance::find(uint64_t id) const {
+  const auto it = std::lower_bound(
+      begin, end, id, [](const advice &a, uint64_t id) { return a.id < id; });
+  return it != end && it->id == id ? it : nullptr;
+}
+
+value_table::value_table(const string &fname) {
+  struct stat sb;
+  hdr = map_table(fname, dists_magic, sb);
+  mapsize = sb.st_size;
+  sites = reinterpret_cast<const site *>(hdr + 4);
+  entries = reinterpret_cast<const entry *>(sites + hdr[2]);
+  const size_t room = mapsize - 4 * sizeof(*hdr);
+  bool valid = hdr[2] <= room / sizeof(site) &&
+               hdr[3] <= (room - hdr[2] * sizeof(site)) / sizeof(entry);
+  for (uint64_t i = 0; valid && i < hdr[2]; ++i)
+    valid = sites[i].count && sites[i].first <= hdr[3] &&
+            sites[i].count <= hdr[3] - sites[i].first;
+  if (!valid) {
+    munmap(const_cast<uint64_t *>(hdr), mapsize);
+    throw file_error("Corrupt value table " + fname);
+  }
+}
+
+value_table::~value_table() { munmap(const_cast<uint64_t *>(hdr), mapsize); }
+
+const value_table::entry *value_table::pick(uint64_t id, double u) const {
+  const auto end = sites + hdr[2];
+  const auto s = std::lower_bound(
+      sites, end, id, [](const site &s, uint64_t id) { return s.id < id; });
+  if (s == end || s->id != id)
+    return nullptr;
+  // The integral part of u*count picks a column; the fractional part decides
+  // between the column's entry and its alias.
+  const double x = u * s->count;
+  const uint32_t col = std::min(uint32_t(x), s->count - 1);
+  const entry *e = entries + s->first + col;
+  return x - col < e->prob ? e : entries + s->first + e->alias % s->count;
+}
+
+std::pair<uint64_t, int64_t> guidance::stamp(const string &fname) {
+  struct stat sb;
+  if (stat(fname.c_str(), &sb))
+    return {0, 0};
+  return {sb.st_ino, sb.st_mtime};
+}
+
+constraints::constraints(const string &fname) {
+  ifstream file(fname);
+  if (!file)
+    throw file_error("Cannot open " + fname);
+  // Multi-location inequalities, normalized so that the largest coefficient
+  // magnitude is 1, mapped to the tightest bound seen for them.
+  std::map<vector<pair<uint64_t, double>>, double> normalized;
+  string line;
+  for (unsigned lineno = 1; getline(file, line); ++lineno) {
+    istringstream in(line);
+    string tok;
+    if (!(in >> tok) || tok[0] == '#')
+      continue;
+    const string where = fname + ":" + std::to_string(lineno);
+    vector<pair<uint64_t, double>> terms;
+    double bound;
+    try {
+      while (tok != "<=" && tok != ">=") {
+        const double coef = std::stod(tok);
+        if (!(in >> tok))
+          throw file_error(where + ": missing location");
+        terms.emplace_back(std::stoull(tok), coef);
+        if (!(in >> tok))
+          throw file_error(where + ": missing <= or >=");
+      }
+    } catch (const std::logic_error &) {
+      throw file_error(where + ": bad number " + tok);
+    }
+    if (!(in >> bound))
+      throw file_error(where + ": missing bound");
+    if (tok == ">=") {
+      bound = -bound;
+      for (auto &t : terms)
+        t.second = -t.second;
+    }
+    // Merge repeated locations and drop zero terms.
+    std::sort(terms.begin(), terms.end());
+    vector<pair<uint64_t, double>> merged;
+    for (const auto &t : terms)
+      if (!merged.empty() && merged.back().first == t.first)
+        merged.back().second += t.second;
+      else
+        merged.push_back(t);
+    merged.erase(std::remove_if(merged.begin(), merged.end(),
+                                [](const pair<uint64_t, double> &t) {
+                                  return t.second == 0.;
+                                }),
+                 merged.end());
+    if (merged.empty())
+      continue;
+    if (merged.size() == 1) {
+      auto &s = sites[merged[0].first];
+      const double a = merged[0].second;
+      if (a > 0)
+        s.hi = std::min(s.hi, bound / a);
+      else
+        s.lo = std::max(s.lo, bound / a);
+      continue;
+    }
+    double scale = 0.;
+    for (const auto &t : merged)
+      scale = std::max(scale, std::abs(t.second));
+    for (auto &t : merged)
+      t.second /= scale;
+    bound /= scale;
+    const auto found = normalized.find(merged);
+    if (found == normalized.end())
+      normalized.emplace(std::move(merged), bound);
+    else
+      found->second = std::min(found->second, bound);
+  }
+  for (const auto &n : normalized) {
+    // Drop the inequality if even its greatest left-hand side satisfies it.
+    double greatest = 0.;
+    for (const auto &t : n.first) {
+      const auto &s = sites[t.first];
+      greatest += t.second > 0 ? t.second * s.hi : t.second * s.lo;
+    }
+    if (greatest <= n.second)
+      continue;
+    ineqs.emplace_back();
+    ineqs.back().bound = n.second;
+    for (const auto &t : n.first) {
+      auto &s = sites[t.first];
+      s.terms.emplace_back(ineqs.size() - 1, t.second);
+      add_term(ineqs.back(), s.least(t.second));
+    }
+  }
+}
+
+void constraints::add_term(ineq &q, double least) {
+  if (std::isinf(least))
+    ++q.infinite;
+  else
+    q.finite_sum += least;
+}
+
+void constraints::remove_term(ineq &q, double least) {
+  if (std::isinf(least))
+    --q.infinite;
+  else
+    q.finite_sum -= least;
+}
+
+pair<double, double> constraints::bounds(uint64_t id) const {
+  const auto found = sites.find(id);
+  if (found == sites.end())
+    return {-numeric_limits<double>::infinity(),
+            numeric_limits<double>::infinity()};
+  const auto &s = found->second;
+  double lo = s.lo, hi = s.hi;
+  for (const auto &t : s.terms) {
+    const auto &q = ineqs[t.first];
+    const double a = t.second, own = s.least(a);
+    // Without finite least values for all other terms, there's no bound.
+    if (q.infinite > unsigned(std::isinf(own)))
+      continue;
+    const double others = q.finite_sum - (std::isinf(own) ? 0. : own);
+    const double limit = (q.bound - others) / a;
+    if (a > 0)
+      hi = std::min(hi, limit);
+    else
+      lo = std::max(lo, limit);
+  }
+  return {lo, hi};
+}
+
+void constraints::assign(uint64_t id, double val) {
+  const auto found = sites.find(id);
+  if (found == sites.end())
+    return;
+  auto &s = found->second;
+  for (const auto &t : s.terms)
+    remove_term(ineqs[t.first], s.least(t.second));
+  s.known = true;
+  s.val = val;
+  for (const auto &t : s.terms)
+    add_term(ineqs[t.first], s.least(t.second));
+}
+
+failure_model::failure_model(const string &fname) {
+  ifstream file(fname);
+  if (!file)
+    throw file_error("Cannot open " + fname);
+  string line;
+  for (unsigned lineno = 1; getline(file, line); ++lineno) {
+    istringstream in(line);
+    string tok;
+    if (!(in >> tok) || tok[0] == '#')
+      continue;
+    if (tok == "bias") {
+      if (!(in >> score))
+        throw file_error(fname + ":" + std::to_string(lineno) + ": bad bias");
+      continue;
+    }
+    int bucket;
+    double weight;
+    try {
+      const uint64_t id = std::stoull(tok);
+      if (!(in >> bucket >> weight))
+        throw std::invalid_argument(tok);
+      weights[id].emplace_back(bucket, weight);
+    } catch (const std::logic_error &) {
+      throw file_error(fname + ":" + std::to_string(lineno) + ": bad weight");
+    }
+  }
+}
+
+double failure_model::add(uint64_t id, double val) {
+  const auto found = weights.find(id);
+  if (found != weights.end()) {
+    const int bucket = magnitude_bucket(val);
+    for (const auto &w : found->second)
+      if (w.first == bucket)
+        score += w.second;
+  }
+  return 1. / (1. + std::exp(-score));
+}
+
+namespace {
+
+/// Replays all the logs in a trie (see gen::gen(argc, argv, k)), forking where
+/// they diverge.  Must match ../tools/logtrie.hpp.
+class trie_buf : public std::streambuf {
+public:
+  explicit trie_buf(const string &fname) {
+    struct stat sb;
+    hdr = map_table(fname, trie_magic, sb);
+    mapsize = sb.st_size;
+    nodes = reinterpret_cast<const node *>(hdr + 4);
+    data = reinterpret_cast<const char *>(nodes + hdr[1]);
+    if (!hdr[1] || hdr[1] > (mapsize - 4 * sizeof(*hdr)) / sizeof(node) ||
+        hdr[3] > mapsize - 4 * sizeof(*hdr) - hdr[1] * sizeof(node)) {
+      munmap(const_cast<uint64_t *>(hdr), mapsize);
+      throw file_error("Corrupt trie " + fname);
+    }
+    if (const char *name = getenv("RAMFUZZ_TRIE_RESULTS"))
+      results = open(name, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (const char *t = getenv("RAMFUZZ_TRIE_TIMEOUT"))
+      timeout = atoi(t);
+    if (timeout)
+      alarm(timeout);
+  }
+
+  ~trie_buf() { munmap(const_cast<uint64_t *>(hdr), mapsize); }
+
+  /// Goes back to the start of this process's log, which then reads the same
+  /// bytes again, without forking.
+  void rewind() {
+    cur = 0;
+    entered = false;
+    retraced = 0;
+    setg(nullptr, nullptr, nullptr);
+  }
+
+protected:
+  int_type underflow() override {
+    while (gptr() == egptr()) {
+      if (!entered) {
+        entered = true;
+        const auto &n = nodes[cur];
+        char *p = const_cast<char *>(data) + n.off;
+        setg(p, p, p + n.len);
+      } else if (!descend())
+        return traits_type::eof();
+    }
+    return traits_type::to_int_type(*gptr());
+  }
+
+private:
+  /// A trie node: a run of log bytes, followed by children that are
+  /// contiguous in the node array.
+  struct node {
+    uint64_t off;   ///< Offset of the node's bytes in data.
+    uint32_t len;   ///< How many bytes.
+    uint32_t first; ///< Index of the first child.
+    uint32_t count; ///< How many children.
+    int32_t leaf;   ///< Index of the log ending here, or -1.
+  };
+
+  /// Moves on to the next node after cur is consumed, forking if the logs
+  /// diverge.  Returns false if the log ends.
+  bool descend() {
+    if (retraced < path.size()) {
+      cur = path[retraced++];
+      entered = false;
+      return true;
+    }
+    const auto &n = nodes[cur];
+    if (ended || !n.count) {
+      ended = true;
+      return false;
+    }
+    if (n.count == 1 && n.leaf < 0)
+      return enter(n.first);
+    // Branch j < 0 is the log that ends here; others are children.
+    alarm(0);
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(nullptr);
+    for (int j = n.leaf < 0 ? 0 : -1; j < int(n.count); ++j) {
+      const pid_t pid = fork();
+      if (pid < 0) {
+        perror("fork");
+        _exit(127);
+      }
+      if (!pid) {
+        if (timeout)
+          alarm(timeout);
+        if (j < 0) {
+          ended = true;
+          return false;
+        }
+        return enter(n.first + j);
+      }
+      int status;
+      while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+      const int leaf = j < 0 ? n.leaf : sole_leaf(n.first + j);
+      if (leaf >= 0 && results >= 0) {
+        char line[32];
+        const int len = snprintf(line, sizeof(line), "%d %d\n", leaf, status);
+        if (write(results, line, len) != len)
+          perror("RAMFUZZ_TRIE_RESULTS");
+      }
+    }
+    _exit(0);
+  }
+
+  /// Makes child i of cur the node being read.  Returns true.
+  bool enter(uint32_t i) {
+    path.push_back(i);
+    retraced = path.size();
+    cur = i;
+    entered = false;
+    return true;
+  }
+
+  /// The log whose replay covers the whole subtree at node i, or -1 if the
+  /// subtree branches.
+  int sole_leaf(uint32_t i) const {
+    for (;; i = nodes[i].first) {
+      if (!nodes[i].count)
+        return nodes[i].leaf;
+      if (nodes[i].count > 1 || nodes[i].leaf >= 0)
+        return -1;
+    }
+  }
+
+  const uint64_t *hdr; ///< Magic, node count, log count, data size.
+  const node *nodes;
+  const char *data;
+  size_t mapsize;
+  uint32_t cur = 0;     ///< Node being read.
+  bool entered = false; ///< Whether cur's bytes are in the get area.
+  std::vector<uint32_t> path; ///< Nodes entered below the root, in order.
+  size_t retraced = 0;        ///< How much of path is entered since rewind().
+  bool ended = false;         ///< Whether the log has ended.
+  int results = -1;     ///< RAMFUZZ_TRIE_RESULTS descriptor.
+  unsigned timeout = 0;
+};
+
+/// Writes a log file from a background thread, through a single-producer,
+/// single-consumer ring.  See gen::write_async().
+class async_buf : public std::streambuf {
+public:
+  /// Appends to file fname through a ring of at least size bytes.  Throws
+  /// file_error if fname can't be opened.
+  async_buf(const string &fname, size_t size);
+
+  /// Writes out the rest of the ring and stops the thread.
+  ~async_buf();
+
+  /// Writes out everything in the ring so far; async-signal-safe.  Waits for
+  /// the thread if it's writing.
+  void drain();
+
+protected:
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      const char ch = traits_type::to_char_type(c);
+      put(&ch, 1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    put(s, n);
+    return n;
+  }
+
+private:
+  /// Copies n bytes at s into the ring, waiting for room if it's full.
+  void put(const char *s, size_t n);
+
+  /// Writes out what's in the ring; the caller must hold writing.  Returns
+  /// whether there was anything.
+  bool write_out();
+
+  /// Like write_out(), unless someone else holds writing.
+  bool try_drain();
+
+  int fd;
+  std::vector<char> ring;
+  uint64_t mask;
+  /// Bytes ever put and ever written out; head - tail are in the ring.
+  std::atomic<uint64_t> head{0}, tail{0};
+  /// Held by whoever is writing out; the thread, drain(), or the destructor.
+  std::atomic<bool> writing{false};
+  std::atomic<bool> stop{false};
+  bool failed = false;
+  std::thread writer;
+};
+
+/// A slot in the list of live async_bufs, which are drained at exit and on
+/// fatal signals.  Slots are reused but never freed, and a slot's next never
+/// changes once it's in the list, so the signal handler can walk the list
+/// without locks.
+struct live_slot {
+  std::atomic<async_buf *> buf{nullptr};
+  live_slot *next = nullptr;
+};
+
+std::atomic<live_slot *> live_bufs{nullptr};
+
+/// Puts b in a free slot, adding one if there's none.
+void add_live(async_buf *b) {
+  for (auto s = live_bufs.load(); s; s = s->next) {
+    async_buf *none = nullptr;
+    if (s->buf.compare_exchange_strong(none, b))
+      return;
+  }
+  const auto s = new live_slot;
+  s->buf.store(b);
+  s->next = live_bufs.load();
+  while (!live_bufs.compare_exchange_weak(s->next, s))
+    ;
+}
+
+void remove_live(async_buf *b) {
+  for (auto s = live_bufs.load(); s; s = s->next) {
+    async_buf *self = b;
+    if (s->buf.compare_exchange_strong(self, nullptr))
+      return;
+  }
+}
+
+/// Signals that drain live_bufs before killing the process, and their
+/// original handlers.
+const int fatal_signals[] = {SIGSEGV, SIGBUS,  SIGILL, SIGFPE,
+                             SIGABRT, SIGTERM, SIGINT, SIGALRM};
+
+void drain_live_bufs() {
+  for (auto s = live_bufs.load(); s; s = s->next)
+    if (auto p = s->buf.load())
+      p->drain();
+}
+
+void drain_and_die(int sig) {
+  drain_live_bufs();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/// Arranges for drain_live_bufs() at exit and on those fatal signals whose
+/// handling is at the default.  Once per process.
+void install_drainers() {
+  static bool installed = false;
+  if (installed)
+    return;
+  installed = true;
+  std::atexit(drain_live_bufs);
+  for (const int sig : fatal_signals) {
+    struct sigaction old;
+    if (sigaction(sig, nullptr, &old) || old.sa_handler != SIG_DFL ||
+        (old.sa_flags & SA_SIGINFO))
+      continue;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = drain_and_die;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, nullptr);
+  }
+}
+
+async_buf::async_buf(const string &fname, size_t size) {
+  size_t cap = 4096;
+  while (cap < size)
+    cap *= 2;
+  ring.resize(cap);
+  mask = cap - 1;
+  fd = open(fname.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666);
+  if (fd < 0)
+    throw file_error("Cannot open " + fname);
+  install_drainers();
+  add_live(this);
+  writer = std::thread([this] {
+    while (!stop.load(std::memory_order_acquire))
+      if (!try_drain())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  });
+}
+
+async_buf::~async_buf() {
+  stop.store(true, std::memory_order_release);
+  writer.join();
+  remove_live(this);
+  drain();
+  close(fd);
+}
+
+void async_buf::put(const char *s, size_t n) {
+  for (size_t k; n; s += k, n -= k) {
+    k = std::min(n, ring.size());
+    const auto h = head.load(std::memory_order_relaxed);
+    while (ring.size() - (h - tail.load(std::memory_order_acquire)) < k)
+      std::this_thread::yield();
+    const size_t at = h & mask, first = std::min(k, ring.size() - at);
+    memcpy(&ring[at], s, first);
+    memcpy(&ring[0], s + first, k - first);
+    head.store(h + k, std::memory_order_release);
+  }
+}
+
+bool async_buf::write_out() {
+  const auto t = tail.load(std::memory_order_relaxed),
+             h = head.load(std::memory_order_acquire);
+  for (auto from = t; from < h && !failed;) {
+    const size_t at = from & mask, len = std::min(h - from, ring.size() - at);
+    const auto n = ::write(fd, &ring[at], len);
+    if (n > 0)
+      from += n;
+    else if (n < 0 && errno != EINTR) {
+      // Drop the rest, so the fuzz thread never waits on a dead log.
+      failed = true;
+      static const char msg[] = "ramfuzz: cannot write the log\n";
+      if (::write(2, msg, sizeof(msg) - 1) < 0)
+        break;
+    }
+  }
+  tail.store(h, std::memory_order_release);
+  return h != t;
+}
+
+bool async_buf::try_drain() {
+  if (writing.exchange(true, std::memory_order_acquire))
+    return false;
+  const bool any = write_out();
+  writing.store(false, std::memory_order_release);
+  return any;
+}
+
+void async_buf::drain() {
+  // The thread holds writing for one batch at most; if it never lets go (say,
+  // it's the thread that crashed), go ahead anyway.
+  for (int spins = 0;
+       writing.exchange(true, std::memory_order_acquire) && spins < 1000000;
+       ++spins)
+    sched_yield();
+  write_out();
+  writing.store(false, std::memory_order_release);
+}
+
+/// Reads a part of a log held in memory.
+class span_buf : public std::streambuf {
+public:
+  explicit span_buf(const string &s) {
+    char *p = const_cast<char *>(s.data());
+    setg(p, p, p + s.size());
+  }
+};
+
+/// Whether the metadata records at the start of the log f reads, before its
+/// first value, mark it as a stream log.
+bool stream_log(istream &f) {
+  for (int ty = f.get(); ty >= meta_tag; ty = f.get()) {
+    if (ty == stream_tag)
+      return true;
+    uint32_t len = 0;
+    f.read(reinterpret_cast<char *>(&len), sizeof(len));
+    f.ignore(len);
+  }
+  return false;
+}
+
+/// Reads a file of location IDs, one per line.  Throws file_error if it can't
+/// be read.
+std::unordered_set<size_t> read_ids(const char *fname) {
+  ifstream f(fname);
+  if (!f)
+    throw file_error(string("Cannot open ") + fname);
+  std::unordered_set<size_t> ids;
+  size_t id;
+  while (f >> id)
+    ids.insert(id);
+  if (!f.eof())
+    throw file_error(string("Bad location ID in ") + fname);
+  return ids;
+}
+
+} // anonymous namespace
+
+gen::gen(const string &ologname) : runmode(generate), base_pc(get_pc()) {
+  open_output(ologname);
+  add_env_sinks();
 }
 
 gen::gen(const string &ilogname, const string &ologname)
-    : runmode(replay), olog(ologname), ilog(ilogname), base_pc(get_pc()) {
-  if (!olog)
-    throw file_error("Cannot open " + ologname);
-  if (!ilog)
-    throw file_error("Cannot open " + ilogname);
+    : runmode(replay), base_pc(get_pc()) {
+  open_output(ologname);
+  open_input(ilogname);
+  if (streams)
+    split_streams();
+  add_env_sinks();
 }
 
 gen::gen(int argc, const char *const *argv, size_t k) : base_pc(get_pc()) {
   if (k < static_cast<size_t>(argc) && argv[k]) {
     runmode = replay;
     const string argstr(argv[k]);
-    ilog.open(argstr);
-    if (!ilog)
-      throw file_error("Cannot open " + argstr);
-    olog.open(argstr + "+");
-    if (!olog)
-      throw file_error("Cannot open " + argstr + "+");
+    if (!open_input(argstr))
+      open_output(argstr + "+");
+    if (streams)
+      split_streams();
   } else {
     runmode = generate;
-    olog.open("fuzzlog");
-    if (!olog)
-      throw file_error("Cannot open fuzzlog");
+    open_output("fuzzlog");
+  }
+  add_env_sinks();
+}
+
+gen::gen(shared_ptr<log_sink> sink) : runmode(generate), base_pc(get_pc()) {
+  add_sink(std::move(sink));
+  add_env_sinks();
+}
+
+void gen::open_output(const string &fname) {
+  auto fb = new std::filebuf;
+  obuf.reset(fb);
+  if (!fb->open(fname, std::ios::out | std::ios::binary))
+    throw file_error("Cannot open " + fname);
+  olog.rdbuf(fb);
+  oname = fname;
+}
+
+bool gen::open_input(const string &fname) {
+  uint64_t magic = 0;
+  ifstream f(fname, std::ios::binary);
+  f.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+  const bool trie = magic == trie_magic;
+  if (trie) {
+    // A trie can't seek, but it can start this process's log over.
+    auto tb = new trie_buf(fname);
+    ibuf.reset(tb);
+    ilog.rdbuf(tb);
+    streams = stream_log(ilog);
+    tb->rewind();
+    ilog.clear();
+  } else {
+    f.clear();
+    streams = stream_log(f.seekg(0));
+    auto fb = new std::filebuf;
+    ibuf.reset(fb);
+    if (!fb->open(fname, std::ios::in | std::ios::binary))
+      throw file_error("Cannot open " + fname);
   }
+  ilog.rdbuf(ibuf.get());
+  return trie;
 }
 
-size_t gen::valueid() {
+void gen::add_env_sinks() {
+  if (const char *name = getenv("RAMFUZZ_SHM"))
+    add_sink(std::make_shared<shm_sink>(name));
+  if (const char *mib = getenv("RAMFUZZ_ASYNC_LOG"))
+    write_async(size_t(atoi(mib)) << 20);
+  if (const char *name = getenv("RAMFUZZ_GUIDANCE"))
+    guide(name);
+  if (const char *name = getenv("RAMFUZZ_CONSTRAINTS"))
+    constrain(name);
+  if (const char *name = getenv("RAMFUZZ_DISTRIBUTIONS")) {
+    const char *exploration = getenv("RAMFUZZ_EXPLORATION");
+    sample_from(name, exploration ? atof(exploration) : 0.1);
+  }
+  if (const char *s = getenv("RAMFUZZ_STREAMS"))
+    if (!strcmp(s, "1"))
+      use_streams();
+  if (const char *name = getenv("RAMFUZZ_LOG_SITES"))
+    filter_sites(read_ids(name), true);
+  else if (const char *name = getenv("RAMFUZZ_SKIP_SITES"))
+    filter_sites(read_ids(name), false);
+  if (const char *ids = getenv("RAMFUZZ_SOURCE_IDS"))
+    if (!strcmp(ids, "1"))
+      use_source_ids();
+  if (const char *name = getenv("RAMFUZZ_MODEL")) {
+    const char *threshold = getenv("RAMFUZZ_MODEL_THRESHOLD");
+    predict(name, threshold ? atof(threshold) : 0.95);
+  }
+}
+
+void gen::abandon() {
+  olog.flush();
+  sinks.clear(); // Lets shm_sink publish the end of the run.
+  std::exit(predicted_failure_exit);
+}
+
+void gen::desync(int found, char wanted) {
+  if (found == std::char_traits<char>::eof())
+    std::cerr << "ramfuzz: replay desync: the log ended, but the program wants "
+              << "a value of type " << int(wanted) << std::endl;
+  else
+    std::cerr << "ramfuzz: replay desync: the log has a value of type " << found
+              << " where the program wants type " << int(wanted) << std::endl;
+  olog.flush();
+  sinks.clear();
+  std::exit(replay_desync_exit);
+}
+
+void gen::guide(const string &fname) {
+  guide_name = fname;
+  guidebook.reset();
+  refresh_guidance();
+}
+
+void gen::refresh_guidance() {
+  since_refresh = 0;
+  const auto st = guidance::stamp(guide_name);
+  if (st == std::make_pair(uint64_t(0), int64_t(0)))
+    return; // Keep the old guidance until a new one is published.
+  if (!guidebook || guidebook->stamp() != st)
+    guidebook.reset(new guidance(guide_name));
+}
+
+void gen::emit(const char *rec, size_t len, location loc) {
+  if (olog.rdbuf()) {
+    if (leave_out(loc.id)) {
+      if (++skipped == numeric_limits<uint32_t>::max())
+        log_skips();
+    } else {
+      log_stream();
+      log_skips();
+      // One write per record: with write_async(), each is a ring copy.
+      const auto vlen = len - 1 - sizeof(size_t);
+      char out[1 + sizeof(uint64_t) + sizeof(loc.node)];
+      out[0] = rec[0] | compact_flag;
+      memcpy(out + 1, rec + 1, vlen);
+      memcpy(out + 1 + vlen, &loc.node, sizeof(loc.node));
+      olog.write(out, 1 + vlen + sizeof(loc.node));
+      olog.flush();
+    }
+  }
+  for (const auto &s : sinks)
+    s->write(rec, len);
+}
+
+void gen::log_skips() {
+  if (!skipped)
+    return;
+  log_stream();
+  emit_meta(skip_tag, string(reinterpret_cast<const char *>(&skipped),
+                             sizeof(skipped)));
+  skipped = 0;
+}
+
+int gen::read_meta(int ty) {
+  for (;; ty = skips ? left_out : ilog.get()) {
+    if (ty == left_out) {
+      --skips;
+      return left_out;
+    }
+    if (ty == std::char_traits<char>::eof())
+      return seeded ? left_out : ty;
+    if (ty < meta_tag)
+      return ty;
+    uint32_t len = 0;
+    ilog.read(reinterpret_cast<char *>(&len), sizeof(len));
+    uint64_t seed;
+    if (ty == seed_tag && len == sizeof(seed)) {
+      ilog.read(reinterpret_cast<char *>(&seed), sizeof(seed));
+      rgen.seed(seed);
+      seeded = true;
+    } else if (ty == skip_tag && len == sizeof(skips))
+      ilog.read(reinterpret_cast<char *>(&skips), sizeof(skips));
+    else
+      ilog.ignore(len);
+  }
+}
+
+void gen::filter_sites(std::unordered_set<size_t> ids, bool allow) {
+  site_filter = std::move(ids);
+  filter_allows = allow;
+  if (runmode != generate)
+    return;
+  filtering = true;
+  if (!seeded)
+    seed_run(std::random_device{}());
+}
+
+void gen::write_async(size_t ring_size) {
+  if (!olog.rdbuf() || dynamic_cast<async_buf *>(obuf.get()))
+    return;
+  olog.flush();
+  obuf.reset(new async_buf(oname, ring_size));
+  olog.rdbuf(obuf.get());
+}
+
+void gen::use_streams() {
+  if (runmode != generate || streams)
+    return;
+  streams = true;
+  log_stream();
+  seed_run(std::random_device{}());
+}
+
+void gen::seed_run(uint64_t seed) {
+  run_seed = seed;
+  seeded = true;
+  if (streams)
+    seed_stream();
+  else
+    rgen.seed(seed);
+  if (olog.rdbuf())
+    emit_meta(seed_tag,
+              string(reinterpret_cast<const char *>(&seed), sizeof(seed)));
+}
+
+void gen::seed_stream() {
+  std::seed_seq s{uint32_t(run_seed), uint32_t(run_seed >> 32),
+                  uint32_t(stream_id), uint32_t(stream_id >> 32)};
+  rgen.seed(s);
+}
+
+void gen::open_stream() {
+  const uint64_t id = cct_id(stream_id, ++stream_kids);
+  outer_streams.push_back(stream{stream_id, stream_kids, skipped, skips, rgen,
+                                 std::move(stream_buf)});
+  stream_id = id;
+  stream_kids = 0;
+  skipped = skips = 0;
+  seed_stream();
+  if (runmode == replay) {
+    static const string none;
+    const auto it = logged_streams.find(id);
+    stream_buf.reset(
+        new span_buf(it == logged_streams.end() ? none : it->second));
+    ilog.rdbuf(stream_buf.get());
+  }
+}
+
+void gen::close_stream() {
+  auto &s = outer_streams.back();
+  stream_id = s.id;
+  stream_kids = s.kids;
+  skipped = s.skipped;
+  skips = s.skips;
+  rgen = s.rgen;
+  stream_buf = std::move(s.buf);
+  outer_streams.pop_back();
+  if (runmode == replay)
+    ilog.rdbuf(stream_buf.get());
+}
+
+void gen::split_streams() {
+  const string log((std::istreambuf_iterator<char>(ilog)),
+                   std::istreambuf_iterator<char>());
+  uint64_t cur = 0;
+  for (size_t at = 0, len; at < log.size(); at += len) {
+    const unsigned char ty = log[at];
+    if (ty < meta_tag) {
+      const auto vlen = value_size(ty & ~compact_flag);
+      // Past an unknown tag, the rest goes to the current stream, whose
+      // replay then desyncs on it.
+      len = vlen ? 1 + vlen + (ty & compact_flag ? sizeof(uint32_t)
+                                                  : sizeof(uint64_t))
+                 : log.size() - at;
+    } else {
+      uint32_t body = 0;
+      memcpy(&body, &log[at + 1], std::min(sizeof(body), log.size() - at - 1));
+      len = 1 + sizeof(body) + body;
+      if (ty == stream_tag && body == sizeof(cur) && at + len <= log.size())
+        memcpy(&cur, &log[at + 1 + sizeof(body)], sizeof(cur));
+      else if (ty == seed_tag && body == sizeof(run_seed) &&
+               at + len <= log.size()) {
+        memcpy(&run_seed, &log[at + 1 + sizeof(body)], sizeof(run_seed));
+        seeded = true;
+      }
+      if (ty != skip_tag)
+        continue;
+    }
+    logged_streams[cur].append(log, at, len);
+  }
+  // Start the output log as use_streams() does.
+  log_stream();
+  seed_run(seeded ? run_seed : std::random_device{}());
+  stream_buf.reset(new span_buf(logged_streams[0]));
+  ilog.rdbuf(stream_buf.get());
+  ibuf.reset();
+}
+
+void gen::log_stream() {
+  if (!streams || logged_stream == stream_id || !olog.rdbuf())
+    return;
+  emit_meta(stream_tag, string(reinterpret_cast<const char *>(&stream_id),
+                               sizeof(stream_id)));
+  logged_stream = stream_id;
+}
+
+void gen::emit_meta(unsigned char tag, const string &body) {
+  const uint32_t len = body.size();
+  olog.put(tag);
+  olog.write(reinterpret_cast<const char *>(&len), sizeof(len));
+  olog << body;
+}
+
+gen::location gen::valueid() {
   CURSORINIT(ctx, curs);
-  size_t stacktrace_hash = 0; // "Stack trace" = a vector of all callers' PCs.
+  frames.clear();
   while (unw_step(&curs)) {
     unw_word_t pc;
     unw_get_reg(&curs, UNW_REG_IP, &pc);
-    // Cribbed from boost::hash_combine().
-    stacktrace_hash ^= pc - base_pc + 0x9e3779b9 + (stacktrace_hash << 6) +
-                       (stacktrace_hash >> 2);
+    frames.push_back(pc - base_pc);
     // On some machines, main's caller has an unstable memory location.
     if (name_is(&curs, "main"))
       break;
   }
-  return stacktrace_hash;
+  location loc{0, 0};
+  for (auto f = frames.rbegin(); f != frames.rend(); ++f)
+    loc = child(loc, *f);
+  return loc;
+}
+
+gen::location gen::child(location parent, uint64_t site) {
+  const uint32_t next = cct_ids.size();
+  const auto ins = cct.insert({cct_key{parent.node, site}, next});
+  if (ins.second) {
+    cct_ids.push_back(cct_id(parent.id, site));
+    if (olog.rdbuf()) {
+      const auto module =
+          next == 1 && !source_ids ? module_record(base_pc) : string();
+      if (!module.empty())
+        emit_meta(module_tag, module);
+      string body(sizeof(parent.node) + sizeof(site), '\0');
+      memcpy(&body[0], &parent.node, sizeof(parent.node));
+      memcpy(&body[sizeof(parent.node)], &site, sizeof(site));
+      emit_meta(cct_tag, body);
+    }
+  }
+  return location{cct_ids[ins.first->second], ins.first->second};
+}
+
+gen::location gen::child(location parent, const call_site &here) {
+  if (here.file != hashed_file) {
+    hashed_file = here.file;
+    file_hash = call_site::file_hash(here.file);
+  }
+  const uint64_t site = here.site(file_hash);
+  if (olog.rdbuf() && named_sites.insert(site).second) {
+    string body(reinterpret_cast<const char *>(&site), sizeof(site));
+    body += string(here.function) + " (" + here.file + ":" +
+            std::to_string(here.line) + ")";
+    emit_meta(source_tag, body);
+  }
+  return child(parent, site);
 }
 
 template <> bool gen::uniform_random<bool>(bool lo, bool hi) {
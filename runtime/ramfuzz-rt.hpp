@@ -16,12 +16,15 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <exception>
 #include <fstream>
 #include <functional>
 #include <limits>
+#include <memory>
 #include <ostream>
 #include <random>
 #include <sstream>
@@ -29,6 +32,7 @@
 #include <type_traits>
 #include <typeindex>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -86,6 +90,305 @@ struct file_error : public std::runtime_error {
 /// Returns T's type tag to put into RamFuzz logs.
 template <typename T> char typetag(T);
 
+/// A type tag with this bit set marks a value record whose location is given
+/// as a 32-bit calling-context-tree node rather than a 64-bit ID.  See gen.
+constexpr char compact_flag = 0x20;
+
+/// Tags from this one up mark metadata records rather than values.  See gen.
+constexpr unsigned char meta_tag = 0x40;
+
+/// Metadata record defining a calling-context-tree node.  See gen.
+constexpr unsigned char cct_tag = meta_tag;
+
+/// Metadata record describing the binary that call sites are in.  See gen.
+constexpr unsigned char module_tag = meta_tag + 1;
+
+/// Metadata record naming a source-position call site.  See gen.
+constexpr unsigned char source_tag = meta_tag + 2;
+
+/// Metadata record giving the random seed of a sparse log.  See gen.
+constexpr unsigned char seed_tag = meta_tag + 3;
+
+/// Metadata record counting values a sparse log left out.  See gen.
+constexpr unsigned char skip_tag = meta_tag + 4;
+
+/// Metadata record switching the log to another stream.  See gen.
+constexpr unsigned char stream_tag = meta_tag + 5;
+
+/// Location ID of the CCT node for call site site under the node with ID
+/// parent_id.  See gen.
+inline uint64_t cct_id(uint64_t parent_id, uint64_t site) {
+  // Cribbed from boost::hash_combine().
+  return parent_id ^
+         (site + 0x9e3779b9 + (parent_id << 6) + (parent_id >> 2));
+}
+
+/// FNV-1a hash of the null-terminated string s, continuing from hash h.
+constexpr uint64_t fnv1a(const char *s, uint64_t h = 0xcbf29ce484222325) {
+  return *s ? fnv1a(s + 1, (h ^ static_cast<unsigned char>(*s)) *
+                               0x100000001b3)
+            : h;
+}
+
+/// The part of path s after its last slash, or last if there's no slash.
+constexpr const char *path_tail(const char *s, const char *last) {
+  return *s ? path_tail(s + 1, *s == '/' ? s + 1 : last) : last;
+}
+
+/// A position in the source code, from which a gen method was called.  gen's
+/// methods capture their caller's position in defaulted trailing arguments;
+/// see gen::use_source_ids().
+struct call_site {
+  const char *file;
+  unsigned line;
+  const char *function;
+
+  constexpr call_site(const char *file, unsigned line, const char *function)
+      : file(file), line(line), function(function) {}
+
+  /// Hash of file's name without the directory, so it doesn't change with the
+  /// build directory.
+  static constexpr uint64_t file_hash(const char *file) {
+    return fnv1a(path_tail(file, file));
+  }
+
+  /// Identifies the site, given file_hash(file): a hash of its file name and
+  /// line.  Left to the caller, so it costs nothing unless it's needed.
+  constexpr uint64_t site(uint64_t fhash) const {
+    return fhash ^ (line * 0x9e3779b97f4a7c15 + 0x9e3779b9);
+  }
+};
+
+/// Receives a copy of every value a gen logs.  See gen::add_sink().
+class log_sink {
+public:
+  virtual ~log_sink() = default;
+
+  /// Receives one value record, encoded as in the log file but always with a
+  /// full 64-bit location ID (never with compact_flag).
+  virtual void write(const char *rec, size_t len) = 0;
+};
+
+/// Publishes log records into a shared-memory ring buffer, where another
+/// process can consume them as they're generated, without going through log
+/// files.  Many processes (each with its own shm_sink) can publish into the
+/// same ring at the same time; there must be exactly one consumer.  See
+/// ramfuzz.shm_create() and ramfuzz.shm_read() in ../pymod, as well as
+/// shm_batches() and shm_runs() in ../ai/rfutils.py.
+///
+/// The ring is a POSIX shared-memory object created by the consumer.  Each of
+/// its slots holds a publisher's pid, a slot kind, a type tag, a location ID,
+/// and a value (converted to double).  Slot kinds are: 0 for a logged value, 1
+/// for the beginning of a run (published when the shm_sink is created), 2 for
+/// the end of a run (published when the shm_sink is destroyed), and 3 for a
+/// run's outcome.  Outcomes are published by whoever runs the test and learns
+/// its exit status (eg, ../ai/gencorp.py); their value is the exit status, or
+/// minus the signal number that killed the test.
+///
+/// When the ring is full, publishing waits for the consumer to make room.
+class shm_sink : public log_sink {
+public:
+  /// Attaches to the ring named name (as in shm_open()).  Throws file_error if
+  /// the ring doesn't exist.
+  explicit shm_sink(const std::string &name);
+  ~shm_sink();
+  shm_sink(const shm_sink &) = delete;
+  shm_sink &operator=(const shm_sink &) = delete;
+
+  void write(const char *rec, size_t len) override;
+
+private:
+  void publish(unsigned char kind, char tag, size_t id, double value);
+
+  struct ring;
+  ring *r;
+  size_t mapsize;
+};
+
+/// Advice on where to generate values, read from a file (typically written by
+/// ../ai/feedback.py while tests run).  For a location ID, the advice is a
+/// range [lo, hi] that values generated there should fall in, and a weight: the
+/// probability of following the advice rather than ignoring it.
+///
+/// The file is memory-mapped.  It starts with four 64-bit words: the magic
+/// number 0x3165646975676672 ("rfguide1"), a version number, the advice count,
+/// and a reserved word.  Then come the advice entries (see advice), sorted by
+/// ID.  All numbers are little-endian.
+class guidance {
+public:
+  /// Advice for one location.
+  struct advice {
+    uint64_t id;
+    double lo, hi, weight;
+  };
+
+  /// Maps the file named fname.  Throws file_error if it can't be read or
+  /// isn't a guidance file.
+  explicit guidance(const std::string &fname);
+  ~guidance();
+  guidance(const guidance &) = delete;
+  guidance &operator=(const guidance &) = delete;
+
+  /// Returns the advice for location id, or nullptr if there is none.
+  const advice *find(uint64_t id) const;
+
+  /// The version recorded in the file.
+  uint64_t version() const { return hdr[1]; }
+
+  /// Identifies the file's contents: changes whenever the file is replaced.
+  /// Can be compared to stamp(fname) to see if the file is stale.
+  std::pair<uint64_t, int64_t> stamp() const { return st; }
+
+  /// Returns the stamp of the file currently named fname, or (0, 0) if there's
+  /// no such file.
+  static std::pair<uint64_t, int64_t> stamp(const std::string &fname);
+
+private:
+  const uint64_t *hdr;
+  const advice *begin, *end;
+  size_t mapsize;
+  std::pair<uint64_t, int64_t> st; ///< Inode and modification time.
+};
+
+/// A system of linear inequalities over values at different locations, which
+/// generated values are kept within.  Each inequality has the form
+///
+///   a1*x1 + a2*x2 + ... + an*xn <= b
+///
+/// where xi is the (latest) value generated at location IDi.  As values are
+/// generated, they're substituted into the inequalities, yielding bounds on the
+/// values not generated yet.  Undetermined values are accounted for by their
+/// own bounds, where known, so bounds are never tighter than the inequalities
+/// require.
+///
+/// The inequalities are read from a text file with one inequality per line:
+/// coefficient/ID pairs, then "<=" or ">=", then the bound, eg:
+///
+///   3 1234 -2 5678 <= 10
+///
+/// Empty lines and lines starting with # are ignored.  Inequalities with a
+/// single location become bounds on that location's values.  Duplicate and
+/// dominated inequalities are pruned, as are those that the single-location
+/// bounds already imply.
+class constraints {
+public:
+  /// Reads inequalities from file fname.  Throws file_error if it can't be
+  /// read or parsed.
+  explicit constraints(const std::string &fname);
+
+  /// Bounds [lo, hi] on the next value at location id, given the values
+  /// assign()ed so far.  Either bound may be infinite.
+  std::pair<double, double> bounds(uint64_t id) const;
+
+  /// Records that val was generated at location id.
+  void assign(uint64_t id, double val);
+
+  /// How many inequalities are left after pruning (not counting
+  /// single-location bounds).
+  size_t size() const { return ineqs.size(); }
+
+private:
+  /// A location's bounds, latest value, and appearances in inequalities.
+  struct site {
+    double lo = -std::numeric_limits<double>::infinity();
+    double hi = std::numeric_limits<double>::infinity();
+    bool known = false;
+    double val = 0.;
+    /// (Inequality index, coefficient) for each term with this location.
+    std::vector<std::pair<size_t, double>> terms;
+
+    /// Least possible value of coef*x.
+    double least(double coef) const {
+      return known ? coef * val : coef > 0 ? coef * lo : coef * hi;
+    }
+  };
+
+  /// An inequality's bound, along with partial sums over its terms' least()
+  /// values, maintained incrementally.
+  struct ineq {
+    double bound;
+    double finite_sum = 0.; ///< Sum of finite least() values.
+    unsigned infinite = 0;  ///< How many least() values are -infinity.
+  };
+
+  void add_term(ineq &q, double least);
+  void remove_term(ineq &q, double least);
+
+  std::unordered_map<uint64_t, site> sites;
+  std::vector<ineq> ineqs;
+};
+
+/// Empirical distributions of values at each location, which gen can sample
+/// from instead of drawing uniformly (see gen::sample_from()).  Read from a
+/// memory-mapped file written by ../tools/dists.cpp.
+///
+/// A location's distribution is a list of entries, each a range [lo, hi] (a
+/// single value when lo == hi) with a probability.  The probabilities are
+/// stored as an alias table, so picking an entry takes constant time.
+///
+/// The file starts with four 64-bit words: the magic number 0x3173747369646672
+/// ("rfdists1"), a reserved word, the location count, and the entry count.
+/// Then come the locations (see site), sorted by ID, and the entries (see
+/// entry).  All numbers are little-endian.
+class value_table {
+public:
+  /// A location and its entries' positions in the entry array.
+  struct site {
+    uint64_t id;
+    uint32_t first, count;
+  };
+
+  /// An alias-table column: it holds this entry's range with probability
+  /// prob, and entry alias (in the same location) otherwise.
+  struct entry {
+    double lo, hi, prob;
+    uint32_t alias, pad;
+  };
+
+  /// Maps the file named fname.  Throws file_error if it can't be read or
+  /// isn't a value table.
+  explicit value_table(const std::string &fname);
+  ~value_table();
+  value_table(const value_table &) = delete;
+  value_table &operator=(const value_table &) = delete;
+
+  /// Picks a range from location id's distribution, using a random number u in
+  /// [0, 1).  Returns nullptr if id has no distribution.
+  const entry *pick(uint64_t id, double u) const;
+
+private:
+  const uint64_t *hdr;
+  const site *sites;
+  const entry *entries;
+  size_t mapsize;
+};
+
+/// A linear model of test failure, scored incrementally as values are
+/// generated.  Each (location, value bucket) pair has a weight, where the
+/// bucket is 0 for zero and otherwise the value's sign times (1 + the number of
+/// bits in its integral part).  A run's failure probability is the logistic
+/// sigmoid of the bias plus the weights of all the values generated so far.
+///
+/// The model is read from a text file (typically written by
+/// ../ai/failmodel.py): a line "bias <b>" and lines "<location> <bucket>
+/// <weight>".  Empty lines and lines starting with # are ignored.
+class failure_model {
+public:
+  /// Reads the model from file fname.  Throws file_error if it can't be read
+  /// or parsed.
+  explicit failure_model(const std::string &fname);
+
+  /// Accounts for value val generated at location id.  Returns the updated
+  /// failure probability.
+  double add(uint64_t id, double val);
+
+private:
+  double score = 0.; ///< Bias plus all weights added so far.
+
+  /// Weights by location, then by bucket.
+  std::unordered_map<uint64_t, std::vector<std::pair<int, double>>> weights;
+};
+
 /// Generates values for RamFuzz code.  Can be used in the "generate" or
 /// "replay" mode.  In "generate" mode, values are created at random and logged.
 /// In "replay" mode, values are read from a previously generated log.  This
@@ -106,6 +409,37 @@ template <typename T> char typetag(T);
 /// which the value is generated.  Different program runs may generate different
 /// values at the same location; this is useful for AI analysis of the logs and
 /// program outcomes.
+///
+/// A location is a path in the calling-context tree (CCT) of the run: the
+/// root is above main(), and each node is a call site (its PC relative to the
+/// runtime's) under its caller's node.  With use_source_ids(), call sites are
+/// source positions instead; see there.  The log holds three kinds of records,
+/// all starting with a one-byte tag:
+/// - a metadata record: a tag of at least meta_tag, a 32-bit body length, and
+///   the body.  Readers skip tags they don't know.  A cct_tag record defines
+///   the next CCT node (nodes are numbered 1, 2, ... in the order they're
+///   defined; the root is 0): its body is the parent node (32 bits) and the
+///   call site (64 bits).  Each node is defined once, before its first use.
+///   A module_tag record, before the first node, describes the binary the
+///   call sites are in: the virtual address (64 bits) in the binary that sites
+///   are relative to, the length (32 bits) and bytes of the binary's build ID,
+///   and the binary's path.  With it, ../tools/symbolize.cpp turns call sites
+///   into source locations offline.  A source_tag record, before the first
+///   node with a source-position call site, names the site: its body is the
+///   site (64 bits) and text like "function (file:line)".  A seed_tag record,
+///   first in the log, gives the random seed (64 bits) of a sparse log (see
+///   filter_sites()) or a stream log (see use_streams()); a skip_tag record
+///   in a sparse log counts (in 32 bits) the values left out just before the
+///   next value record of the same stream.  In a stream log, a stream_tag
+///   record makes the value and skip_tag records after it, up to the next
+///   stream_tag record, belong to the stream whose ID (64 bits) is its body;
+/// - a compact value record: typetag() | compact_flag, the value, and the
+///   value's CCT node (32 bits).  gen writes only these;
+/// - a full value record: typetag(), the value, and its 64-bit location ID.
+///   These are what sinks receive, and older logs hold.
+/// All numbers are in host byte order.  A node's ID is
+/// cct_id(parent's ID, site), where the root's ID is 0, so readers turn nodes
+/// into IDs as they go.
 class gen {
   /// Are we generating values or replaying a previous run?
   enum { generate, replay } runmode;
@@ -125,21 +459,204 @@ public:
   /// This makes it convenient for main(argc, argv) to invoke gen(argc, argv),
   /// yielding a program that either generates its values (if no command-line
   /// arguments) or replays the log file named by its first argument.
+  ///
+  /// If argv[k] is a trie of many logs (see ../tools/trie.cpp), all of them are
+  /// replayed: the program forks wherever the logs diverge, so each shared
+  /// prefix is replayed only once.  Nothing is logged in that case.  A process
+  /// that forked waits for its children and exits with status 0 instead of
+  /// returning; the outcome of each log's replay is appended to the file named
+  /// by the environment variable RAMFUZZ_TRIE_RESULTS, as a line "<log index>
+  /// <wait status>".  If RAMFUZZ_TRIE_TIMEOUT is set, each replay is killed
+  /// after that many seconds.
   gen(int argc, const char *const *argv, size_t k = 1);
 
+  /// Values will be generated and logged only into sink, not into any file.
+  explicit gen(std::shared_ptr<log_sink> sink);
+
+  /// Identifies values' locations by the source positions of gen calls rather
+  /// than by unwinding the stack.  Call before generating any values.
+  ///
+  /// make<T>() and between() capture the position they're called from in
+  /// defaulted trailing arguments, so both hand-written and generated tests
+  /// get such positions for free; make<T>(allow_subclass) doesn't, but
+  /// make<T>(allow_subclass, here) takes one explicitly.  A value's CCT node is
+  /// its between() call's position, under the node of the innermost
+  /// position-taking make() call in progress, whose node is its position under
+  /// the one enclosing it, and so on up to the root.  This costs a hash
+  /// lookup instead of a stack unwind per value, and locations survive
+  /// rebuilds unless the calls' lines move.  But calls from the same line of a
+  /// helper function share a location, however the helper was reached, unless
+  /// a make() call sets them apart.
+  ///
+  /// All constructors call this if the environment variable RAMFUZZ_SOURCE_IDS
+  /// is set to 1.
+  void use_source_ids() { source_ids = true; }
+
+  /// Logs only the values whose location IDs are in ids (if allow is true) or
+  /// aren't (if it's false).  For campaigns that only care about a few
+  /// locations, this cuts the log many times over.  Call before generating
+  /// any values; no effect in replay mode.  Sinks still get every value.
+  ///
+  /// The log stays replayable: it starts with the random seed, and each run of
+  /// left-out values is logged as its length.  A replay draws every value from
+  /// a generator seeded the same way, and takes the logged ones from the log,
+  /// so the left-out values come out just as they were generated, as long as
+  /// the replay uses the same guidance, constraints, and distributions (if
+  /// any) and the logged values still lead down the same path.  After the end
+  /// of the log, the replay goes on generating values.  Each run of left-out
+  /// values costs a 9-byte record, so leaving out values that alternate with
+  /// logged ones one by one makes the log bigger, not smaller.
+  ///
+  /// All constructors call this if the environment variable RAMFUZZ_LOG_SITES
+  /// (for allow = true) or RAMFUZZ_SKIP_SITES (for allow = false) names a file
+  /// of location IDs, one per line; they throw file_error if it can't be read.
+  void filter_sites(std::unordered_set<size_t> ids, bool allow);
+
+  /// Partitions the log into streams, so that changing some values of one
+  /// object in the log leaves the values of all the other objects valid.
+  /// Call before generating any values or calling filter_sites(); no effect in
+  /// replay mode, where the log decides.
+  ///
+  /// Without streams, a replay takes values from the log in order: once a
+  /// changed value makes the program take one value more or less than before
+  /// (a different spin count, say), every later value lands on the wrong
+  /// site.  With streams, every make() that creates a new object of class type
+  /// (containers and strings included) or a C string opens a child of the
+  /// current stream, which holds the values generated until that make()
+  /// returns.  Scalars stay in the stream they're made in, as a stream costs
+  /// two metadata records on top of its values.  A stream's ID depends only
+  /// on its parent's ID and on how many children the parent opened before it,
+  /// and a replay takes each stream's values from that stream's part of the
+  /// log.  So a change inside one object's stream moves nothing in the streams
+  /// of objects made before, after, or around it.
+  ///
+  /// Each stream also draws from its own random generator, seeded from the
+  /// log's seed and the stream's ID, and a replay draws every value (like that
+  /// of a sparse log; see filter_sites()).  When a replay wants more values
+  /// from a stream than the log holds (or a stream the log doesn't have), it
+  /// generates them, and the same ones on every replay of that log.
+  ///
+  /// A replay reads the whole of a stream log at the start, so a trie of
+  /// stream logs (see gen(argc, argv, k)) forks right away instead of sharing
+  /// work between them.  All constructors call this if the environment
+  /// variable RAMFUZZ_STREAMS is set to 1.
+  void use_streams();
+
+  /// Writes the log file from a background thread, so that generating values
+  /// doesn't wait for the disk.  Logging a record then only copies it into a
+  /// ring buffer of ring_size bytes (rounded up to a power of two), which the
+  /// thread drains with large writes; it waits only when the ring is full.
+  /// For runs that log hundreds of MB.  No effect if there's no log file.
+  ///
+  /// Records still in the ring are written out when the log is destroyed, at
+  /// exit(), and on a fatal signal (SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT,
+  /// SIGTERM, SIGINT, or SIGALRM) whose handling the program left at the
+  /// default, so that logs of crashes, aborts, and timeouts stay complete.  A
+  /// process forked while the log is open must not log, or leave by exit().
+  ///
+  /// All constructors call this if the environment variable RAMFUZZ_ASYNC_LOG
+  /// is set to the ring's size in MiB.
+  void write_async(size_t ring_size = size_t(1) << 24);
+
+  /// Every record logged from now on will also be written to sink.
+  ///
+  /// All constructors also add a shm_sink if the environment variable
+  /// RAMFUZZ_SHM is set to the name of a shared-memory ring.
+  void add_sink(std::shared_ptr<log_sink> sink) {
+    sinks.push_back(std::move(sink));
+  }
+
+  /// Steers generated values by the guidance in file fname, skewing each
+  /// value's range toward the advised one for its location.  Replayed values
+  /// aren't affected.  The file needn't exist yet: it's looked up again every
+  /// refresh_interval values, and reloaded whenever it's replaced (eg, by
+  /// rename()), so a long-running test picks up fresh guidance as soon as it's
+  /// published.  Throws file_error if the file exists but isn't valid
+  /// guidance.
+  ///
+  /// All constructors call this if the environment variable RAMFUZZ_GUIDANCE
+  /// is set to a file name.
+  void guide(const std::string &fname);
+
+  /// Keeps generated values within the inequalities in file fname (see
+  /// constraints).  Values are still random, but only between the bounds the
+  /// inequalities imply, given the values generated before them; where a
+  /// location has no bounds, or the bounds don't overlap with the requested
+  /// range, the requested range is used unchanged.  Throws file_error if the
+  /// file can't be read or parsed.
+  ///
+  /// All constructors call this if the environment variable RAMFUZZ_CONSTRAINTS
+  /// is set to a file name.
+  void constrain(const std::string &fname) {
+    limits.reset(new constraints(fname));
+  }
+
+  /// Scores the run with the failure model in file fname as values are
+  /// generated (see failure_model).  As soon as the predicted failure
+  /// probability reaches threshold, exits with predicted_failure_exit instead
+  /// of spending more time on a doomed run.  Replays are never cut short.
+  /// Throws file_error if the file can't be read or parsed.
+  ///
+  /// All constructors call this if the environment variable RAMFUZZ_MODEL is
+  /// set to a file name; the threshold is then RAMFUZZ_MODEL_THRESHOLD, if
+  /// set.
+  void predict(const std::string &fname, double threshold = 0.95) {
+    predictor.reset(new failure_model(fname));
+    predict_threshold = threshold;
+  }
+
+  /// Draws generated values from the empirical distributions in file fname
+  /// (see value_table) rather than uniformly.  With probability exploration, or
+  /// where the location has no distribution, or where the picked range doesn't
+  /// overlap with the requested one, the value is drawn uniformly as usual.
+  /// Throws file_error if the file can't be read or isn't a value table.
+  ///
+  /// All constructors call this if the environment variable
+  /// RAMFUZZ_DISTRIBUTIONS is set to a file name; exploration is then
+  /// RAMFUZZ_EXPLORATION, if set.
+  void sample_from(const std::string &fname, double exploration = 0.1) {
+    dists.reset(new value_table(fname));
+    explore = exploration;
+  }
+
+  /// Reloads the guidance file if it has been replaced since it was loaded.
+  /// Also done automatically; see guide().
+  void refresh_guidance();
+
+  /// How many values to generate between automatic guidance refreshes.
+  unsigned refresh_interval = 1024;
+
   /// Returns an unconstrained value of type T and logs it.  The value is random
   /// in "generate" mode but read from the input log in "replay" mode.
   ///
   /// If allow_subclass is true, the result may be an object of T's subclass.
-  template <typename T> T *make(bool allow_subclass = false) {
+  ///
+  /// This is the one to specialize for types that need special handling; the
+  /// overloads below call it.
+  template <typename T> T *make(bool allow_subclass) {
     auto &oldies = storage[std::type_index(typeid(T))];
     if (!oldies.empty() && reuse())
       // Note we don't check allow_subclass here, so T's storage must never hold
       // subclass objects, only actual Ts.
       return reinterpret_cast<T *>(
           oldies[between<size_t>(0, oldies.size() - 1)]);
-    else
-      return makenew<T>(allow_subclass);
+    const substream fresh(*this,
+                          std::is_class<T>::value || is_char_ptr<T>::value);
+    return makenew<T>(allow_subclass);
+  }
+
+  /// Like make<T>(allow_subclass), but with use_source_ids(), locates the
+  /// values it makes under here.
+  template <typename T> T *make(bool allow_subclass, call_site here) {
+    const scope inner(*this, here);
+    return make<T>(allow_subclass);
+  }
+
+  /// Like make<T>(false, here), where here defaults to the caller's position.
+  template <typename T>
+  T *make(call_site here = call_site(__builtin_FILE(), __builtin_LINE(),
+                                     __builtin_FUNCTION())) {
+    return make<T>(false, here);
   }
 
   /// Handy name for invoking make<T>(or_subclass).
@@ -148,34 +665,214 @@ public:
   /// Returns a value of numeric type T between lo and hi, inclusive, and logs
   /// it.  The value is random in "generate" mode but read from the input log in
   /// "replay" mode.
-  template <typename T> T between(T lo, T hi) {
+  template <typename T>
+  T between(T lo, T hi,
+            call_site here = call_site(__builtin_FILE(), __builtin_LINE(),
+                                       __builtin_FUNCTION())) {
+    const auto loc = source_ids ? child(current, here) : valueid();
     T val;
-    if (runmode == generate)
-      val = uniform_random(lo, hi);
-    else
-      input(val);
-    output(val, valueid());
+    const bool logged = runmode == replay && input(val);
+    // A sparse log's replay draws every value, to stay in step with the run
+    // that wrote it.  See filter_sites().
+    if (!logged || seeded) {
+      steer(lo, hi, loc.id);
+      const auto drawn = uniform_random(lo, hi);
+      if (!logged)
+        val = drawn;
+    }
+    if (limits)
+      limits->assign(loc.id, double(val));
+    output(val, loc);
+    if (predictor && runmode == generate &&
+        predictor->add(loc.id, double(val)) >= predict_threshold)
+      abandon();
     return val;
   }
 
 private:
-  /// Logs val and id to olog.
-  template <typename U> void output(U val, size_t id) {
-    olog.put(typetag(val));
-    olog.write(reinterpret_cast<char *>(&val), sizeof(val));
-    olog.write(reinterpret_cast<char *>(&id), sizeof(id));
-    olog.flush();
+  /// Narrows [lo, hi] for the value at location id, according to the
+  /// constraints, the distributions, and the guidance.
+  template <typename T> void steer(T &lo, T &hi, size_t id) {
+    if (limits) {
+      const auto b = limits->bounds(id);
+      intersect(lo, hi, b.first, b.second);
+    }
+    if (dists && uniform_random(0., 1.) >= explore)
+      if (const auto e = dists->pick(id, uniform_random(0., 1.)))
+        intersect(lo, hi, e->lo, e->hi);
+    if (guide_name.empty())
+      return;
+    if (++since_refresh >= refresh_interval)
+      refresh_guidance();
+    if (!guidebook)
+      return;
+    const auto a = guidebook->find(id);
+    if (a && uniform_random(0., 1.) < a->weight)
+      intersect(lo, hi, a->lo, a->hi);
+  }
+
+  /// Narrows [lo, hi] to its intersection with [alo, ahi].  Leaves [lo, hi]
+  /// unchanged if the intersection is empty.
+  template <typename T> static void intersect(T &lo, T &hi, double alo,
+                                              double ahi) {
+    if (std::is_integral<T>::value) {
+      alo = std::ceil(alo);
+      ahi = std::floor(ahi);
+    }
+    if (!(alo <= ahi) || alo > double(hi) || ahi < double(lo))
+      return;
+    // The comparisons keep conversions in T's range even where double(hi)
+    // rounds up or double(lo) rounds down.
+    const T nlo = alo <= double(lo) ? lo : alo >= double(hi) ? hi : T(alo);
+    const T nhi = ahi >= double(hi) ? hi : ahi <= double(lo) ? lo : T(ahi);
+    if (nlo <= nhi) {
+      lo = nlo;
+      hi = nhi;
+    }
   }
 
+  /// Where a value is generated: its location ID and CCT node.
+  struct location {
+    size_t id;
+    uint32_t node;
+  };
+
+  /// Makes the node of here (under the current one) current while it lives,
+  /// if source_ids.  See use_source_ids().
+  class scope {
+  public:
+    scope(gen &g, const call_site &here) : g(g), outer(g.current) {
+      if (g.source_ids)
+        g.current = g.child(outer, here);
+    }
+    ~scope() { g.current = outer; }
+
+  private:
+    gen &g;
+    location outer;
+  };
+
+  /// Opens a child of the current stream, which is current while this lives,
+  /// if streams and wanted.  See use_streams().
+  class substream {
+  public:
+    substream(gen &g, bool wanted) : g(g), open(wanted && g.streams) {
+      if (open)
+        g.open_stream();
+    }
+    ~substream() {
+      if (open)
+        g.close_stream();
+    }
+
+  private:
+    gen &g;
+    bool open;
+  };
+
+  /// A stream enclosing the current one, while the current one is open.
+  struct stream {
+    uint64_t id;
+    uint32_t kids;           ///< How many children it has opened.
+    uint32_t skipped, skips; ///< Its gen::skipped and gen::skips.
+    std::ranlux24 rgen;
+    std::unique_ptr<std::streambuf> buf; ///< Its part of the replayed log.
+  };
+
+  /// Makes a new child of the current stream current, saving the current one.
+  void open_stream();
+
+  /// Makes the current stream's parent current again.
+  void close_stream();
+
+  /// Seeds rgen from the log's seed and the current stream's ID.
+  void seed_stream();
+
+  /// Seeds rgen (or the current stream's generator) from seed, and logs it.
+  void seed_run(uint64_t seed);
+
+  /// Splits the rest of ilog, a stream log, by stream into logged_streams, and
+  /// replays the root stream.
+  void split_streams();
+
+  /// Logs a stream_tag record if the current stream isn't the one the last
+  /// record in olog belongs to.
+  void log_stream();
+
+  /// Logs val at loc to olog and sinks.
+  template <typename U> void output(U val, location loc) {
+    char rec[1 + sizeof(val) + sizeof(loc.id)];
+    rec[0] = typetag(val);
+    memcpy(rec + 1, &val, sizeof(val));
+    memcpy(rec + 1 + sizeof(val), &loc.id, sizeof(loc.id));
+    emit(rec, sizeof(rec), loc);
+  }
+
+  /// Logs a full value record to sinks, and to olog (if open and loc isn't
+  /// left out) in compact form with loc's CCT node.
+  void emit(const char *rec, size_t len, location loc);
+
+  /// Logs a metadata record with the given tag and body to olog.
+  void emit_meta(unsigned char tag, const std::string &body);
+
+  /// Ends a run predicted to fail.  See predict().
+  [[noreturn]] void abandon();
+
+  /// Adds sinks, the log writer thread, guidance, constraints, distributions,
+  /// the failure model, source-position locations, site filters, and streams
+  /// requested by the environment (see add_sink(), write_async(), guide(),
+  /// constrain(), sample_from(), predict(), use_source_ids(), filter_sites(),
+  /// and use_streams()).
+  void add_env_sinks();
+
+  /// Opens olog to write to file fname.  Throws file_error if that fails.
+  void open_output(const std::string &fname);
+
+  /// Opens ilog to read from file fname, which may be a log or a trie of logs.
+  /// Returns true for a trie.  Sets streams if fname is a stream log.
+  bool open_input(const std::string &fname);
+
   /// Reads val from ilog and advances ilog to the beginning of the next value.
-  template <typename T> void input(T &val) {
-    const char ty = ilog.get();
-    assert(ty == typetag(val));
+  /// Returns false, leaving val alone, if a sparse log left the value out (see
+  /// filter_sites()) or has ended.  Calls desync() if another log has no more
+  /// values, or if the next one isn't a T.
+  template <typename T> bool input(T &val) {
+    int ty = skips ? left_out : ilog.get();
+    if (ty >= meta_tag || ty == left_out ||
+        (seeded && ty == std::char_traits<char>::eof()))
+      ty = read_meta(ty);
+    if (ty == left_out)
+      return false;
+    if ((ty & ~compact_flag) != typetag(val))
+      desync(ty, typetag(val));
     ilog.read(reinterpret_cast<char *>(&val), sizeof(val));
-    size_t id;
-    ilog.read(reinterpret_cast<char *>(&id), sizeof(id));
+    ilog.ignore(ty & compact_flag ? sizeof(uint32_t) : sizeof(size_t));
+    if (!ilog)
+      desync(std::char_traits<char>::eof(), typetag(val));
+    return true;
   }
 
+  /// Stands for a value that a sparse log left out, in place of a tag.
+  static constexpr int left_out = -2;
+
+  /// Reads metadata records from ilog, starting with tag ty (already read),
+  /// until the next value.  Returns the value's tag, or left_out if the log
+  /// left the value out.
+  int read_meta(int ty);
+
+  /// Does filter_sites() leave location id out of the log?
+  bool leave_out(size_t id) const {
+    return filtering && (site_filter.count(id) != 0) != filter_allows;
+  }
+
+  /// Logs a skip_tag record for the values left out since the last one
+  /// logged, if any.
+  void log_skips();
+
+  /// Ends a replay that no longer matches its log: the log had tag found (or
+  /// EOF) where the program wanted a value with tag wanted.
+  [[noreturn]] void desync(int found, char wanted);
+
   /// Stores p as the newest element in T's storage.  Returns p.
   template <typename T> T *store(T *p) {
     storage[std::type_index(typeid(T))].push_back(p);
@@ -272,16 +969,135 @@ private:
   /// Uniquely identifies the numeric value currently being generated and
   /// logged.  The identity is derived from the program's current execution
   /// state.  Next time the program is run, the same value will get the same ID.
-  size_t valueid();
+  /// Adds the calling context to the CCT, logging any new nodes.
+  location valueid();
+
+  /// The CCT node for call site site under parent, which is added (and
+  /// logged) if new.
+  location child(location parent, uint64_t site);
+
+  /// The CCT node for here under parent, which is added (and logged) if new.
+  /// Also names here in the log the first time it's seen.
+  location child(location parent, const call_site &here);
+
+  /// Whether to use source positions for locations.  See use_source_ids().
+  bool source_ids = false;
+
+  /// The node of the innermost make() in progress, if source_ids.
+  location current{0, 0};
+
+  /// Source-position sites already named in the log.
+  std::unordered_set<uint64_t> named_sites;
+
+  /// The file of the last call_site given to child(), and its file_hash().
+  /// Consecutive calls mostly come from the same file, so this spares hashing
+  /// its name every time.
+  const char *hashed_file = nullptr;
+  uint64_t file_hash = 0;
+
+  /// Whether filter_sites() is in force, and its arguments.
+  bool filtering = false, filter_allows = true;
+  std::unordered_set<size_t> site_filter;
+
+  /// Values left out of the log since the last one logged.
+  uint32_t skipped = 0;
+
+  /// Values the replayed log left out that are still to come before its next
+  /// value.
+  uint32_t skips = 0;
+
+  /// Is rgen seeded from the log's seed (seed_run() or a seed_tag record)?
+  bool seeded = false;
+
+  /// The log's seed, if seeded.
+  uint64_t run_seed = 0;
+
+  /// Whether the log is partitioned into streams.  See use_streams().
+  bool streams = false;
+
+  /// The current stream's ID and how many children it has opened.
+  uint64_t stream_id = 0;
+  uint32_t stream_kids = 0;
+
+  /// The streams enclosing the current one, innermost last.
+  std::vector<stream> outer_streams;
+
+  /// The current stream's part of the replayed log.
+  std::unique_ptr<std::streambuf> stream_buf;
+
+  /// Each stream's part of the replayed log, by stream ID.
+  std::unordered_map<uint64_t, std::string> logged_streams;
+
+  /// The stream the last record in olog belongs to.
+  uint64_t logged_stream = ~uint64_t(0);
+
+  /// Callers' PCs (relative to base_pc) during valueid(), innermost first.
+  std::vector<uint64_t> frames;
+
+  /// A CCT node's parent and call site.
+  struct cct_key {
+    uint32_t parent;
+    uint64_t site;
+    bool operator==(const cct_key &that) const {
+      return parent == that.parent && site == that.site;
+    }
+  };
+  struct cct_key_hash {
+    size_t operator()(const cct_key &k) const {
+      return std::hash<uint64_t>()(k.site) * 31 + k.parent;
+    }
+  };
+
+  /// CCT nodes by parent and site.
+  std::unordered_map<cct_key, uint32_t, cct_key_hash> cct;
+
+  /// Location IDs of CCT nodes, by node.
+  std::vector<size_t> cct_ids = std::vector<size_t>(1, 0);
 
   /// Used for random value generation.
   std::ranlux24 rgen = std::ranlux24(std::random_device{}());
 
-  /// Output log.
-  std::ofstream olog;
+  /// Where olog writes to.
+  std::unique_ptr<std::streambuf> obuf;
+
+  /// Output log, if it has an rdbuf().
+  std::ostream olog{nullptr};
+
+  /// Name of the olog file.
+  std::string oname;
+
+  /// Where else to log.
+  std::vector<std::shared_ptr<log_sink>> sinks;
+
+  /// Guidance file name; empty if values aren't guided.
+  std::string guide_name;
+
+  /// Currently loaded guidance, if any.
+  std::unique_ptr<guidance> guidebook;
+
+  /// Values generated since the last refresh_guidance().
+  unsigned since_refresh = 0;
+
+  /// Inequalities to keep values within, if any.
+  std::unique_ptr<constraints> limits;
+
+  /// Distributions to sample values from, if any.
+  std::unique_ptr<value_table> dists;
+
+  /// Probability of ignoring dists.
+  double explore = 0.1;
+
+  /// Failure model scoring this run, if any.
+  std::unique_ptr<failure_model> predictor;
+
+  /// Failure probability at which to abandon the run.
+  double predict_threshold = 1.;
+
+  /// Where ilog reads from.
+  std::unique_ptr<std::streambuf> ibuf;
 
   /// Input log in replay mode.
-  std::ifstream ilog;
+  std::istream ilog{nullptr};
 
   /// Stores all values generated by makenew().
   std::unordered_map<std::type_index, std::vector<void *>> storage;
@@ -290,6 +1106,9 @@ private:
   /// valueid() will be relative to this value, which will make them
   /// position-independent.
   unw_word_t base_pc;
+
+  /// Lets ../bench/RuntimeBench.cpp measure private hot paths in isolation.
+  friend struct bench_access;
 };
 
 /// Limit on the call-stack depth in generated RamFuzz methods.  Without such a
@@ -298,6 +1117,16 @@ private:
 /// value or the depthlimit member of any RamFuzz class.
 constexpr unsigned depthlimit = 20;
 
+/// Exit status of a run that gen abandoned because it was predicted to fail
+/// (see gen::predict()).  ../ai/gencorp.py names such runs' logs *.p.
+constexpr int predicted_failure_exit = 125;
+
+/// Exit status of a replay whose program asked for a value the log doesn't
+/// have: the log ended, or its next value has a different type.  It means the
+/// program under test changed since the log was made, or behaves
+/// nondeterministically.
+constexpr int replay_desync_exit = 123;
+
 } // namespace runtime
 
 template <> class harness<std::exception> {
@@ -348,7 +1177,7 @@ public:
       : g(g), obj(new std::basic_string<CharT, Traits, Allocator>(
                   g.between(1u, 1000u), CharT())) {
     for (size_t i = 0; i < obj->size() - 1; ++i)
-      obj[i] = g.between<CharT>(1, std::numeric_limits<CharT>::max());
+      (*obj)[i] = g.between<CharT>(1, std::numeric_limits<CharT>::max());
     obj->back() = CharT(0);
   }
   operator bool() const { return true; }
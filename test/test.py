@@ -15,32 +15,42 @@
 # limitations under the License.
 """Runs the RamFuzz test battery.
 
-Usage: $0 <llvm-build-dir>
+Usage: $0 [-j <jobs>] [-t <timeout>] [-n <runs>] <llvm-build-dir> [<case> ...]
 
 where <llvm-build-dir> is the directory in which LLVM with RamFuzz was
 built; this directory must contain bin/ramfuzz and bin/clang++ in it.
 
 Each .hpp/.cpp file pair in this script's directory represents a test
-case.  Each case will be run as follows:
+case.  (Naming cases on the command line runs only those.)  First, the
+RamFuzz runtime is copied into a temporary directory and compiled once
+into an object file that all cases link.  Then each case will be run as
+follows:
 
 1. Make a temporary directory and copy the .hpp and .cpp testcase
-   files into it; also copy the requisite RamFuzz runtime there.
+   files into it.
 
 2. Run bin/ramfuzz on the .hpp file in the temporary directory,
    generating fuzz.hpp and fuzz.cpp.
 
 3. Compile the .cpp file (which must #include fuzz.hpp) using
-   bin/clang++ (also adding fuzz.cpp and runtime to produce an
-   executable).
+   bin/clang++ (also adding fuzz.cpp and the runtime object to produce
+   an executable).
 
-4. Run the compiled executable and treat its exit status as indication
-   of success or failure.
+4. Run the compiled executable <runs> times (default: 1) and treat its
+   exit status as indication of success or failure.  A run taking longer
+   than <timeout> seconds (default: 60) fails.  If the .cpp file
+   constructs its gen from argc and argv, every run is also replayed
+   from the log it wrote, and the replay must exit the same way and log
+   exactly the same values.  Such runs and their replays are repeated in
+   each of the logging modes in MODES below.
 
 5. On success, remove the temporary directory.
 
 If any of the steps fail, the temporary directory is kept and a brief
-error message is printed including the test name and the path to the
-temporary directory.
+error message is printed including the test name, the path to the
+temporary directory, and the failed step's output.
+
+Cases run in parallel, <jobs> at a time (default: one per core).
 
 A test case is usually structured as follows: the .hpp file contains
 declarations that RamFuzz will process into fuzzing code, while the
@@ -50,25 +60,72 @@ to ensure that all methods under test have been called in some order.
 """
 
 from glob import glob
-from os import chdir, path
-from subprocess import CalledProcessError, check_call
+from multiprocessing import cpu_count
+from multiprocessing.pool import ThreadPool
+from os import path
+import argparse
+import filecmp
+import os
+import re
 import shutil
+import subprocess
 import sys
 import tempfile
+import threading
 
-if len(sys.argv) != 2:
-    sys.exit('usage: %s <llvm-build-dir>' % sys.argv[0])
-bindir = path.join(sys.argv[1], 'bin')
 scriptdir = path.dirname(path.realpath(__file__))
 rtdir = path.join(scriptdir, '..', 'runtime')
-failures = 0
-for case in glob(path.join(scriptdir, '*.hpp')):
-    hfile = path.basename(case)
-    testname = hfile[:-4]
-    cfile = testname + '.cpp'
-    temp = tempfile.mkdtemp()
-    shutil.copy(path.join(scriptdir, hfile), temp)
-    shutil.copy(path.join(scriptdir, cfile), temp)
+
+# Logging modes that replayable cases run in, as (name, environment, sparse)
+# triples.  The environment applies to both a run and its replay.  The replay
+# of a sparse log logs every value, so it can't match the log; instead, the
+# replay's log must replay exactly.
+MODES = [
+    ('plain', {}, False),
+    ('source IDs', {'RAMFUZZ_SOURCE_IDS': '1'}, False),
+    ('sparse', {'RAMFUZZ_LOG_SITES': os.devnull}, True),
+    ('streams', {'RAMFUZZ_STREAMS': '1'}, False),
+    ('async', {'RAMFUZZ_ASYNC_LOG': '1'}, False),
+]
+
+
+class StepError(Exception):
+    """A test step failed; the message says which and why."""
+
+
+def run(cmd, cwd, timeout=None, env=None):
+    """Runs cmd in directory cwd, with env added to the environment, killing it
+    after timeout seconds.  Raises StepError unless it exits with status 0."""
+    full_env = dict(os.environ)
+    full_env.update(env or {})
+    proc = subprocess.Popen(
+        cmd,
+        cwd=cwd,
+        env=full_env,
+        stdout=subprocess.PIPE,
+        stderr=subprocess.STDOUT)
+    timed_out = []
+
+    def kill():
+        timed_out.append(True)
+        proc.kill()
+
+    timer = threading.Timer(timeout, kill) if timeout else None
+    if timer:
+        timer.start()
+    out = proc.communicate()[0].decode('utf-8', 'replace')
+    if timer:
+        timer.cancel()
+    if timed_out:
+        raise StepError('{} timed out after {}s\n{}'.format(
+            ' '.join(cmd), timeout, out))
+    if proc.returncode:
+        raise StepError('{} exited with {}\n{}'.format(
+            ' '.join(cmd), proc.returncode, out))
+
+
+def build_runtime(bindir, temp):
+    """Compiles the runtime in directory temp.  Returns the object file."""
     shutil.copy(path.join(rtdir, 'ramfuzz-rt.cpp'), temp)
     # Also copy ramfuzz-rt.hpp, but with lower depthlimit so tests don't take
     # forever:
@@ -76,20 +133,85 @@ for case in glob(path.join(scriptdir, '*.hpp')):
         newcontent = fsrc.read().replace('depthlimit = 20', 'depthlimit = 4')
         with open(path.join(temp, 'ramfuzz-rt.hpp'), 'w') as fdst:
             fdst.write(newcontent)
+    run([
+        path.join(bindir, 'clang++'), '-std=c++11', '-g', '-c',
+        'ramfuzz-rt.cpp', '-o', 'ramfuzz-rt.o'
+    ], temp)
+    return path.join(temp, 'ramfuzz-rt.o')
+
+
+def uses_argv(cfile):
+    """True if the test in cfile makes its gen from argc and argv, so its runs
+    can be replayed."""
+    with open(cfile) as f:
+        return re.search(r'\bgen\b[^;]*\(\s*argc\b', f.read()) is not None
+
+
+def run_case(case, args, bindir, rtobj):
+    """Runs the test case whose .hpp file is case.  Returns None on success or
+    an error message on failure."""
+    hfile = path.basename(case)
+    testname = hfile[:-4]
+    cfile = testname + '.cpp'
+    temp = tempfile.mkdtemp()
+    shutil.copy(path.join(scriptdir, hfile), temp)
+    shutil.copy(path.join(scriptdir, cfile), temp)
     try:
-        chdir(temp)
-        check_call([path.join(bindir, 'ramfuzz'), hfile, '--', '-std=c++11'])
+        run([path.join(bindir, 'ramfuzz'), hfile, '--', '-std=c++11'], temp)
         build_cmd = [
-            path.join(bindir, 'clang++'), '-std=c++11', '-or', '-g', cfile,
-            'fuzz.cpp', 'ramfuzz-rt.cpp'
+            path.join(bindir, 'clang++'), '-std=c++11', '-or', '-g',
+            '-I' + path.dirname(rtobj), cfile, 'fuzz.cpp', rtobj
         ]
         if sys.platform != 'darwin':
-            build_cmd.append('-lunwind')
-        check_call(build_cmd)
-        check_call(path.join(temp, 'r'))
-        chdir(bindir)  # Just a precaution to guarantee rmtree success.
+            build_cmd += ['-lunwind', '-lrt', '-pthread']
+        run(build_cmd, temp)
+        exe = path.join(temp, 'r')
+        replay = uses_argv(path.join(temp, cfile))
+        log = path.join(temp, 'fuzzlog')
+        for i in range(args.runs):
+            for mode, env, sparse in MODES if replay else MODES[:1]:
+                run([exe], temp, args.timeout, env)
+                if replay and path.exists(log):
+                    run([exe, log], temp, args.timeout, env)
+                    if sparse:
+                        shutil.move(log + '+', log)
+                        run([exe, log], temp, args.timeout, env)
+                    if not filecmp.cmp(log, log + '+', shallow=False):
+                        raise StepError(
+                            'run {} ({}): replay logged different values'.
+                            format(i + 1, mode))
         shutil.rmtree(path.realpath(temp))
-    except CalledProcessError:
-        failures += 1
-        sys.stderr.write('error in {} ({})\n'.format(testname, temp))
-sys.exit(failures)
+        return None
+    except StepError as e:
+        return 'error in {} ({}): {}'.format(testname, temp, e)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+        description='Runs the RamFuzz test battery.')
+    parser.add_argument('-j', '--jobs', type=int, default=cpu_count())
+    parser.add_argument('-t', '--timeout', type=float, default=60)
+    parser.add_argument('-n', '--runs', type=int, default=1)
+    parser.add_argument('llvm_build_dir')
+    parser.add_argument('cases', nargs='*')
+    args = parser.parse_args()
+    bindir = path.join(args.llvm_build_dir, 'bin')
+    cases = glob(path.join(scriptdir, '*.hpp'))
+    if args.cases:
+        cases = [c for c in cases if path.basename(c)[:-4] in args.cases]
+    rttemp = tempfile.mkdtemp()
+    try:
+        rtobj = build_runtime(bindir, rttemp)
+    except StepError as e:
+        sys.exit('error building the runtime ({}): {}'.format(rttemp, e))
+    pool = ThreadPool(max(args.jobs, 1))
+    failures = 0
+    for err in pool.imap_unordered(
+            lambda c: run_case(c, args, bindir, rtobj), sorted(cases)):
+        if err:
+            failures += 1
+            sys.stderr.write(err + '\n')
+    pool.close()
+    if not failures:
+        shutil.rmtree(rttemp)
+    sys.exit(failures)
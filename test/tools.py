@@ -0,0 +1,447 @@
+#!/usr/bin/python
+
+# Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Runs end-to-end tests of the command-line tools in ../tools.
+
+Usage: $0 [-t <timeout>] <llvm-build-dir> [<case> ...]
+
+where <llvm-build-dir> is as for test.py, though only its bin/clang++ is
+used.  First, the tools and the programs in tools/ (linked with the RamFuzz
+runtime) are compiled into a temporary directory.  Then each case, a
+case_<name>() function below, runs in a directory of its own: it generates
+logs with the programs, runs a tool on them, and checks what the tool did.
+(Naming cases on the command line runs only those.)  A command taking longer
+than <timeout> seconds (default: 60) fails its case.
+
+If any case fails, the temporary directory is kept, and each failure is
+printed with the case's name and why it failed.
+"""
+
+from distutils.spawn import find_executable
+from glob import glob
+from os import path
+import argparse
+import filecmp
+import imp
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+
+scriptdir = path.dirname(path.realpath(__file__))
+tooldir = path.join(scriptdir, '..', 'tools')
+e2e = imp.load_source('e2e', path.join(scriptdir, 'test.py'))
+
+# Each tool's sources besides <tool>.cpp; see ../tools/README.
+TOOLS = {
+    'distill': ['logfile.cpp'],
+    'dists': ['logfile.cpp'],
+    'logtool': ['logfile.cpp'],
+    'minimize': ['logfile.cpp', 'runner.cpp'],
+    'regress': ['logfile.cpp', 'logtrie.cpp', 'runner.cpp'],
+    'rules': ['logfile.cpp'],
+    'sitestats': ['logfile.cpp'],
+    'symbolize': ['logfile.cpp', 'runner.cpp'],
+    'sync': ['logfile.cpp', 'runner.cpp'],
+    'trie': ['logtrie.cpp', 'logfile.cpp', 'runner.cpp'],
+}
+
+# Environment for runs logging in streams.
+STREAMS = {'RAMFUZZ_STREAMS': '1'}
+
+
+class Context(object):
+    """What a case works with: the built programs and tools, and a directory
+    of its own."""
+
+    def __init__(self, bindir, builddir, timeout):
+        self.bindir, self.builddir, self.timeout = bindir, builddir, timeout
+        self.dir = tempfile.mkdtemp(dir=builddir)
+
+    def prog(self, name):
+        """Full path of the test program built from tools/<name>.cpp."""
+        return path.join(self.builddir, name)
+
+    def call(self, cmd, env=None):
+        """Runs cmd in the case's directory, with env added to the
+        environment.  Returns its exit status (or minus the signal that killed
+        it) and its output.  Raises StepError if it times out."""
+        full_env = dict(os.environ)
+        full_env.update(env or {})
+        proc = subprocess.Popen(
+            cmd,
+            cwd=self.dir,
+            env=full_env,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT)
+        timed_out = []
+
+        def kill():
+            timed_out.append(True)
+            proc.kill()
+
+        timer = threading.Timer(self.timeout, kill)
+        timer.start()
+        out = proc.communicate()[0].decode('utf-8', 'replace')
+        timer.cancel()
+        if timed_out:
+            raise e2e.StepError('{} timed out after {}s\n{}'.format(
+                ' '.join(cmd), self.timeout, out))
+        return proc.returncode, out
+
+    def tool(self, name, *args, **kwargs):
+        """Runs ramfuzz-<name> with args, and with kwargs['env'] added to the
+        environment.  Returns its output.  Raises StepError unless it exits
+        with kwargs['status'] (default: 0)."""
+        cmd = [path.join(self.builddir, 'ramfuzz-' + name)] + list(args)
+        status, out = self.call(cmd, kwargs.get('env'))
+        check(status == kwargs.get('status', 0),
+              '{} exited with {}\n{}'.format(' '.join(cmd), status, out))
+        return out
+
+    def corpus(self, prog, runs, subdir='corpus', env=None):
+        """Runs prog runs times, keeping each run's log in subdir as <i>.s or
+        <i>.f, by the run's outcome, like ../ai/gencorp.py.  Returns the
+        logs' paths."""
+        cdir = path.join(self.dir, subdir)
+        if not path.isdir(cdir):
+            os.mkdir(cdir)
+        logs = []
+        for i in range(runs):
+            status, out = self.call([self.prog(prog)], env)
+            check(status in (0, 1),
+                  '{} exited with {}\n{}'.format(prog, status, out))
+            logs.append(
+                path.join(cdir, '{}.{}'.format(i, 'f' if status else 's')))
+            os.rename(path.join(self.dir, 'fuzzlog'), logs[-1])
+        return logs
+
+    def replay(self, prog, log, env=None):
+        """Replays log with prog.  Returns the exit status."""
+        return self.call([self.prog(prog), log], env)[0]
+
+
+def check(cond, msg):
+    """Raises StepError with msg unless cond holds."""
+    if not cond:
+        raise e2e.StepError(msg)
+
+
+def failures(logs):
+    """The failing runs' logs among logs."""
+    return [l for l in logs if l.endswith('.f')]
+
+
+def case_dists(ctx):
+    """Sampling only from the successful runs' distributions, runs succeed."""
+    logs = ctx.corpus('coin', 40)
+    ctx.tool('dists', '-o', 'table', *logs)
+    env = {
+        'RAMFUZZ_DISTRIBUTIONS': path.join(ctx.dir, 'table'),
+        'RAMFUZZ_EXPLORATION': '0'
+    }
+    check(not failures(ctx.corpus('coin', 20, 'sampled', env)),
+          'failed despite sampling')
+
+
+def case_logtool(ctx):
+    """Each command reads logs the same way: dump, stats, and grep agree on
+    the records, and diff tells a replay from a different run."""
+    a, b = ctx.corpus('coin', 2)
+    dump = ctx.tool('logtool', 'dump', a).splitlines()
+    check(dump and dump[0].startswith('1 '), '\n'.join(dump))
+    stats = ctx.tool('logtool', 'stats', a).splitlines()
+    counts = sum(int(l.split()[1]) for l in stats[1:])
+    check(counts == len(dump), 'dumped {}, counted {}'.format(
+        len(dump), counts))
+    loc = dump[0].split()[3]
+    hits = ctx.tool('logtool', 'grep', loc, a).splitlines()
+    check(
+        len(hits) == sum(l.split()[3] == loc for l in dump) and
+        hits[0].startswith(a + ':1 '), '\n'.join(hits))
+    ctx.tool('logtool', 'grep', '1', a, status=1)
+    ctx.replay('coin', a)
+    ctx.tool('logtool', 'diff', a, a + '+')
+    if not filecmp.cmp(a, b, shallow=False):
+        ctx.tool('logtool', 'diff', a, b, status=1)
+    check(ctx.tool('logtool', 'cct', a).startswith('node'), 'no CCT')
+
+
+def case_minimize(ctx):
+    """A failing log, plain or partitioned into streams, shrinks to a simpler
+    one that fails the same way."""
+
+    def nonzero(log):
+        """How many of log's values aren't zero."""
+        dump = ctx.tool('logtool', 'dump', log).splitlines()
+        return sum(float(l.split()[2]) != 0 for l in dump if l[0].isdigit())
+
+    # A private TMPDIR shows what the minimizer leaves behind.
+    tmp = path.join(ctx.dir, 'tmp')
+    os.mkdir(tmp)
+    for subdir, env in (('plain', {}), ('streams', STREAMS)):
+        fails = failures(ctx.corpus('coin', 40, subdir, env))
+        check(fails, 'no failing run')
+        log = max(fails, key=path.getsize)
+        minimized = path.join(ctx.dir, subdir + '.min')
+        out = ctx.tool(
+            'minimize',
+            '-o',
+            minimized,
+            ctx.prog('coin'),
+            log,
+            env={'TMPDIR': tmp})
+        check(
+            path.getsize(minimized) <= path.getsize(log) and
+            nonzero(minimized) < nonzero(log), 'not simpler: ' + out)
+        check(ctx.replay('coin', minimized) == 1, 'no longer fails: ' + out)
+    check(not os.listdir(tmp), 'temporary files left behind')
+
+
+def case_distill(ctx):
+    """Duplicates are dropped, unreadable logs are skipped, the picked logs are
+    linked into the output directory, and nothing there is overwritten."""
+    logs = ctx.corpus('coin', 20)
+    corpus = path.dirname(logs[0])
+    shutil.copy(logs[0], path.join(corpus, 'dup.s'))
+    garbage = path.join(corpus, 'garbage.s')
+    with open(garbage, 'w') as f:
+        f.write('\xff')
+    out = path.join(ctx.dir, 'out')
+    os.mkdir(out)
+    summary = ctx.tool('distill', '-o', out, *glob(path.join(corpus, '*')))
+    check('1 duplicates' in summary, summary)
+    check('1 skipped unreadable' in summary, summary)
+    picked = [l for l in summary.splitlines() if l.startswith(corpus)]
+    check(picked, 'nothing picked: ' + summary)
+    check(garbage not in picked, 'picked ' + garbage)
+    check(
+        sorted(os.listdir(out)) == sorted(path.basename(p) for p in picked),
+        'picked {} but linked {}'.format(picked, os.listdir(out)))
+    # Distilling again into the same directory leaves it as it is.
+    ctx.tool('distill', '-o', out, *picked)
+    check(len(os.listdir(out)) == len(picked), 'relinked: ' + summary)
+    # A different log with a name already taken gets a new name.
+    base = path.basename(picked[0])
+    os.mkdir(path.join(ctx.dir, 'other'))
+    other = path.join(ctx.dir, 'other', base)
+    shutil.copy(next(l for l in logs[1:] if l != picked[0]), other)
+    ctx.tool('distill', '-o', out, other)
+    check(
+        filecmp.cmp(path.join(out, base), picked[0], shallow=False),
+        'overwrote ' + base)
+    check(
+        filecmp.cmp(
+            path.join(out, base.replace('.', '-2.')), other, shallow=False),
+        'misplaced ' + other)
+
+
+def case_regress(ctx):
+    """Replays of a corpus are sorted by how their outcomes changed."""
+    logs = ctx.corpus('coin', 20)
+    fails = failures(logs)
+    check(fails and len(fails) < len(logs), 'all runs fail or pass')
+    corpus = path.dirname(logs[0])
+    out = ctx.tool('regress', ctx.prog('coin'), corpus)
+    check('unchanged: 20' in out, out)
+    passing = next(l for l in logs if l not in fails)
+    os.rename(passing, passing[:-1] + 'f')
+    os.rename(fails[0], fails[0][:-1] + 's')
+    open(path.join(corpus, 'empty.s'), 'w').close()
+    with open(path.join(corpus, 'garbage.s'), 'w') as f:
+        f.write('\xff')
+    out = ctx.tool('regress', ctx.prog('coin'), corpus, status=1)
+    for bucket in ('now fails: 1', 'now passes: 1', 'desync: 1',
+                   'unparseable: 1', 'unchanged: 18'):
+        check(bucket in out, out)
+
+
+def case_rules(ctx):
+    """Rules learned from a corpus keep the runs they're applied to from
+    failing."""
+    logs = ctx.corpus('coin', 60)
+    check(failures(logs), 'no failing run')
+    ctx.tool('rules', '-m', '3', '-o', 'rules', *logs)
+    env = {'RAMFUZZ_CONSTRAINTS': path.join(ctx.dir, 'rules')}
+    rules = open(env['RAMFUZZ_CONSTRAINTS']).read()
+    check('<=' in rules or '>=' in rules, 'no rules learned')
+    check(not failures(ctx.corpus('coin', 20, 'ruled', env)),
+          'failed despite rules:\n' + rules)
+
+
+def case_symbolize(ctx):
+    """Locations are traced back to the test program's source, through
+    addr2line or through the names a log holds itself, in the logs tests write
+    and in the logs ramfuzz-minimize writes."""
+
+    def minimized(subdir, env=None):
+        fails = failures(ctx.corpus('coin', 20, subdir, env))
+        check(fails, 'no failing run')
+        out = path.join(ctx.dir, subdir + '.min')
+        ctx.tool('minimize', '-o', out, ctx.prog('coin'), fails[0])
+        return fails[0], out
+
+    for log in minimized('ids', {'RAMFUZZ_SOURCE_IDS': '1'}):
+        out = ctx.tool('symbolize', log, env={'PATH': ''})
+        check('coin.cpp' in out and 'main' in out, out)
+    if not find_executable('addr2line'):
+        sys.stderr.write('skipping symbolize with addr2line: not found\n')
+        return
+    log, minlog = minimized('plain')
+    out = ctx.tool('symbolize', '-c', 'cache', log)
+    check('coin.cpp' in out and 'main' in out, out)
+    check(os.listdir(path.join(ctx.dir, 'cache')), 'nothing cached')
+    check(ctx.tool('symbolize', '-c', 'cache', log, env={'PATH': ''}) == out,
+          'cached sites differ')
+    out = ctx.tool('symbolize', minlog)
+    check('coin.cpp' in out and 'main' in out, out)
+
+
+def case_sitestats(ctx):
+    """The location deciding coin's outcome tops the ranking."""
+    logs = ctx.corpus('coin', 40)
+    fails = failures(logs)
+    check(fails and len(fails) < len(logs), 'all runs fail or pass')
+    out = ctx.tool('sitestats', '-n', 'stats', *logs).splitlines()
+    # Header lines, then the best feature: the coin toss coming out 0.
+    check(out[2].split()[1:5] == ['0', '0', str(len(fails)), '1.000'],
+          '\n'.join(out))
+    for suffix in ('locs', 'stats', 'hist'):
+        npy = path.join(ctx.dir, 'stats.{}.npy'.format(suffix))
+        check(open(npy, 'rb').read(6) == '\x93NUMPY', 'no ' + npy)
+
+
+def case_sync(ctx):
+    """Instances publish their logs and import each other's, dropping logs that
+    don't replay as labeled or desync and skipping logs that can't be read."""
+    logs = ctx.corpus('coin', 20, 'a')
+    fails = failures(logs)
+    check(fails, 'no failing run')
+    passes = [l for l in logs if l not in fails]
+    check(passes, 'no passing run')
+    os.mkdir(path.join(ctx.dir, 'b'))
+    os.mkdir(path.join(ctx.dir, 'sync'))
+    ctx.tool('sync', '-1', 'sync', 'a', ctx.prog('coin'), 'a')
+    published = os.listdir(path.join(ctx.dir, 'sync', 'a'))
+    check(published, 'nothing published')
+    shutil.copy(fails[0], path.join(ctx.dir, 'sync', 'a', 'liar.s'))
+    with open(path.join(ctx.dir, 'sync', 'a', 'garbage.s'), 'w') as f:
+        f.write('\xff')
+    # Dropping the last record (the int from between(0, 3): a tag, a 4-byte
+    # value, and a 4-byte node) leaves a valid log whose replay desyncs, which
+    # is a failure but not the failure the label claims.
+    with open(passes[0], 'rb') as f:
+        data = f.read()
+    with open(path.join(ctx.dir, 'sync', 'a', 'short.f'), 'wb') as f:
+        f.write(data[:-9])
+    out = ctx.tool('sync', '-1', 'sync', 'b', ctx.prog('coin'), 'b')
+    check('skipped 1 unreadable' in out, out)
+    imported = sorted(os.listdir(path.join(ctx.dir, 'b')))
+    check(imported == sorted('sync-a-' + n for n in published),
+          'published {} but imported {}'.format(published, imported))
+    for n in published:
+        check(
+            filecmp.cmp(
+                path.join(ctx.dir, 'a', n),
+                path.join(ctx.dir, 'b', 'sync-a-' + n),
+                shallow=False), 'imported a different ' + n)
+    # Imported logs aren't published again.
+    ctx.tool('sync', '-1', 'sync', 'b', ctx.prog('coin'), 'b')
+    check(not os.listdir(path.join(ctx.dir, 'sync', 'b')), 'republished')
+
+
+def case_trie(ctx):
+    """Replaying a trie gives each log's outcome, and each log taken out of the
+    trie replays like the original, whether or not it has streams."""
+    logs = ctx.corpus('coin', 20) + ctx.corpus('coin', 10, 'streams', STREAMS)
+    fails = failures(logs)
+    check(fails, 'no failing run')
+    liar = path.join(path.dirname(logs[0]), 'liar.s')
+    shutil.copy(fails[0], liar)
+    # A passing log without its last record (see case_sync) desyncs, which
+    # doesn't make it a failure.
+    short = path.join(path.dirname(logs[0]), 'short.f')
+    with open([l for l in logs[:20] if l not in fails][0], 'rb') as f:
+        data = f.read()
+    with open(short, 'wb') as f:
+        f.write(data[:-9])
+    ctx.tool('trie', 'build', '-o', 'trie', *(logs + [liar, short]))
+    out = ctx.tool('trie', 'replay', 'trie', ctx.prog('coin'), status=1)
+    marked = sorted(l for l in out.splitlines() if l.startswith('!'))
+    check(
+        len(marked) == 2 and marked[0].startswith('!' + liar + ' ') and
+        marked[1].startswith('!' + short + ' exit 123'), out)
+    for l in logs:
+        check(l + ' ' in out, 'no outcome for {}:\n{}'.format(l, out))
+    for line in ctx.tool('trie', 'ls', 'trie').splitlines():
+        fields = line.split('\t')
+        ctx.tool('trie', 'get', 'trie', fields[0], 'got')
+        # The liar shares a leaf with a failing log.
+        if short in fields[1:]:
+            want = 123
+        elif any(n.endswith('.f') for n in fields[1:]):
+            want = 1
+        else:
+            want = 0
+        check(
+            ctx.replay('coin', path.join(ctx.dir, 'got')) == want,
+            'leaf {} replays differently'.format(fields[0]))
+
+
+def build(bindir, builddir):
+    """Compiles the runtime, the programs, and the tools into builddir."""
+    cxx = [path.join(bindir, 'clang++'), '-std=c++11', '-O2']
+    libs = [] if sys.platform == 'darwin' else ['-lunwind', '-lrt', '-pthread']
+    shutil.copy(path.join(e2e.rtdir, 'ramfuzz-rt.hpp'), builddir)
+    shutil.copy(path.join(e2e.rtdir, 'ramfuzz-rt.cpp'), builddir)
+    e2e.run(cxx + ['-c', 'ramfuzz-rt.cpp', '-o', 'ramfuzz-rt.o'], builddir)
+    for src in glob(path.join(scriptdir, 'tools', '*.cpp')):
+        name = path.basename(src)[:-4]
+        e2e.run(cxx + ['-g', '-I.', src, 'ramfuzz-rt.o', '-o', name] + libs,
+                builddir)
+    for name, srcs in TOOLS.items():
+        e2e.run(cxx + [path.join(tooldir, s) for s in [name + '.cpp'] + srcs] +
+                ['-pthread', '-o', 'ramfuzz-' + name], builddir)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+        description='Runs end-to-end tests of the tools.')
+    parser.add_argument('-t', '--timeout', type=float, default=60)
+    parser.add_argument('llvm_build_dir')
+    parser.add_argument('cases', nargs='*')
+    args = parser.parse_args()
+    bindir = path.join(args.llvm_build_dir, 'bin')
+    builddir = tempfile.mkdtemp()
+    try:
+        build(bindir, builddir)
+    except e2e.StepError as e:
+        sys.exit('error building ({}): {}'.format(builddir, e))
+    cases = sorted(n[5:] for n in globals() if n.startswith('case_'))
+    if args.cases:
+        cases = [c for c in cases if c in args.cases]
+    failed = 0
+    for name in cases:
+        try:
+            globals()['case_' + name](Context(bindir, builddir, args.timeout))
+        except e2e.StepError as e:
+            failed += 1
+            sys.stderr.write('error in {} ({}): {}\n'.format(name, builddir,
+                                                              e))
+    if not failed:
+        shutil.rmtree(builddir)
+    sys.exit(failed)
@@ -0,0 +1,27 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Makes a few values, then fails (exits with 1) a quarter of the time.
+
+#include "ramfuzz-rt.hpp"
+
+int main(int argc, char *argv[]) {
+  ramfuzz::runtime::gen g(argc, argv);
+  for (int i = 0, n = g.between(0, 30); i < n; ++i)
+    g.make<short>();
+  g.make<double>();
+  return g.between(0, 3) ? 0 : 1;
+}
+
+unsigned ::ramfuzz::runtime::spinlimit = 3;
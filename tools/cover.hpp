@@ -0,0 +1,131 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "logfile.hpp"
+
+namespace ramfuzz {
+namespace tools {
+
+/// Maps features -- (location, value bucket, label) triples -- to dense
+/// indexes.
+class feature_index {
+public:
+  /// The feature's index; a new feature gets the next free one.
+  uint32_t get(uint64_t loc, int bucket, label lbl) {
+    const auto it = idx.emplace(feature{loc, bucket, lbl}, uint32_t(idx.size()))
+                        .first;
+    return it->second;
+  }
+  size_t size() const { return idx.size(); }
+
+private:
+  struct feature {
+    uint64_t loc;
+    int bucket;
+    label lbl;
+    bool operator==(const feature &that) const {
+      return loc == that.loc && bucket == that.bucket && lbl == that.lbl;
+    }
+  };
+  struct feature_hash {
+    size_t operator()(const feature &f) const {
+      return std::hash<uint64_t>()(f.loc * 0x9e3779b97f4a7c15ULL ^
+                                   static_cast<uint64_t>(f.bucket * 4 +
+                                                         int(f.lbl)));
+    }
+  };
+  std::unordered_map<feature, uint32_t, feature_hash> idx;
+};
+
+/// A set of feature indexes, kept as a bitset.
+class feature_set {
+public:
+  void resize(size_t bits) { words.resize((bits + 63) / 64); }
+  void set(uint32_t i) { words[i / 64] |= uint64_t(1) << (i % 64); }
+  bool test(uint32_t i) const { return words[i / 64] >> (i % 64) & 1; }
+
+  /// Number of set bits.  Compiles to POPCNT where available.
+  size_t count() const {
+    size_t n = 0;
+    for (auto w : words)
+      n += __builtin_popcountll(w);
+    return n;
+  }
+
+private:
+  std::vector<uint64_t> words;
+};
+
+/// A log and its features (sorted, unique feature indexes).
+struct candidate {
+  std::string name;
+  std::vector<uint32_t> features;
+};
+
+/// Counts features in c that aren't in covered.
+inline size_t gain(const candidate &c, const feature_set &covered) {
+  size_t n = 0;
+  for (auto f : c.features)
+    n += !covered.test(f);
+  return n;
+}
+
+/// Greedy set cover: picks candidates until the picked ones have all the
+/// features of cands (of which there are nfeatures), always picking the one
+/// that adds the most features not picked yet.  Returns indexes of picked
+/// candidates, in picking order.
+///
+/// Uses lazy evaluation: a candidate's gain can only shrink as more features
+/// are covered, so a candidate whose freshly recomputed gain still tops the
+/// queue is the best pick.
+inline std::vector<size_t> cover(const std::vector<candidate> &cands,
+                                 size_t nfeatures) {
+  feature_set covered;
+  covered.resize(nfeatures);
+  // (Possibly stale) gain, candidate index.
+  std::priority_queue<std::pair<size_t, size_t>> q;
+  for (size_t i = 0; i < cands.size(); ++i)
+    q.emplace(cands[i].features.size(), i);
+  std::vector<size_t> picked;
+  while (!q.empty()) {
+    const auto top = q.top();
+    q.pop();
+    if (!top.first)
+      break;
+    const auto fresh = gain(cands[top.second], covered);
+    if (!q.empty() && fresh < q.top().first) {
+      q.emplace(fresh, top.second);
+      continue;
+    }
+    if (!fresh)
+      continue;
+    picked.push_back(top.second);
+    for (auto f : cands[top.second].features)
+      covered.set(f);
+  }
+  return picked;
+}
+
+} // namespace tools
+} // namespace ramfuzz
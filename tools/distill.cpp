@@ -0,0 +1,181 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Shrinks a corpus (as generated by ../ai/gencorp.py) while keeping its
+/// signal.  Usage:
+///
+/// ramfuzz-distill [-o <outdir>] <log> ...
+///
+/// First drops logs whose contents are byte-identical to an earlier log.  Then
+/// describes each remaining log by its features: the set of (location, value
+/// bucket, label) triples it contains, where the value bucket is
+/// magnitude_bucket() from stats.hpp and the label is the log's .s/.f suffix.
+/// Finally, greedily picks logs until the picked ones cover every feature of
+/// the whole corpus, always picking the log that adds the most uncovered
+/// features.  Near-identical logs add nothing new, so they aren't picked.
+///
+/// Prints the picked logs' names, one per line.  With -o, also hard-links (or,
+/// failing that, copies) them into <outdir>, which must exist.  Logs already
+/// in <outdir> stay as they are, and no existing file there is overwritten: a
+/// log whose name is taken gets a numbered one (eg, r1-2.s).  A summary goes to
+/// standard error.  Logs that can't be parsed are skipped and counted there.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cover.hpp"
+#include "logfile.hpp"
+#include "stats.hpp"
+
+using namespace ramfuzz::tools;
+using namespace std;
+
+namespace {
+
+/// Makes dst a copy of src.  Writes to a temporary file in dir first, so dst
+/// never appears partially written.
+void copy_file(const string &src, const string &dst, const string &dir) {
+  string tmp = dir + "/.ramfuzz-distill.XXXXXX";
+  const int fd = mkstemp(&tmp[0]);
+  if (fd < 0)
+    throw runtime_error("cannot create a temporary file in " + dir);
+  close(fd);
+  {
+    ifstream in(src, ios::binary);
+    ofstream out(tmp, ios::binary);
+    out << in.rdbuf();
+    if (!in || !out) {
+      unlink(tmp.c_str());
+      throw runtime_error("cannot copy " + src + " to " + tmp);
+    }
+  }
+  if (rename(tmp.c_str(), dst.c_str())) {
+    unlink(tmp.c_str());
+    throw runtime_error("cannot rename " + tmp + " to " + dst);
+  }
+}
+
+/// Puts src into dir: leaves it alone if it's already there, else makes
+/// dir/basename(src) (or, if that's taken, dir/<stem>-<n><suffix>) the same
+/// file as src, or a copy of it.  Never overwrites an existing file.
+void place(const string &src, const string &dir) {
+  struct stat s;
+  if (stat(src.c_str(), &s))
+    throw runtime_error("cannot stat " + src);
+  const auto slash = src.rfind('/');
+  const auto base = slash == string::npos ? src : src.substr(slash + 1);
+  const auto dot = base.rfind('.');
+  const auto stem = base.substr(0, dot),
+             suffix = dot == string::npos ? string() : base.substr(dot);
+  for (unsigned n = 1;; ++n) {
+    const auto dst =
+        dir + "/" + (n == 1 ? base : stem + "-" + to_string(n) + suffix);
+    struct stat d;
+    if (!stat(dst.c_str(), &d)) {
+      if (d.st_dev == s.st_dev && d.st_ino == s.st_ino)
+        return;
+      continue;
+    }
+    if (!link(src.c_str(), dst.c_str()))
+      return;
+    if (errno == EEXIST) // Appeared since the stat().
+      continue;
+    copy_file(src, dst, dir);
+    return;
+  }
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  string outdir;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    if (opt == 'o')
+      outdir = optarg;
+    else {
+      fprintf(stderr, "usage: %s [-o <outdir>] <log> ...\n", argv[0]);
+      return 2;
+    }
+  }
+  try {
+    unordered_map<uint64_t, vector<size_t>> by_digest; // Digest -> entries.
+    vector<candidate> entries;
+    feature_index fidx;
+    size_t duplicates = 0, skipped = 0;
+    for (int i = optind; i < argc; ++i) {
+      vector<pair<uint64_t, int>> recs; // Location and value bucket.
+      uint64_t dig;
+      try {
+        logfile log(argv[i]);
+        dig = digest(log.data(), log.size());
+        const auto &same_digest = by_digest[dig];
+        const bool dup = any_of(
+            same_digest.begin(), same_digest.end(), [&](size_t e) {
+              const logfile other(entries[e].name);
+              return other.size() == log.size() &&
+                     !memcmp(other.data(), log.data(), log.size());
+            });
+        if (dup) {
+          ++duplicates;
+          continue;
+        }
+        logfile::cursor c(log);
+        record r;
+        while (c.next(r))
+          recs.emplace_back(r.id, magnitude_bucket(r.value()));
+      } catch (const log_error &e) {
+        // Eg, a log still being written; the rest of the corpus is fine.
+        fprintf(stderr, "skipping %s\n", e.what());
+        ++skipped;
+        continue;
+      }
+      by_digest[dig].push_back(entries.size());
+      entries.push_back({argv[i], {}});
+      auto &features = entries.back().features;
+      const auto lbl = label_of(argv[i]);
+      for (const auto &r : recs)
+        features.push_back(fidx.get(r.first, r.second, lbl));
+      sort(features.begin(), features.end());
+      features.erase(unique(features.begin(), features.end()), features.end());
+    }
+    const auto picked = cover(entries, fidx.size());
+    for (auto i : picked) {
+      printf("%s\n", entries[i].name.c_str());
+      if (!outdir.empty())
+        place(entries[i].name, outdir);
+    }
+    fprintf(stderr,
+            "%d logs, %zu duplicates, %zu skipped unreadable, %zu features, "
+            "%zu picked\n",
+            argc - optind, duplicates, skipped, fidx.size(), picked.size());
+  } catch (const exception &e) {
+    fflush(stdout);
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
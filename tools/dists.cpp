@@ -0,0 +1,205 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Builds, from the successful runs in a corpus generated by ../ai/gencorp.py,
+/// an empirical distribution of the values at each location.  Usage:
+///
+/// ramfuzz-dists [-k <exact values>] [-m <min values>] -o <table> <log> ...
+///
+/// Only .s logs are read.  For each location with at least <min values>
+/// values (default: 5), the distribution consists of the location's <exact
+/// values> most frequent values (default: 8; values seen only once don't
+/// qualify), each with its frequency, plus a histogram of the remaining
+/// values: one range per magnitude_bucket() from stats.hpp, spanning the
+/// bucket's smallest and largest value.
+///
+/// The distributions are written to <table> in the format that
+/// ramfuzz::runtime::value_table reads, with each distribution stored as an
+/// alias table.  Tests then sample from them when run with
+/// RAMFUZZ_DISTRIBUTIONS=<table>.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "logfile.hpp"
+#include "stats.hpp"
+
+using namespace ramfuzz::tools;
+using namespace std;
+
+namespace {
+
+/// Must match ramfuzz::runtime::value_table.
+constexpr uint64_t magic = 0x3173747369646672; // "rfdists1"
+struct site {
+  uint64_t id;
+  uint32_t first, count;
+};
+struct entry {
+  double lo, hi, prob;
+  uint32_t alias, pad;
+};
+
+/// Turns entries' weights (in prob) into an alias table, using Vose's method.
+void make_alias(entry *e, size_t n) {
+  double total = 0.;
+  for (size_t i = 0; i < n; ++i)
+    total += e[i].prob;
+  vector<uint32_t> small, large;
+  for (size_t i = 0; i < n; ++i) {
+    e[i].prob *= n / total;
+    e[i].alias = i;
+    (e[i].prob < 1. ? small : large).push_back(i);
+  }
+  while (!small.empty() && !large.empty()) {
+    const auto s = small.back(), l = large.back();
+    small.pop_back();
+    e[s].alias = l;
+    e[l].prob -= 1. - e[s].prob;
+    if (e[l].prob < 1.) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  // Whatever is left is 1 up to rounding error.
+  for (auto i : small)
+    e[i].prob = 1.;
+  for (auto i : large)
+    e[i].prob = 1.;
+}
+
+/// Appends a location's distribution, built from its value counts, to
+/// entries.
+void build(const unordered_map<double, size_t> &counts, size_t exact,
+           vector<entry> &entries) {
+  vector<pair<size_t, double>> by_count; // (Count, value).
+  for (const auto &c : counts)
+    by_count.emplace_back(c.second, c.first);
+  const auto top = min(exact, by_count.size());
+  partial_sort(by_count.begin(), by_count.begin() + top, by_count.end(),
+               [](const pair<size_t, double> &a,
+                  const pair<size_t, double> &b) { return a.first > b.first; });
+  const size_t first = entries.size();
+  size_t i = 0;
+  for (; i < top && by_count[i].first > 1; ++i)
+    entries.push_back({by_count[i].second, by_count[i].second,
+                       double(by_count[i].first), 0, 0});
+  map<int, entry> hist; // By bucket.
+  for (; i < by_count.size(); ++i) {
+    const double v = by_count[i].second;
+    const auto ins = hist.emplace(magnitude_bucket(v), entry{v, v, 0., 0, 0});
+    auto &e = ins.first->second;
+    e.lo = min(e.lo, v);
+    e.hi = max(e.hi, v);
+    e.prob += by_count[i].first;
+  }
+  for (const auto &h : hist)
+    entries.push_back(h.second);
+  make_alias(&entries[first], entries.size() - first);
+}
+
+void usage(const char *self) {
+  fprintf(stderr,
+          "usage: %s [-k <exact values>] [-m <min values>] -o <table> <log> "
+          "...\n",
+          self);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  size_t exact = 8, min_values = 5;
+  string outname;
+  int opt;
+  while ((opt = getopt(argc, argv, "k:m:o:")) != -1) {
+    switch (opt) {
+    case 'k':
+      exact = atoi(optarg);
+      break;
+    case 'm':
+      min_values = atoi(optarg);
+      break;
+    case 'o':
+      outname = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (outname.empty() || optind == argc) {
+    usage(argv[0]);
+    return 2;
+  }
+  // Value counts by location.
+  unordered_map<uint64_t, unordered_map<double, size_t>> values;
+  size_t runs = 0;
+  try {
+    for (int i = optind; i < argc; ++i) {
+      if (label_of(argv[i]) != label::success)
+        continue;
+      ++runs;
+      logfile log(argv[i]);
+      logfile::cursor c(log);
+      record r;
+      while (c.next(r))
+        ++values[r.id][r.value()];
+    }
+  } catch (const exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  vector<uint64_t> ids;
+  for (const auto &v : values) {
+    size_t n = 0;
+    for (const auto &c : v.second)
+      n += c.second;
+    if (n >= min_values)
+      ids.push_back(v.first);
+  }
+  sort(ids.begin(), ids.end());
+  vector<site> sites;
+  vector<entry> entries;
+  for (auto id : ids) {
+    const size_t first = entries.size();
+    build(values[id], exact, entries);
+    sites.push_back({id, uint32_t(first), uint32_t(entries.size() - first)});
+  }
+
+  ofstream out(outname, ios::binary);
+  const uint64_t hdr[4] = {magic, 0, sites.size(), entries.size()};
+  out.write(reinterpret_cast<const char *>(hdr), sizeof(hdr));
+  out.write(reinterpret_cast<const char *>(sites.data()),
+            sites.size() * sizeof(site));
+  out.write(reinterpret_cast<const char *>(entries.data()),
+            entries.size() * sizeof(entry));
+  if (!out) {
+    fprintf(stderr, "cannot write %s\n", outname.c_str());
+    return 1;
+  }
+  fprintf(stderr, "%zu successful runs, %zu locations, %zu entries\n", runs,
+          sites.size(), entries.size());
+  return 0;
+}
@@ -0,0 +1,323 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "logfile.hpp"
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string;
+using std::to_string;
+using std::vector;
+
+namespace {
+
+/// Returns a T whose bytes are at p, which may be unaligned.
+template <typename T> T load(const char *p) {
+  T val;
+  memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+/// Appends to out a metadata record with tag tag and the len bytes at body.
+void put_meta(unsigned char tag, const void *body, uint32_t len, string &out) {
+  out += char(tag);
+  out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+  out.append(static_cast<const char *>(body), len);
+}
+
+bool ends_with(const string &s, const char *suffix) {
+  const auto n = strlen(suffix);
+  return s.size() >= n && !s.compare(s.size() - n, n, suffix);
+}
+
+} // anonymous namespace
+
+namespace ramfuzz {
+namespace tools {
+
+// The following must match the specializations of ramfuzz::runtime::typetag.
+
+size_t valsize(char tag) {
+  switch (tag) {
+  case 0:
+    return sizeof(bool);
+  case 1:
+    return sizeof(char);
+  case 2:
+    return sizeof(unsigned char);
+  case 3:
+    return sizeof(short);
+  case 4:
+    return sizeof(unsigned short);
+  case 5:
+    return sizeof(int);
+  case 6:
+    return sizeof(unsigned int);
+  case 7:
+    return sizeof(long);
+  case 8:
+    return sizeof(unsigned long);
+  case 9:
+    return sizeof(long long);
+  case 10:
+    return sizeof(unsigned long long);
+  case 11:
+    return sizeof(float);
+  case 12:
+    return sizeof(double);
+  default:
+    return 0;
+  }
+}
+
+const char *tagname(char tag) {
+  static const char *names[] = {
+      "bool", "char",  "uchar",    "short",     "ushort", "int",   "uint",
+      "long", "ulong", "longlong", "ulonglong", "float",  "double"};
+  return valsize(tag) ? names[int(tag)] : "?";
+}
+
+double record::value() const {
+  switch (tag) {
+  case 0:
+    return load<bool>(val);
+  case 1:
+    return load<char>(val);
+  case 2:
+    return load<unsigned char>(val);
+  case 3:
+    return load<short>(val);
+  case 4:
+    return load<unsigned short>(val);
+  case 5:
+    return load<int>(val);
+  case 6:
+    return load<unsigned int>(val);
+  case 7:
+    return load<long>(val);
+  case 8:
+    return load<unsigned long>(val);
+  case 9:
+    return load<long long>(val);
+  case 10:
+    return load<unsigned long long>(val);
+  case 11:
+    return load<float>(val);
+  case 12:
+    return load<double>(val);
+  default:
+    return 0.;
+  }
+}
+
+string record::bytes() const {
+  string b(1, tag);
+  b.append(val, valsize(tag));
+  b.append(reinterpret_cast<const char *>(&id), sizeof(id));
+  return b;
+}
+
+logfile::logfile(const string &name) : name_(name) {
+  const int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw log_error("Cannot open " + name);
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    throw log_error("Cannot stat " + name);
+  }
+  size_ = st.st_size;
+  if (size_) {
+    void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      throw log_error("Cannot map " + name);
+    }
+    madvise(p, size_, MADV_SEQUENTIAL);
+    data_ = static_cast<const char *>(p);
+  }
+  close(fd);
+}
+
+logfile::~logfile() {
+  if (data_)
+    munmap(const_cast<char *>(data_), size_);
+}
+
+bool logfile::read(size_t off, record &r, log_meta &meta) const {
+  auto &cct = meta.cct;
+  r.skipped = 0;
+  for (; off < size_ && static_cast<unsigned char>(data_[off]) >= meta_tag;) {
+    uint32_t len;
+    if (size_ - off < 1 + sizeof(len) ||
+        size_ - off - 1 - sizeof(len) < (len = load<uint32_t>(data_ + off + 1)))
+      throw log_error(name_ + ": truncated metadata at offset " +
+                      to_string(off));
+    const unsigned char tag = data_[off];
+    const char *body = data_ + off + 1 + sizeof(len);
+    if (tag == cct_tag) {
+      cct_node n;
+      if (len < sizeof(n.parent) + sizeof(n.site))
+        throw log_error(name_ + ": short CCT node at offset " + to_string(off));
+      n.parent = load<uint32_t>(body);
+      n.site = load<uint64_t>(body + sizeof(n.parent));
+      if (n.parent >= cct.size())
+        throw log_error(name_ + ": unknown CCT parent at offset " +
+                        to_string(off));
+      n.id = cct_id(cct[n.parent].id, n.site);
+      cct.push_back(n);
+    } else if (tag == module_tag) {
+      uint32_t idlen;
+      if (len < sizeof(meta.base) + sizeof(idlen) ||
+          len - sizeof(meta.base) - sizeof(idlen) <
+              (idlen = load<uint32_t>(body + sizeof(meta.base))))
+        throw log_error(name_ + ": short module at offset " + to_string(off));
+      meta.base = load<uint64_t>(body);
+      const auto id = body + sizeof(meta.base) + sizeof(idlen);
+      meta.build_id.assign(id, idlen);
+      meta.path.assign(id + idlen, body + len);
+    } else if (tag == source_tag) {
+      if (len < sizeof(uint64_t))
+        throw log_error(name_ + ": short source site at offset " +
+                        to_string(off));
+      meta.sources[load<uint64_t>(body)].assign(body + sizeof(uint64_t),
+                                                body + len);
+    } else if (tag == seed_tag && len == sizeof(meta.seed)) {
+      meta.seeded = true;
+      meta.seed = load<uint64_t>(body);
+    } else if (tag == stream_tag && len == sizeof(meta.stream)) {
+      meta.streams = true;
+      meta.stream = load<uint64_t>(body);
+    } else if (tag == skip_tag && len == sizeof(uint32_t)) {
+      r.skipped += load<uint32_t>(body);
+    }
+    off += 1 + sizeof(len) + len;
+  }
+  if (off >= size_)
+    return false;
+  const bool compact = data_[off] & compact_flag;
+  r.tag = data_[off] & ~compact_flag;
+  r.offset = off;
+  const auto vsz = valsize(r.tag);
+  if (!vsz)
+    throw log_error(name_ + ": unknown type tag " + to_string(int(r.tag)) +
+                    " at offset " + to_string(off));
+  r.len = 1 + vsz + (compact ? sizeof(r.node) : sizeof(r.id));
+  if (size_ - off < r.len)
+    throw log_error(name_ + ": truncated record at offset " + to_string(off));
+  r.val = data_ + off + 1;
+  r.stream = meta.stream;
+  if (compact) {
+    r.node = load<uint32_t>(r.val + vsz);
+    if (r.node >= cct.size())
+      throw log_error(name_ + ": unknown CCT node at offset " +
+                      to_string(off));
+    r.id = cct[r.node].id;
+  } else {
+    r.node = 0;
+    r.id = load<uint64_t>(r.val + vsz);
+  }
+  return true;
+}
+
+void log_encoder::add(const record &rec, const log_meta &meta, string &out) {
+  start(meta, out);
+  if (meta.streams && rec.stream != stream) {
+    stream = rec.stream;
+    put_meta(stream_tag, &stream, sizeof(stream), out);
+  }
+  for (auto left = rec.skipped; left;) {
+    const uint32_t n = std::min<uint64_t>(left, UINT32_MAX);
+    put_meta(skip_tag, &n, sizeof(n), out);
+    left -= n;
+  }
+  if (!rec.node) {
+    out += rec.bytes();
+    return;
+  }
+  // Define the node's missing ancestors, outermost first.
+  const auto &cct = meta.cct;
+  vector<uint32_t> missing;
+  for (auto i = rec.node; !nodes.count(cct[i].id); i = cct[i].parent)
+    missing.push_back(i);
+  // Name the binary before the first node and sites before their first nodes,
+  // as ramfuzz::runtime::gen does.
+  if (nodes.size() == 1 && !missing.empty() && !meta.path.empty()) {
+    const uint32_t idlen = meta.build_id.size();
+    string body(reinterpret_cast<const char *>(&meta.base), sizeof(meta.base));
+    body.append(reinterpret_cast<const char *>(&idlen), sizeof(idlen));
+    body += meta.build_id + meta.path;
+    put_meta(module_tag, body.data(), body.size(), out);
+  }
+  for (auto it = missing.rbegin(); it != missing.rend(); ++it) {
+    const auto &n = cct[*it];
+    const auto name = meta.sources.find(n.site);
+    if (name != meta.sources.end() && named.insert(n.site).second) {
+      string body(reinterpret_cast<const char *>(&n.site), sizeof(n.site));
+      body += name->second;
+      put_meta(source_tag, body.data(), body.size(), out);
+    }
+    char body[sizeof(uint32_t) + sizeof(n.site)];
+    const uint32_t parent = nodes.at(cct[n.parent].id);
+    memcpy(body, &parent, sizeof(parent));
+    memcpy(body + sizeof(parent), &n.site, sizeof(n.site));
+    put_meta(cct_tag, body, sizeof(body), out);
+    nodes.emplace(n.id, uint32_t(nodes.size()));
+  }
+  const auto node = nodes.at(rec.id);
+  out += char(rec.tag | compact_flag);
+  out.append(rec.val, valsize(rec.tag));
+  out.append(reinterpret_cast<const char *>(&node), sizeof(node));
+}
+
+void log_encoder::start(const log_meta &meta, string &out) {
+  if (started)
+    return;
+  started = true;
+  // In the order ramfuzz::runtime::gen writes them.
+  if (meta.streams)
+    put_meta(stream_tag, &stream, sizeof(stream), out);
+  if (meta.seeded)
+    put_meta(seed_tag, &meta.seed, sizeof(meta.seed), out);
+}
+
+uint64_t digest(const char *p, size_t n) {
+  // FNV-1a over 8-byte words, with a final avalanche from MurmurHash3.
+  uint64_t h = 0xcbf29ce484222325ULL ^ n;
+  for (; n >= 8; p += 8, n -= 8)
+    h = (h ^ load<uint64_t>(p)) * 0x100000001b3ULL;
+  for (; n; ++p, --n)
+    h = (h ^ static_cast<unsigned char>(*p)) * 0x100000001b3ULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 33);
+}
+
+label label_of(const string &fname) {
+  if (ends_with(fname, ".s"))
+    return label::success;
+  if (ends_with(fname, ".f"))
+    return label::failure;
+  return label::unknown;
+}
+
+} // namespace tools
+} // namespace ramfuzz
@@ -0,0 +1,224 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace ramfuzz {
+namespace tools {
+
+/// Exception thrown when a log can't be opened or is malformed.
+struct log_error : public std::runtime_error {
+  explicit log_error(const std::string &s) : runtime_error(s) {}
+};
+
+/// Size of the value following the type tag in a log record, or 0 if tag is
+/// unknown.  Must match the specializations of ramfuzz::runtime::typetag.
+size_t valsize(char tag);
+
+/// Log format constants; must match ../runtime/ramfuzz-rt.hpp, which also
+/// describes the format.
+constexpr char compact_flag = 0x20;
+constexpr unsigned char meta_tag = 0x40;
+constexpr unsigned char cct_tag = meta_tag;
+constexpr unsigned char module_tag = meta_tag + 1;
+constexpr unsigned char source_tag = meta_tag + 2;
+constexpr unsigned char seed_tag = meta_tag + 3;
+constexpr unsigned char skip_tag = meta_tag + 4;
+constexpr unsigned char stream_tag = meta_tag + 5;
+
+/// Location ID of a calling-context-tree node.  Must match
+/// ramfuzz::runtime::cct_id().
+inline uint64_t cct_id(uint64_t parent_id, uint64_t site) {
+  return parent_id ^
+         (site + 0x9e3779b9 + (parent_id << 6) + (parent_id >> 2));
+}
+
+/// A node of a log's calling-context tree.
+struct cct_node {
+  uint32_t parent; ///< Index of the parent node; the root is 0.
+  uint64_t site;   ///< Call site (a PC relative to the runtime's).
+  uint64_t id;     ///< Location ID.
+};
+
+/// What a log's metadata records say so far.
+struct log_meta {
+  /// CCT nodes, indexed by node; [0] is the root.
+  std::vector<cct_node> cct = std::vector<cct_node>(1, cct_node{0, 0, 0});
+
+  /// The binary the call sites are in: sites are relative to its virtual
+  /// address base.  Empty path if the log doesn't say.
+  uint64_t base = 0;
+  std::string build_id; ///< Raw bytes.
+  std::string path;
+
+  /// Names of source-position call sites, by site.  See
+  /// ramfuzz::runtime::gen::use_source_ids().
+  std::unordered_map<uint64_t, std::string> sources;
+
+  /// Whether the log has a random seed, and what it is.  Replaying such a log
+  /// regenerates values it doesn't hold (see
+  /// ramfuzz::runtime::gen::filter_sites() and use_streams()); rewriting it
+  /// with log_encoder keeps the seed.
+  bool seeded = false;
+  uint64_t seed = 0;
+
+  /// Whether the log is partitioned into streams (see
+  /// ramfuzz::runtime::gen::use_streams()), and the stream being read.
+  bool streams = false;
+  uint64_t stream = 0;
+};
+
+/// Human-readable name of the type denoted by tag.
+const char *tagname(char tag);
+
+/// One record of a RamFuzz log: a value and its location ID.  Points into the
+/// memory of the logfile it came from, so it's only valid while that logfile
+/// is.  See ../runtime/ramfuzz-rt.hpp for the log format.
+struct record {
+  char tag;           ///< Value's type tag, without compact_flag.
+  const char *val;    ///< Raw value bytes; there are valsize(tag) of them.
+  uint64_t id;        ///< Location ID.
+  uint32_t node;      ///< CCT node, or 0 if the log gives the ID directly.
+  uint64_t skipped;   ///< Values a sparse log left out just before this one.
+  uint64_t stream;    ///< Stream the value belongs to; 0 if the log has none.
+  size_t offset;      ///< Offset of the record's first byte in the log.
+  size_t len;         ///< Size of the whole record in the log.
+
+  /// The value converted to double, like ../pymod does it.
+  double value() const;
+
+  /// Size of the whole record in the log.
+  size_t size() const { return len; }
+
+  /// The record encoded with its full location ID, which doesn't depend on
+  /// the log's CCT.  Logs made of such records replay like the original.
+  std::string bytes() const;
+
+  /// True iff that has the same type and bit-identical value.
+  bool same_value(const record &that) const {
+    return tag == that.tag && !memcmp(val, that.val, valsize(tag));
+  }
+};
+
+/// A RamFuzz log file mapped into memory for reading.  Cheap to iterate over,
+/// even for huge logs.
+class logfile {
+public:
+  /// Maps the named file.  Throws log_error if that fails.
+  explicit logfile(const std::string &name);
+  ~logfile();
+  logfile(const logfile &) = delete;
+  logfile &operator=(const logfile &) = delete;
+
+  const std::string &name() const { return name_; }
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  /// Reads the value record at offset off into r, skipping any metadata
+  /// records there and adding what they say to meta.  Returns false at the end
+  /// of the log.  Throws log_error if a record is malformed or truncated, or
+  /// refers to a CCT node that isn't in meta.
+  bool read(size_t off, record &r, log_meta &meta) const;
+
+  /// Iterates over value records in log order.
+  class cursor {
+  public:
+    explicit cursor(const logfile &log) : log(log) {}
+
+    /// Reads the next record into r and advances.  Returns false at the end of
+    /// the log.
+    bool next(record &r) {
+      if (!log.read(off, r, meta_))
+        return false;
+      off = r.offset + r.size();
+      ++idx;
+      return true;
+    }
+
+    /// How many records next() has returned so far.
+    size_t count() const { return idx; }
+
+    /// The CCT nodes defined so far, indexed by node; [0] is the root.
+    const std::vector<cct_node> &cct() const { return meta_.cct; }
+
+    /// The metadata read so far.
+    const log_meta &meta() const { return meta_; }
+
+  private:
+    const logfile &log;
+    size_t off = 0, idx = 0;
+    log_meta meta_;
+  };
+
+private:
+  std::string name_;
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+/// Writes records from logs as a compact log of its own.  It defines CCT nodes
+/// as its records first need them and numbers them itself, so the bytes it
+/// writes depend only on the records' types, values, location IDs, streams,
+/// and left-out values (and on the log's seed, binary, and call-site names),
+/// not on how their logs numbered the nodes.  Logs with the same records thus
+/// start with the same bytes.  Like the runtime, it names the binary before
+/// the first node and each source-position call site before the first node at
+/// that site, so ramfuzz-symbolize can read its output.
+class log_encoder {
+public:
+  /// Appends rec to out, as a compact record after the definitions of any of
+  /// its nodes not written yet, and after the metadata records placing it in
+  /// its stream after rec.skipped left-out values.  meta is what rec's log
+  /// says; the first call also writes its seed and stream metadata.  A record
+  /// without a node (from a log giving IDs directly) is appended in long form.
+  void add(const record &rec, const log_meta &meta, std::string &out);
+
+  /// Ends the log.  Only needed for a log that may have no records, which
+  /// still has to say whether it's seeded and partitioned into streams.
+  void end(const log_meta &meta, std::string &out) { start(meta, out); }
+
+private:
+  /// Writes meta's seed and stream metadata, unless that's already done.
+  void start(const log_meta &meta, std::string &out);
+
+  bool started = false;
+  uint64_t stream = 0; ///< The stream the last record written belongs to.
+
+  /// Our node numbers, by location ID.
+  std::unordered_map<uint64_t, uint32_t> nodes{{0, 0}};
+
+  /// Call sites whose names are written already.
+  std::unordered_set<uint64_t> named;
+};
+
+/// A 64-bit hash of n bytes at p.  Fast, but not cryptographic.
+uint64_t digest(const char *p, size_t n);
+
+/// Corpus label of a log file, based on its name suffix (see ../ai/gencorp.py).
+enum class label { success, failure, unknown };
+
+/// Returns the label for a log file name.
+label label_of(const std::string &fname);
+
+} // namespace tools
+} // namespace ramfuzz
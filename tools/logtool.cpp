@@ -0,0 +1,241 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Inspects RamFuzz logs without needing ../pymod.  Usage:
+///
+/// ramfuzz-logtool dump <log>
+///   Prints every record in <log>: position, type, value, and location.  For a
+///   sparse log (see ramfuzz::runtime::gen::filter_sites()), also notes where
+///   values were left out; for a stream log (see use_streams() there), where
+///   the records switch to another stream.
+///
+/// ramfuzz-logtool grep <location> <log> ...
+///   Prints every record at <location> in the given logs as
+///   <log>:<position> <type> <value>.  Exits with 1 if there are no hits.
+///
+/// ramfuzz-logtool stats <log> ...
+///   Prints per-location statistics over all the given logs: count, min, max,
+///   mean, and standard deviation.  Most frequent locations come first.
+///
+/// ramfuzz-logtool diff <log1> <log2>
+///   Walks both logs in lockstep.  Prints every position where the two logs
+///   have the same location but different values, until the first position
+///   where the locations themselves differ (the point where the two runs took
+///   different paths).  Exits with 0 iff the logs are identical.  Useful for
+///   comparing a .s run with a .f run, or a log with its replay output (the
+///   file with a "+" appended to its name).
+///
+/// ramfuzz-logtool cct <log>
+///   Prints the calling-context tree <log> defines: a line per node with its
+///   index, parent, depth, call site, and location (and the site's source
+///   position, if the log names it), children indented under their parents.
+///   Records' locations are the locations of these nodes.
+///
+/// Positions are 1-based, like ../ai/loggrep.py's line numbers; locations are
+/// the same numbers ../ai/logdump.py prints.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "logfile.hpp"
+#include "stats.hpp"
+
+using namespace ramfuzz::tools;
+using namespace std;
+
+namespace {
+
+void print_record(const char *prefix, const record &r) {
+  printf("%s%s %.17g %llu\n", prefix, tagname(r.tag), r.value(),
+         static_cast<unsigned long long>(r.id));
+}
+
+int dump(const char *fname) {
+  logfile log(fname);
+  logfile::cursor c(log);
+  record r;
+  uint64_t stream = 0;
+  while (c.next(r)) {
+    if (r.stream != stream)
+      printf("(stream %llu)\n", static_cast<unsigned long long>(r.stream));
+    stream = r.stream;
+    if (r.skipped)
+      printf("(%llu values left out)\n",
+             static_cast<unsigned long long>(r.skipped));
+    printf("%zu ", c.count());
+    print_record("", r);
+  }
+  return 0;
+}
+
+int grep(const char *locstr, char **fnames, int count) {
+  char *end;
+  const uint64_t loc = strtoull(locstr, &end, 0);
+  if (*end) {
+    fprintf(stderr, "bad location: %s\n", locstr);
+    return 2;
+  }
+  size_t hits = 0;
+  for (int i = 0; i < count; ++i) {
+    logfile log(fnames[i]);
+    logfile::cursor c(log);
+    record r;
+    while (c.next(r))
+      if (r.id == loc) {
+        printf("%s:%zu %s %.17g\n", fnames[i], c.count(), tagname(r.tag),
+               r.value());
+        ++hits;
+      }
+  }
+  return hits == 0;
+}
+
+int stats(char **fnames, int count) {
+  unordered_map<uint64_t, site_stats> sites;
+  for (int i = 0; i < count; ++i) {
+    logfile log(fnames[i]);
+    logfile::cursor c(log);
+    record r;
+    while (c.next(r))
+      sites[r.id].add(r.value());
+  }
+  vector<pair<uint64_t, const site_stats *>> sorted;
+  sorted.reserve(sites.size());
+  for (const auto &s : sites)
+    sorted.emplace_back(s.first, &s.second);
+  sort(sorted.begin(), sorted.end(),
+       [](const pair<uint64_t, const site_stats *> &a,
+          const pair<uint64_t, const site_stats *> &b) {
+         return a.second->count != b.second->count
+                    ? a.second->count > b.second->count
+                    : a.first < b.first;
+       });
+  printf("%-20s %12s %14s %14s %14s %14s\n", "location", "count", "min", "max",
+         "mean", "stddev");
+  for (const auto &s : sorted)
+    printf("%-20llu %12llu %14.6g %14.6g %14.6g %14.6g\n",
+           static_cast<unsigned long long>(s.first),
+           static_cast<unsigned long long>(s.second->count), s.second->min,
+           s.second->max, s.second->mean, sqrt(s.second->variance()));
+  return 0;
+}
+
+int cct(const char *fname) {
+  logfile log(fname);
+  logfile::cursor c(log);
+  record r;
+  while (c.next(r))
+    ;
+  const auto &nodes = c.cct();
+  const auto &sources = c.meta().sources;
+  vector<vector<uint32_t>> kids(nodes.size());
+  for (uint32_t i = 1; i < nodes.size(); ++i)
+    kids[nodes[i].parent].push_back(i);
+  printf("%-6s %-6s %-5s %-18s %s\n", "node", "parent", "depth", "site",
+         "location");
+  // Depth-first, so each node's children follow it.
+  vector<pair<uint32_t, unsigned>> stack(1, make_pair(0u, 0u));
+  while (!stack.empty()) {
+    const auto n = stack.back();
+    stack.pop_back();
+    if (n.first) {
+      const auto src = sources.find(nodes[n.first].site);
+      printf("%-6u %-6u %-5u %*s%#-18llx %llu%s%s\n", n.first,
+             nodes[n.first].parent, n.second, 2 * (n.second - 1), "",
+             static_cast<unsigned long long>(nodes[n.first].site),
+             static_cast<unsigned long long>(nodes[n.first].id),
+             src == sources.end() ? "" : " ",
+             src == sources.end() ? "" : src->second.c_str());
+    }
+    for (auto k = kids[n.first].rbegin(); k != kids[n.first].rend(); ++k)
+      stack.emplace_back(*k, n.second + 1);
+  }
+  return 0;
+}
+
+int diff(const char *fname1, const char *fname2) {
+  logfile log1(fname1), log2(fname2);
+  logfile::cursor c1(log1), c2(log2);
+  record r1, r2;
+  size_t valdiffs = 0;
+  for (;;) {
+    const bool more1 = c1.next(r1), more2 = c2.next(r2);
+    if (!more1 && !more2)
+      break;
+    if (more1 != more2) {
+      printf("%s ends at position %zu\n", more1 ? fname2 : fname1,
+             more1 ? c1.count() : c2.count());
+      return 1;
+    }
+    if (r1.id != r2.id) {
+      printf("paths diverge at position %zu:\n", c1.count());
+      print_record("< ", r1);
+      print_record("> ", r2);
+      return 1;
+    }
+    if (!r1.same_value(r2)) {
+      printf("%zu: location %llu\n", c1.count(),
+             static_cast<unsigned long long>(r1.id));
+      print_record("< ", r1);
+      print_record("> ", r2);
+      ++valdiffs;
+    }
+  }
+  return valdiffs != 0;
+}
+
+void usage(const char *self) {
+  fprintf(stderr,
+          "usage: %s dump <log>\n"
+          "       %s grep <location> <log> ...\n"
+          "       %s stats <log> ...\n"
+          "       %s diff <log1> <log2>\n"
+          "       %s cct <log>\n",
+          self, self, self, self, self);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    usage(argv[0]);
+    return 2;
+  }
+  const string cmd(argv[1]);
+  try {
+    if (cmd == "dump" && argc == 3)
+      return dump(argv[2]);
+    if (cmd == "grep" && argc >= 4)
+      return grep(argv[2], argv + 3, argc - 3);
+    if (cmd == "stats")
+      return stats(argv + 2, argc - 2);
+    if (cmd == "diff" && argc == 4)
+      return diff(argv[2], argv[3]);
+    if (cmd == "cct" && argc == 3)
+      return cct(argv[2]);
+  } catch (const log_error &e) {
+    fflush(stdout);
+    fprintf(stderr, "%s\n", e.what());
+    return 2;
+  }
+  usage(argv[0]);
+  return 2;
+}
@@ -0,0 +1,225 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "logtrie.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "logfile.hpp"
+
+using namespace std;
+
+namespace ramfuzz {
+namespace tools {
+
+constexpr uint32_t trie_builder::none;
+
+void trie_builder::add(const string &fname) {
+  logfile log(fname);
+  logfile::cursor c(log);
+  record r;
+  log_encoder enc;
+  string recs;
+  vector<uint32_t> ends; // Where each record's bytes in recs end.
+  while (c.next(r)) {
+    enc.add(r, c.meta(), recs);
+    ends.push_back(recs.size());
+  }
+  if (ends.empty()) {
+    enc.end(c.meta(), recs);
+    if (!recs.empty())
+      ends.push_back(recs.size());
+  }
+  uint32_t cur = 0, from = 0;
+  for (const auto end : ends) {
+    cur = child(cur, recs.data() + from, end - from);
+    from = end;
+  }
+  if (v[cur].leaf < 0) {
+    v[cur].leaf = names.size();
+    names.emplace_back();
+  }
+  names[v[cur].leaf].push_back(fname);
+}
+
+uint32_t trie_builder::child(uint32_t parent, const char *rec, uint32_t n) {
+  const auto key = digest(rec, n) ^ parent * 0x9e3779b97f4a7c15ULL;
+  const auto found = kids.find(key);
+  if (found != kids.end()) {
+    const auto &k = v[found->second];
+    if (k.parent == parent && k.len == n && !bytes.compare(k.off, n, rec, n))
+      return found->second;
+  }
+  const uint32_t i = v.size();
+  v.emplace_back();
+  v[i].parent = parent;
+  v[i].off = bytes.size();
+  v[i].len = n;
+  v[i].next = v[parent].first;
+  v[parent].first = i;
+  bytes.append(rec, n);
+  kids.emplace(key, i);
+  return i;
+}
+
+size_t trie_builder::write(const string &fname) const {
+  // Number nodes breadth-first, so each node's children are contiguous.
+  vector<trie_node> nodes;
+  string data;
+  vector<const vector<string> *> leaf_names;
+  queue<uint32_t> q;
+  q.push(0);
+  uint32_t next = 1; // Index the next enqueued node will get.
+  while (!q.empty()) {
+    uint32_t i = q.front();
+    q.pop();
+    trie_node n{data.size(), 0, 0, 0, -1};
+    data.append(bytes, v[i].off, v[i].len);
+    while (v[i].first != none && v[v[i].first].next == none &&
+           v[i].leaf < 0) {
+      i = v[i].first;
+      data.append(bytes, v[i].off, v[i].len);
+    }
+    n.len = data.size() - n.off;
+    n.first = next;
+    for (auto k = v[i].first; k != none; k = v[k].next) {
+      q.push(k);
+      ++n.count;
+    }
+    next += n.count;
+    if (v[i].leaf >= 0) {
+      n.leaf = leaf_names.size();
+      leaf_names.push_back(&names[v[i].leaf]);
+    }
+    nodes.push_back(n);
+  }
+  ofstream f(fname, ios::binary);
+  const uint64_t hdr[4] = {trie_magic, nodes.size(), leaf_names.size(),
+                           data.size()};
+  f.write(reinterpret_cast<const char *>(hdr), sizeof(hdr));
+  f.write(reinterpret_cast<const char *>(nodes.data()),
+          nodes.size() * sizeof(trie_node));
+  f << data;
+  for (const auto n : leaf_names) {
+    for (size_t i = 0; i < n->size(); ++i)
+      f << (i ? "\t" : "") << (*n)[i];
+    f << '\n';
+  }
+  if (!f)
+    throw runtime_error("cannot write " + fname);
+  return data.size();
+}
+
+trie_file::trie_file(const string &fname) {
+  ifstream f(fname, ios::binary);
+  uint64_t hdr[4];
+  if (!f.read(reinterpret_cast<char *>(hdr), sizeof(hdr)) ||
+      hdr[0] != trie_magic)
+    throw runtime_error(fname + " is not a trie");
+  nodes.resize(hdr[1]);
+  data.resize(hdr[3]);
+  f.read(reinterpret_cast<char *>(&nodes[0]), nodes.size() * sizeof(trie_node));
+  f.read(&data[0], data.size());
+  string line;
+  while (getline(f, line)) {
+    names.emplace_back();
+    istringstream fields(line);
+    string name;
+    while (getline(fields, name, '\t'))
+      names.back().push_back(name);
+  }
+  if (!f.eof() || nodes.empty() || names.size() != hdr[2])
+    throw runtime_error(fname + " is truncated");
+}
+
+string trie_file::log(int32_t leaf) const {
+  vector<uint32_t> parent(nodes.size());
+  uint32_t at = nodes.size();
+  for (uint32_t i = 0; i < nodes.size(); ++i) {
+    for (uint32_t k = 0; k < nodes[i].count; ++k)
+      parent[nodes[i].first + k] = i;
+    if (nodes[i].leaf == leaf)
+      at = i;
+  }
+  if (at == nodes.size())
+    throw runtime_error("no leaf " + to_string(leaf));
+  vector<uint32_t> path;
+  for (; at; at = parent[at])
+    path.push_back(at);
+  path.push_back(0);
+  string out;
+  for (auto it = path.rbegin(); it != path.rend(); ++it)
+    out.append(data, nodes[*it].off, nodes[*it].len);
+  return out;
+}
+
+int32_t trie_file::sole_leaf(uint32_t i) const {
+  for (;; i = nodes[i].first) {
+    if (!nodes[i].count)
+      return nodes[i].leaf;
+    if (nodes[i].count > 1 || nodes[i].leaf >= 0)
+      return -1;
+  }
+}
+
+vector<vector<leaf_outcome>> replay_tries(runner &r, const string &exe,
+                                          const vector<string> &tries,
+                                          unsigned timeout) {
+  // Each replay reports into its own results file; env passes it the name.
+  vector<string> results;
+  vector<vector<string>> cmds;
+  for (const auto &t : tries) {
+    string tmpl = temp_template("ramfuzz-trie");
+    const int fd = mkstemp(&tmpl[0]);
+    if (fd < 0)
+      throw runtime_error("cannot create a temporary file");
+    close(fd);
+    results.push_back(tmpl);
+    cmds.push_back({"/usr/bin/env", "RAMFUZZ_TRIE_RESULTS=" + results.back(),
+                    "RAMFUZZ_TRIE_TIMEOUT=" + to_string(timeout), exe, t});
+  }
+  const auto tops = r.run(cmds);
+  vector<vector<leaf_outcome>> outcomes;
+  for (size_t i = 0; i < tries.size(); ++i) {
+    const trie_file t(tries[i]);
+    outcomes.emplace_back(t.names.size());
+    auto &out = outcomes.back();
+    // If the trie doesn't branch, the executable never forked.
+    const auto sole = t.sole_leaf(0);
+    if (sole >= 0) {
+      out[sole].o = tops[i];
+      out[sole].known = true;
+    }
+    ifstream f(results[i]);
+    int leaf, status;
+    while (f >> leaf >> status)
+      if (leaf >= 0 && size_t(leaf) < out.size()) {
+        out[leaf].o.status = WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+        out[leaf].o.signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+        out[leaf].known = true;
+      }
+    unlink(results[i].c_str());
+  }
+  return outcomes;
+}
+
+} // namespace tools
+} // namespace ramfuzz
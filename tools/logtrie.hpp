@@ -0,0 +1,118 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "runner.hpp"
+
+namespace ramfuzz {
+namespace tools {
+
+/// Trie file format (all numbers little-endian), which must match
+/// ramfuzz::runtime::trie_buf:
+/// - four 64-bit words: magic "\0rftrie1", node count, leaf count, data size;
+/// - nodes (see trie_node), in breadth-first order with the root first;
+/// - data: the nodes' log bytes, such that the bytes along every path from
+///   the root make up a valid log (in the compact form written by
+///   log_encoder, with CCT definitions before their first use on the path);
+/// - names: a line per leaf, with the leaf's log names separated by tabs.
+constexpr uint64_t trie_magic = 0x3165697274667200; // "\0rftrie1"
+
+struct trie_node {
+  uint64_t off;   ///< Offset of the node's bytes in the data.
+  uint32_t len;   ///< How many bytes.
+  uint32_t first; ///< Index of the first child.
+  uint32_t count; ///< How many children.
+  int32_t leaf;   ///< Index of the log ending here, or -1.
+};
+
+/// Builds a trie of logs, one record per edge.  Each log is re-encoded with
+/// log_encoder, so that logs with the same records share the same bytes and
+/// thus the same path, whatever their original CCT numbering.
+class trie_builder {
+public:
+  /// Adds the log in file fname.  Throws log_error if it can't be read.
+  void add(const std::string &fname);
+
+  /// Writes the trie to file fname, compressing chains of records with no
+  /// branches into single nodes.  Returns the number of data bytes.  Throws
+  /// std::runtime_error if the file can't be written.
+  size_t write(const std::string &fname) const;
+
+  /// How many distinct logs were added.
+  size_t leaves() const { return names.size(); }
+
+private:
+  static constexpr uint32_t none = UINT32_MAX;
+
+  struct vertex {
+    uint32_t parent = 0;   ///< Vertex above; the root's is itself.
+    uint64_t off = 0;      ///< Offset in bytes of the record leading here.
+    uint32_t len = 0;      ///< Size of that record and its CCT definitions.
+    uint32_t first = none; ///< First child.
+    uint32_t next = none;  ///< Next sibling.
+    int32_t leaf = -1;     ///< Index in names of the logs ending here, or -1.
+  };
+
+  /// Returns the child of vertex parent whose record is the n bytes at rec,
+  /// adding it if there's none.
+  uint32_t child(uint32_t parent, const char *rec, uint32_t n);
+
+  std::vector<vertex> v = std::vector<vertex>(1);
+  std::string bytes; ///< All vertices' records.
+  /// Children, keyed by a hash of the parent and the record.  A record whose
+  /// key collides just gets a vertex of its own.
+  std::unordered_map<uint64_t, uint32_t> kids;
+  std::vector<std::vector<std::string>> names; ///< Logs ending at a vertex.
+};
+
+/// A trie read from a file.
+struct trie_file {
+  std::vector<trie_node> nodes;
+  std::string data;
+  std::vector<std::vector<std::string>> names; ///< Log names, by leaf.
+
+  /// Reads file fname.  Throws std::runtime_error if it isn't a valid trie.
+  explicit trie_file(const std::string &fname);
+
+  /// Returns the bytes of the log at the given leaf.
+  std::string log(int32_t leaf) const;
+
+  /// The leaf whose log's replay covers the whole subtree at node i, or -1 if
+  /// the subtree branches.  Like ramfuzz::runtime::trie_buf::sole_leaf().
+  int32_t sole_leaf(uint32_t i) const;
+};
+
+/// Outcome of replaying one leaf of a trie.
+struct leaf_outcome {
+  outcome o;
+  bool known = false; ///< False if the replay never reached the leaf.
+};
+
+/// Replays each of tries (trie files) with exe, which must use gen(argc, argv),
+/// using runner r and killing each log's replay after timeout seconds (0: no
+/// limit).  Returns the outcomes by trie and leaf.  A leaf's outcome is
+/// unknown if the executable exited before reaching the point where the leaf
+/// branches off.  Throws std::runtime_error if temporary files can't be made.
+std::vector<std::vector<leaf_outcome>>
+replay_tries(runner &r, const std::string &exe,
+             const std::vector<std::string> &tries, unsigned timeout);
+
+} // namespace tools
+} // namespace ramfuzz
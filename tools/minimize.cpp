@@ -0,0 +1,388 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Shrinks a RamFuzz log that makes a test fail into a smaller log that makes
+/// it fail the same way.  Usage:
+///
+/// ramfuzz-minimize [-j <jobs>] [-t <timeout>] [-o <output>] <executable> <log>
+///
+/// <executable> must replay its first command-line argument, as tests using
+/// gen(argc, argv) do.  Failing "the same way" means exiting with the same
+/// status or signal, and having the same last location in the replay output
+/// log -- the location of the last value generated before the failure.
+///
+/// The minimizer repeatedly tries the following reductions on the log, keeping
+/// each one that still reproduces the failure:
+/// - deleting chunks of records, from halves of the log down to single records
+///   (this drops subtrees of make() calls that no longer matter, such as the
+///   objects of a container after its size was reduced); in a log partitioned
+///   into streams (see ramfuzz::runtime::gen::use_streams()), chunks are taken
+///   from one stream at a time, and the other streams' records are kept;
+/// - zeroing values (spin counts, container sizes, reuse decisions, etc.);
+/// - halving integer values.
+///
+/// Candidates are replayed in parallel, <jobs> at a time (default: one per
+/// core), each with a time limit of <timeout> seconds (default: 10).  The
+/// result is written to <output> (default: <log>.min).  It keeps the original
+/// log's seed, so values a seeded log left out are regenerated as before.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "logfile.hpp"
+#include "runner.hpp"
+
+using namespace ramfuzz::tools;
+using namespace std;
+
+namespace {
+
+/// What a failure looks like.
+struct signature {
+  outcome how;
+  bool has_loc = false; ///< False if nothing was logged before the failure.
+  uint64_t loc = 0;     ///< Location of the last logged value.
+
+  bool operator==(const signature &that) const {
+    return how == that.how && has_loc == that.has_loc && loc == that.loc;
+  }
+};
+
+/// Halves the integral value at p.  Returns false if that doesn't change it.
+template <typename T> bool halve(char *p) {
+  T val;
+  memcpy(&val, p, sizeof(val));
+  const T half = val / 2;
+  if (half == val)
+    return false;
+  memcpy(p, &half, sizeof(half));
+  return true;
+}
+
+/// A log record the minimizer can change.
+struct entry {
+  char tag;
+  string val; ///< Raw value bytes.
+  uint64_t id;
+  uint32_t node;
+  uint64_t skipped;
+  uint64_t stream;
+
+  explicit entry(const record &r)
+      : tag(r.tag), val(r.val, valsize(r.tag)), id(r.id), node(r.node),
+        skipped(r.skipped), stream(r.stream) {}
+
+  /// The record to encode, valid while this entry is unchanged.
+  record rec() const {
+    return record{tag, val.data(), id, node, skipped, stream, 0, 0};
+  }
+};
+
+/// Halves the value in e.  Returns false if the value can't be halved.
+bool halve_record(entry &e) {
+  char *p = &e.val[0];
+  switch (e.tag) {
+  case 1:
+    return halve<char>(p);
+  case 2:
+    return halve<unsigned char>(p);
+  case 3:
+    return halve<short>(p);
+  case 4:
+    return halve<unsigned short>(p);
+  case 5:
+    return halve<int>(p);
+  case 6:
+    return halve<unsigned int>(p);
+  case 7:
+    return halve<long>(p);
+  case 8:
+    return halve<unsigned long>(p);
+  case 9:
+    return halve<long long>(p);
+  case 10:
+    return halve<unsigned long long>(p);
+  default: // bool and floating-point values only get zeroed.
+    return false;
+  }
+}
+
+/// Zeroes the value in e.  Returns false if it's already zero.
+bool zero_record(entry &e) {
+  bool changed = false;
+  for (auto &b : e.val)
+    if (b) {
+      b = 0;
+      changed = true;
+    }
+  return changed;
+}
+
+class minimizer {
+public:
+  minimizer(const string &exe, const string &log, runner &r)
+      : exe(exe), tmpdir("ramfuzz-minimize"), run(r) {
+    logfile lf(log);
+    logfile::cursor c(lf);
+    record rec;
+    while (c.next(rec))
+      recs.emplace_back(rec);
+    meta = c.meta();
+    const auto sig = replay(vector<candidate>(1, recs));
+    target = sig[0];
+    if (!target.how.failed())
+      throw runtime_error(log + " doesn't fail when replayed");
+  }
+
+  /// Reduces the log as much as possible.
+  void minimize() {
+    bool progress;
+    do {
+      progress = delete_chunks();
+      progress |= shrink_values(zero_record);
+      progress |= shrink_values(halve_record);
+    } while (progress);
+  }
+
+  size_t records() const { return recs.size(); }
+  const signature &failure() const { return target; }
+  size_t tries() const { return ntries; }
+
+  /// The log of the records in cand, with the original log's seed, streams,
+  /// and CCT.
+  string encode(const vector<entry> &cand) const {
+    string out;
+    log_encoder enc;
+    for (const auto &e : cand)
+      enc.add(e.rec(), meta, out);
+    enc.end(meta, out);
+    return out;
+  }
+
+  /// The minimized log.
+  string encode() const { return encode(recs); }
+
+private:
+  using candidate = vector<entry>;
+
+  /// Replays candidates in parallel and returns their signatures.
+  vector<signature> replay(const vector<candidate> &cands) {
+    vector<string> logs;
+    for (size_t i = 0; i < cands.size(); ++i) {
+      logs.push_back(tmpdir.path() + "/c" + to_string(i));
+      ofstream f(logs.back(), ios::binary);
+      f << encode(cands[i]);
+      if (!f)
+        throw runtime_error("cannot write " + logs.back());
+    }
+    const auto outcomes = run.replay(exe, logs);
+    ntries += cands.size();
+    vector<signature> sigs(cands.size());
+    for (size_t i = 0; i < cands.size(); ++i) {
+      sigs[i].how = outcomes[i];
+      const auto outlog = logs[i] + "+";
+      try {
+        logfile lf(outlog);
+        logfile::cursor c(lf);
+        record r;
+        while (c.next(r)) {
+          sigs[i].has_loc = true;
+          sigs[i].loc = r.id;
+        }
+      } catch (const log_error &) {
+        // A missing or truncated output log just means a different signature.
+      }
+      unlink(logs[i].c_str());
+      unlink(outlog.c_str());
+    }
+    return sigs;
+  }
+
+  /// Replays cands (a jobs-sized batch at a time) and returns the index of the
+  /// first one failing like the original log, or cands.size() if none does.
+  size_t first_reproducing(const vector<candidate> &cands) {
+    for (size_t b = 0; b < cands.size(); b += run.jobs()) {
+      const auto e = min(cands.size(), b + run.jobs());
+      const auto sigs =
+          replay(vector<candidate>(cands.begin() + b, cands.begin() + e));
+      for (size_t i = 0; i < sigs.size(); ++i)
+        if (sigs[i] == target)
+          return b + i;
+    }
+    return cands.size();
+  }
+
+  /// Indices of stream's records in recs.
+  vector<size_t> in_stream(uint64_t stream) const {
+    vector<size_t> idx;
+    for (size_t i = 0; i < recs.size(); ++i)
+      if (recs[i].stream == stream)
+        idx.push_back(i);
+    return idx;
+  }
+
+  /// Tries deleting ever smaller chunks of records, one stream at a time:
+  /// since replay reads each stream separately, a chunk spanning streams
+  /// would make no sense.  Returns true iff anything was deleted.
+  bool delete_chunks() {
+    vector<uint64_t> streams;
+    for (const auto &e : recs)
+      if (find(streams.begin(), streams.end(), e.stream) == streams.end())
+        streams.push_back(e.stream);
+    bool progress = false;
+    for (auto s : streams)
+      progress |= delete_chunks(s);
+    return progress;
+  }
+
+  /// Returns recs without those at idx[from, to).
+  candidate without(const vector<size_t> &idx, size_t from, size_t to) const {
+    to = min(to, idx.size());
+    candidate cand;
+    for (size_t i = 0, k = from; i < recs.size(); ++i)
+      if (k < to && idx[k] == i)
+        ++k;
+      else
+        cand.push_back(recs[i]);
+    return cand;
+  }
+
+  /// delete_chunks() within stream.
+  bool delete_chunks(uint64_t stream) {
+    bool progress = false;
+    for (size_t chunk = in_stream(stream).size() / 2; chunk >= 1;
+         chunk /= 2) {
+      auto idx = in_stream(stream);
+      for (size_t b = 0; b < idx.size();) {
+        vector<candidate> cands;
+        vector<size_t> where;
+        for (size_t p = b; p < idx.size() && cands.size() < run.jobs();
+             p += chunk) {
+          cands.push_back(without(idx, p, p + chunk));
+          where.push_back(p);
+        }
+        const auto found = first_reproducing(cands);
+        if (found < cands.size()) {
+          recs = cands[found];
+          idx = in_stream(stream);
+          progress = true;
+          // Records after the deleted chunk moved to where[found]; try there
+          // again.
+          b = where[found];
+        } else
+          b = where.back() + chunk;
+      }
+    }
+    return progress;
+  }
+
+  /// Tries applying shrink to each record's value in turn.  Returns true iff
+  /// any record was changed.
+  bool shrink_values(bool (*shrink)(entry &)) {
+    bool progress = false;
+    for (size_t i = 0; i < recs.size();) {
+      vector<candidate> cands;
+      vector<size_t> where;
+      for (size_t j = i; j < recs.size() && cands.size() < run.jobs(); ++j) {
+        entry r = recs[j];
+        if (shrink(r)) {
+          cands.push_back(recs);
+          cands.back()[j] = r;
+          where.push_back(j);
+        }
+      }
+      if (cands.empty())
+        break;
+      const auto found = first_reproducing(cands);
+      if (found < cands.size()) {
+        recs = cands[found];
+        progress = true;
+        i = where[found] + 1;
+      } else
+        i = where.back() + 1;
+    }
+    return progress;
+  }
+
+  string exe;
+  temp_dir tmpdir;
+  runner &run;
+  vector<entry> recs;
+  log_meta meta; ///< The original log's.
+  signature target;
+  size_t ntries = 0;
+};
+
+void usage(const char *self) {
+  fprintf(stderr,
+          "usage: %s [-j <jobs>] [-t <timeout>] [-o <output>] <executable> "
+          "<log>\n",
+          self);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  unsigned jobs = 0, timeout = 10;
+  string output;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:t:o:")) != -1) {
+    switch (opt) {
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 't':
+      timeout = atoi(optarg);
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+    return 2;
+  }
+  const string exe(argv[optind]), log(argv[optind + 1]);
+  if (output.empty())
+    output = log + ".min";
+  try {
+    runner r(jobs, timeout);
+    minimizer m(exe, log, r);
+    const auto before = m.records();
+    m.minimize();
+    ofstream f(output, ios::binary);
+    f << m.encode();
+    if (!f)
+      throw runtime_error("cannot write " + output);
+    printf("%s: %zu -> %zu records (%s), %zu replays\n", output.c_str(),
+           before, m.records(), m.failure().how.str().c_str(),
+           m.tries());
+  } catch (const exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
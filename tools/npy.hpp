@@ -0,0 +1,59 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ramfuzz {
+namespace tools {
+
+/// NumPy's dtype string for T.
+template <typename T> const char *npy_descr();
+template <> inline const char *npy_descr<double>() { return "<f8"; }
+template <> inline const char *npy_descr<uint64_t>() { return "<u8"; }
+
+/// Writes data to file fname in NumPy's .npy format, so numpy.load() can read
+/// it.  The array has the given number of rows and cols (or is 1-dimensional if
+/// cols is 0) and is stored in row-major order.  Throws std::runtime_error on
+/// failure.
+template <typename T>
+void write_npy(const std::string &fname, const std::vector<T> &data,
+               size_t rows, size_t cols = 0) {
+  std::string hdr = std::string("{'descr': '") + npy_descr<T>() +
+                    "', 'fortran_order': False, 'shape': (" +
+                    std::to_string(rows) + "," +
+                    (cols ? " " + std::to_string(cols) : std::string()) +
+                    "), }";
+  // Magic, version, and header length take 10 bytes; the whole header must be
+  // padded to a multiple of 64 and end in a newline.
+  hdr.append(63 - (10 + hdr.size()) % 64, ' ');
+  hdr += '\n';
+  std::ofstream f(fname, std::ios::binary);
+  const uint16_t hlen = hdr.size();
+  f.write("\x93NUMPY\x01\x00", 8);
+  f.put(char(hlen & 0xff));
+  f.put(char(hlen >> 8));
+  f << hdr;
+  f.write(reinterpret_cast<const char *>(data.data()), data.size() * sizeof(T));
+  if (!f)
+    throw std::runtime_error("Cannot write " + fname);
+}
+
+} // namespace tools
+} // namespace ramfuzz
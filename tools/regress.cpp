@@ -0,0 +1,301 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Replays a whole corpus against a new build of the code under test and
+/// reports the runs whose outcome changed.  Usage:
+///
+/// ramfuzz-regress [-j <jobs>] [-t <timeout>] [-r <reproducers>] [-o <summary>]
+///                 <executable> <corpus>
+///
+/// <executable> must replay its first argument, as tests using gen(argc, argv)
+/// do.  Every .s/.f log in directory <corpus> is replayed, and sorted into
+/// buckets:
+///
+/// - now fails: a .s log whose replay fails;
+/// - now passes: a .f log whose replay succeeds;
+/// - desync: a replay that exited with ramfuzz::runtime::replay_desync_exit,
+///   because the program asked for a value the log doesn't have;
+/// - timeout: a replay killed after <timeout> seconds (default: 10);
+/// - unparseable: a log that is malformed or truncated, and isn't replayed;
+/// - unchanged: everything else.
+///
+/// The summary (written to <summary>, default: standard output) gives each
+/// bucket's count and its <reproducers> smallest logs (default: 5), which are
+/// the quickest to debug (and to shrink further with ramfuzz-minimize).  Exits
+/// with 1 if any log landed outside "unchanged", else with 0.
+///
+/// The replays don't start from scratch: logs are sorted so that similar ones
+/// are adjacent, split into a few groups per job, and each group is stored as a
+/// trie (see trie.cpp).  Each group is replayed by a single run of
+/// <executable>, which forks from its already-warm state wherever the group's
+/// logs diverge.  Up to <jobs> groups (default: one per core) replay at a time.
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logfile.hpp"
+#include "logtrie.hpp"
+#include "runner.hpp"
+
+using namespace ramfuzz::tools;
+using namespace std;
+
+namespace {
+
+enum bucket {
+  now_fails,
+  now_passes,
+  desync,
+  timeout,
+  unparseable,
+  unchanged,
+  buckets
+};
+
+const char *bucket_names[] = {"now fails", "now passes", "desync",
+                              "timeout",   "unparseable", "unchanged"};
+
+bucket classify(label l, const outcome &o, bool broken) {
+  if (broken)
+    return unparseable;
+  if (o.desynced())
+    return desync;
+  if (o.timed_out())
+    return timeout;
+  if (l == label::success && o.failed())
+    return now_fails;
+  if (l == label::failure && !o.failed())
+    return now_passes;
+  return unchanged;
+}
+
+/// A corpus log and how its replay went.
+struct entry {
+  string name;
+  size_t size;
+  string prefix; ///< The log's beginning, for grouping similar logs.
+  outcome o;
+  bool known = false;
+  string error; ///< Why the log can't be parsed; empty if it can.
+
+  bool broken() const { return !error.empty(); }
+};
+
+/// How much of each log to compare when grouping.
+constexpr size_t prefix_size = 4096;
+
+vector<entry> list_corpus(const string &dir) {
+  vector<entry> logs;
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    throw runtime_error("cannot read directory " + dir);
+  while (const dirent *e = readdir(d)) {
+    if (label_of(e->d_name) == label::unknown)
+      continue;
+    entry l;
+    l.name = dir + "/" + e->d_name;
+    ifstream f(l.name, ios::binary);
+    l.prefix.resize(prefix_size);
+    f.read(&l.prefix[0], prefix_size);
+    l.prefix.resize(f.gcount());
+    struct stat st;
+    l.size = stat(l.name.c_str(), &st) ? 0 : st.st_size;
+    // Logs that don't even start right are set aside here; any other damage
+    // is found when the log is added to a trie.
+    try {
+      const logfile log(l.name);
+      logfile::cursor c(log);
+      record r;
+      c.next(r);
+    } catch (const log_error &e) {
+      l.error = e.what();
+    }
+    logs.push_back(move(l));
+  }
+  closedir(d);
+  return logs;
+}
+
+/// Copies file src to dst.
+void copy_file(const string &src, const string &dst) {
+  ifstream in(src, ios::binary);
+  ofstream out(dst, ios::binary);
+  out << in.rdbuf();
+  if (!in || !out)
+    throw runtime_error("cannot copy " + src + " to " + dst);
+}
+
+/// Replays logs, filling in their outcomes.  Doesn't replay broken logs, and
+/// marks the ones it finds broken.
+void replay(vector<entry> &logs, const string &exe, unsigned jobs,
+            unsigned limit) {
+  // Broken logs go last.
+  sort(logs.begin(), logs.end(), [](const entry &a, const entry &b) {
+    return a.broken() != b.broken() ? b.broken() : a.prefix < b.prefix;
+  });
+  // Only the logs before those go into tries.
+  const size_t dense =
+      find_if(logs.begin(), logs.end(), mem_fn(&entry::broken)) - logs.begin();
+  const temp_dir tmp("ramfuzz-regress");
+  const auto &tmpdir = tmp.path();
+  runner r(jobs, 0);
+  // Several groups per job even out groups that take longer than others.
+  const size_t groups = min(dense, size_t(r.jobs()) * 4);
+  vector<string> tries;
+  vector<size_t> starts; // Index in logs of each group's first log.
+  for (size_t g = 0; g < groups; ++g) {
+    trie_builder tb;
+    starts.push_back(dense * g / groups);
+    for (size_t i = starts.back(); i < dense * (g + 1) / groups; ++i)
+      try {
+        tb.add(logs[i].name);
+      } catch (const log_error &e) {
+        logs[i].error = e.what();
+      }
+    tries.push_back(tmpdir + "/" + to_string(g));
+    tb.write(tries.back());
+  }
+  const auto results = replay_tries(r, exe, tries, limit);
+  for (size_t g = 0; g < groups; ++g) {
+    const trie_file t(tries[g]);
+    // Leaf names are the logs' full names, which are unique.
+    vector<pair<string, leaf_outcome>> byname;
+    for (size_t leaf = 0; leaf < t.names.size(); ++leaf)
+      for (const auto &n : t.names[leaf])
+        byname.emplace_back(n, results[g][leaf]);
+    sort(byname.begin(), byname.end(),
+         [](const pair<string, leaf_outcome> &a,
+            const pair<string, leaf_outcome> &b) { return a.first < b.first; });
+    const size_t end = g + 1 < groups ? starts[g + 1] : dense;
+    for (size_t i = starts[g]; i < end; ++i) {
+      const auto it = lower_bound(
+          byname.begin(), byname.end(), logs[i].name,
+          [](const pair<string, leaf_outcome> &a, const string &n) {
+            return a.first < n;
+          });
+      if (it != byname.end() && it->first == logs[i].name) {
+        logs[i].o = it->second.o;
+        logs[i].known = it->second.known;
+      }
+    }
+    unlink(tries[g].c_str());
+  }
+  // A test that exits before a branch point never replays the logs beyond it;
+  // replay those one by one.
+  vector<string> copies;
+  vector<size_t> which;
+  for (size_t i = 0; i < logs.size(); ++i)
+    if (!logs[i].known && !logs[i].broken()) {
+      copies.push_back(tmpdir + "/" + to_string(i) + ".log");
+      which.push_back(i);
+      copy_file(logs[i].name, copies.back());
+    }
+  runner single(jobs, limit);
+  const auto outcomes = single.replay(exe, copies);
+  for (size_t k = 0; k < copies.size(); ++k) {
+    logs[which[k]].o = outcomes[k];
+    logs[which[k]].known = true;
+    unlink(copies[k].c_str());
+    unlink((copies[k] + "+").c_str());
+  }
+}
+
+void usage(const char *self) {
+  fprintf(stderr,
+          "usage: %s [-j <jobs>] [-t <timeout>] [-r <reproducers>] [-o "
+          "<summary>] <executable> <corpus>\n",
+          self);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  unsigned jobs = 0, limit = 10;
+  size_t reproducers = 5;
+  string outname;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:t:r:o:")) != -1) {
+    switch (opt) {
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 't':
+      limit = atoi(optarg);
+      break;
+    case 'r':
+      reproducers = atoi(optarg);
+      break;
+    case 'o':
+      outname = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+    return 2;
+  }
+  vector<entry> logs;
+  try {
+    logs = list_corpus(argv[optind + 1]);
+    if (!logs.empty())
+      replay(logs, argv[optind], jobs, limit);
+  } catch (const exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 2;
+  }
+
+  vector<vector<const entry *>> sorted(buckets);
+  for (const auto &l : logs)
+    sorted[classify(label_of(l.name), l.o, l.broken())].push_back(&l);
+  FILE *out = outname.empty() ? stdout : fopen(outname.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "cannot write %s\n", outname.c_str());
+    return 2;
+  }
+  fprintf(out, "%zu logs replayed\n",
+          logs.size() - sorted[unparseable].size());
+  for (int b = 0; b < buckets; ++b)
+    fprintf(out, "%s: %zu\n", bucket_names[b], sorted[b].size());
+  for (int b = 0; b < unchanged; ++b) {
+    auto &v = sorted[b];
+    if (v.empty())
+      continue;
+    const auto n = min(reproducers, v.size());
+    partial_sort(v.begin(), v.begin() + n, v.end(),
+                 [](const entry *x, const entry *y) {
+                   return x->size < y->size;
+                 });
+    fprintf(out, "\n%s, smallest first:\n", bucket_names[b]);
+    for (size_t i = 0; i < n; ++i)
+      fprintf(out, "%s (%zu bytes, %s)\n", v[i]->name.c_str(), v[i]->size,
+              v[i]->broken() ? v[i]->error.c_str() : v[i]->o.str().c_str());
+  }
+  if (out != stdout)
+    fclose(out);
+  return sorted[unchanged].size() == logs.size() ? 0 : 1;
+}
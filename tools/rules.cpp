@@ -0,0 +1,204 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Learns, from a corpus generated by ../ai/gencorp.py, which value ranges at
+/// each location keep tests valid.  Usage:
+///
+/// ramfuzz-rules [-g <min gain>] [-m <min values>] [-o <rules>] <log> ...
+///
+/// For each location, finds the interval [lo, hi] that best separates the
+/// values logged there by successful runs from those logged by failing runs:
+/// the interval maximizing (fraction of .s values inside it) - (fraction of .f
+/// values inside it).  This is an exact maximum-sum-segment search over the
+/// location's sorted values, so it takes one sort and one linear pass per
+/// location.  Locations with fewer than <min values> values (default: 10) of
+/// either label, or whose best interval's gain is below <min gain> (default:
+/// 0.2), get no rule.
+///
+/// Rules are written to <rules> (default: standard output) as inequalities that
+/// ramfuzz::runtime::constraints reads, so tests can apply them directly, eg:
+///
+///   RAMFUZZ_CONSTRAINTS=<rules> ./fuzz-test
+///
+/// Each rule is preceded by a comment with its statistics, so the rules are
+/// easy to review and edit by hand.  A bound is omitted where the interval
+/// extends to the location's extreme value anyway.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "logfile.hpp"
+
+using namespace ramfuzz::tools;
+using namespace std;
+
+namespace {
+
+/// A logged value and whether its run succeeded.
+using sample = pair<double, bool>;
+
+/// A learned rule for one location.
+struct rule {
+  uint64_t loc;
+  double lo, hi;        ///< The interval, inclusive.
+  bool has_lo, has_hi;  ///< Whether lo/hi exclude anything.
+  double gain;          ///< Fraction of .s minus fraction of .f values inside.
+  double s_in, f_in;    ///< Fractions of .s and .f values inside.
+};
+
+/// Finds the best interval for one location's samples, which it sorts.
+/// Returns false if there are too few samples of either label.
+bool learn(uint64_t loc, vector<sample> &samples, size_t min_values,
+           rule &r) {
+  size_t ns = 0;
+  for (const auto &s : samples)
+    ns += s.second;
+  const size_t nf = samples.size() - ns;
+  if (ns < min_values || nf < min_values)
+    return false;
+  sort(samples.begin(), samples.end());
+  // Kadane's algorithm over groups of equal values, where each .s value weighs
+  // 1/ns and each .f value -1/nf.
+  double best = -1., cur = 0.;
+  size_t cur_start = 0, best_start = 0, best_end = 0;
+  double cur_s = 0., cur_f = 0., best_s = 0., best_f = 0.;
+  for (size_t i = 0; i < samples.size();) {
+    size_t j = i;
+    double ds = 0., df = 0.;
+    for (; j < samples.size() && samples[j].first == samples[i].first; ++j)
+      (samples[j].second ? ds : df) += 1.;
+    if (cur <= 0.) {
+      cur = 0.;
+      cur_s = cur_f = 0.;
+      cur_start = i;
+    }
+    cur += ds / ns - df / nf;
+    cur_s += ds;
+    cur_f += df;
+    if (cur > best) {
+      best = cur;
+      best_start = cur_start;
+      best_end = j - 1;
+      best_s = cur_s;
+      best_f = cur_f;
+    }
+    i = j;
+  }
+  r.loc = loc;
+  r.lo = samples[best_start].first;
+  r.hi = samples[best_end].first;
+  r.has_lo = r.lo > samples.front().first;
+  r.has_hi = r.hi < samples.back().first;
+  r.gain = best;
+  r.s_in = best_s / ns;
+  r.f_in = best_f / nf;
+  return true;
+}
+
+void usage(const char *self) {
+  fprintf(stderr,
+          "usage: %s [-g <min gain>] [-m <min values>] [-o <rules>] <log> "
+          "...\n",
+          self);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  double min_gain = 0.2;
+  size_t min_values = 10;
+  const char *outname = nullptr;
+  int opt;
+  while ((opt = getopt(argc, argv, "g:m:o:")) != -1) {
+    switch (opt) {
+    case 'g':
+      min_gain = atof(optarg);
+      break;
+    case 'm':
+      min_values = atoi(optarg);
+      break;
+    case 'o':
+      outname = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (optind == argc) {
+    usage(argv[0]);
+    return 2;
+  }
+  unordered_map<uint64_t, vector<sample>> sites;
+  size_t runs = 0;
+  try {
+    for (int i = optind; i < argc; ++i) {
+      const auto l = label_of(argv[i]);
+      if (l == label::unknown)
+        continue;
+      ++runs;
+      logfile log(argv[i]);
+      logfile::cursor c(log);
+      record r;
+      while (c.next(r))
+        sites[r.id].emplace_back(r.value(), l == label::success);
+    }
+  } catch (const exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  vector<rule> rules;
+  for (auto &s : sites) {
+    rule r;
+    if (learn(s.first, s.second, min_values, r) && r.gain >= min_gain &&
+        (r.has_lo || r.has_hi))
+      rules.push_back(r);
+  }
+  sort(rules.begin(), rules.end(),
+       [](const rule &a, const rule &b) { return a.gain > b.gain; });
+
+  FILE *out = outname ? fopen(outname, "w") : stdout;
+  if (!out) {
+    perror(outname);
+    return 1;
+  }
+  fprintf(out, "# %zu rules learned from %zu runs at %zu locations.\n",
+          rules.size(), runs, sites.size());
+  for (const auto &r : rules) {
+    fprintf(out, "\n# %llu in [%.17g, %.17g]: keeps %.1f%% of .s values, "
+                 "%.1f%% of .f values\n",
+            static_cast<unsigned long long>(r.loc), r.lo, r.hi, 100 * r.s_in,
+            100 * r.f_in);
+    if (r.has_lo)
+      fprintf(out, "1 %llu >= %.17g\n", static_cast<unsigned long long>(r.loc),
+              r.lo);
+    if (r.has_hi)
+      fprintf(out, "1 %llu <= %.17g\n", static_cast<unsigned long long>(r.loc),
+              r.hi);
+  }
+  if (outname && fclose(out)) {
+    perror(outname);
+    return 1;
+  }
+  return 0;
+}
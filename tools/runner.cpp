@@ -0,0 +1,140 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "runner.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using std::map;
+using std::runtime_error;
+using std::string;
+using std::to_string;
+using std::vector;
+
+namespace {
+
+/// Starts cmd in a child process and returns its pid.
+pid_t spawn(const vector<string> &cmd, unsigned timeout) {
+  vector<char *> argv;
+  for (const auto &a : cmd)
+    argv.push_back(const_cast<char *>(a.c_str()));
+  argv.push_back(nullptr);
+  const pid_t pid = fork();
+  if (pid < 0)
+    throw runtime_error(string("fork: ") + strerror(errno));
+  if (pid == 0) {
+    const int devnull = open("/dev/null", O_RDWR);
+    if (devnull >= 0) {
+      dup2(devnull, 1);
+      dup2(devnull, 2);
+    }
+    // Thousands of crashing children are normal here; don't dump their cores.
+    const struct rlimit nocore = {0, 0};
+    setrlimit(RLIMIT_CORE, &nocore);
+    // Pending alarms survive execv(), so this limits the executable's runtime.
+    if (timeout)
+      alarm(timeout);
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+  return pid;
+}
+
+} // anonymous namespace
+
+namespace ramfuzz {
+namespace tools {
+
+string outcome::str() const {
+  return signal ? "signal " + to_string(signal) : "exit " + to_string(status);
+}
+
+runner::runner(unsigned jobs, unsigned timeout)
+    : jobs_(jobs ? jobs : std::thread::hardware_concurrency()),
+      timeout(timeout) {
+  if (!jobs_)
+    jobs_ = 1;
+}
+
+vector<outcome> runner::run(const vector<vector<string>> &cmds) {
+  vector<outcome> results(cmds.size());
+  map<pid_t, size_t> running; // Child pid -> index in cmds.
+  size_t next = 0;
+  while (next < cmds.size() || !running.empty()) {
+    while (next < cmds.size() && running.size() < jobs_) {
+      running[spawn(cmds[next], timeout)] = next;
+      ++next;
+    }
+    int wstatus;
+    const pid_t pid = waitpid(-1, &wstatus, 0);
+    if (pid < 0) {
+      if (errno == EINTR)
+        continue;
+      throw runtime_error(string("waitpid: ") + strerror(errno));
+    }
+    const auto it = running.find(pid);
+    if (it == running.end())
+      continue;
+    auto &res = results[it->second];
+    if (WIFSIGNALED(wstatus))
+      res.signal = WTERMSIG(wstatus);
+    else
+      res.status = WEXITSTATUS(wstatus);
+    running.erase(it);
+  }
+  return results;
+}
+
+vector<outcome> runner::replay(const string &exe, const vector<string> &logs) {
+  vector<vector<string>> cmds;
+  cmds.reserve(logs.size());
+  for (const auto &log : logs)
+    cmds.push_back({exe, log});
+  return run(cmds);
+}
+
+string temp_template(const string &name) {
+  const char *dir = getenv("TMPDIR");
+  return string(dir && *dir ? dir : "/tmp") + "/" + name + ".XXXXXX";
+}
+
+temp_dir::temp_dir(const string &name) : path_(temp_template(name)) {
+  if (!mkdtemp(&path_[0]))
+    throw runtime_error("cannot create a temporary directory");
+}
+
+temp_dir::~temp_dir() {
+  if (DIR *d = opendir(path_.c_str())) {
+    while (const dirent *e = readdir(d))
+      if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+        unlink((path_ + "/" + e->d_name).c_str());
+    closedir(d);
+  }
+  rmdir(path_.c_str());
+}
+
+} // namespace tools
+} // namespace ramfuzz
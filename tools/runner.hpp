@@ -0,0 +1,98 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <csignal>
+#include <string>
+#include <vector>
+
+namespace ramfuzz {
+namespace tools {
+
+/// Exit status of a replay that ran out of log or found a value of the wrong
+/// type in it.  Must match ramfuzz::runtime::replay_desync_exit.
+constexpr int replay_desync_exit = 123;
+
+/// How a child process ended.
+struct outcome {
+  int status = 0; ///< Exit status, if the process exited normally.
+  int signal = 0; ///< Terminating signal, or 0 if the process exited normally.
+
+  bool failed() const { return signal || status; }
+
+  /// True if a replay lost step with its log, so it says nothing about the
+  /// run the log was recorded from.
+  bool desynced() const { return !signal && status == replay_desync_exit; }
+
+  /// True if the runner killed the child for exceeding its timeout.
+  bool timed_out() const { return signal == SIGALRM; }
+
+  bool operator==(const outcome &that) const {
+    return status == that.status && signal == that.signal;
+  }
+  bool operator!=(const outcome &that) const { return !(*this == that); }
+
+  /// Eg, "exit 1" or "signal 11".
+  std::string str() const;
+};
+
+/// Runs executables (typically RamFuzz tests in replay mode) in parallel child
+/// processes.  The children's standard output and error are discarded.
+class runner {
+public:
+  /// At most jobs children will run at the same time; 0 means as many as there
+  /// are cores.  A child running longer than timeout seconds is killed by
+  /// SIGALRM; 0 means no timeout.
+  explicit runner(unsigned jobs = 0, unsigned timeout = 0);
+
+  /// Runs every command (argv[0] is the executable) and returns their outcomes
+  /// in the same order.  Throws std::runtime_error if a child can't be
+  /// started.
+  std::vector<outcome> run(const std::vector<std::vector<std::string>> &cmds);
+
+  /// Runs exe in replay mode on each of logs.  Each replay writes its output
+  /// log next to the input one, with a "+" appended to the name.
+  std::vector<outcome> replay(const std::string &exe,
+                              const std::vector<std::string> &logs);
+
+  unsigned jobs() const { return jobs_; }
+
+private:
+  unsigned jobs_, timeout;
+};
+
+/// A mkdtemp()/mkstemp() template for a temporary file called name plus a
+/// random suffix, in $TMPDIR (or, if that's unset or empty, /tmp).
+std::string temp_template(const std::string &name);
+
+/// A temporary directory, removed along with its contents on destruction.
+class temp_dir {
+public:
+  /// Creates the directory from temp_template(name).  Throws
+  /// std::runtime_error on failure.
+  explicit temp_dir(const std::string &name);
+  ~temp_dir();
+
+  temp_dir(const temp_dir &) = delete;
+  temp_dir &operator=(const temp_dir &) = delete;
+
+  const std::string &path() const { return path_; }
+
+private:
+  std::string path_;
+};
+
+} // namespace tools
+} // namespace ramfuzz
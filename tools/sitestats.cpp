@@ -0,0 +1,308 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Finds which locations and value ranges predict test failure in a corpus
+/// generated by ../ai/gencorp.py.  Usage:
+///
+/// ramfuzz-sitestats [-j <jobs>] [-k <top>] [-c] [-n <prefix>] <log> ...
+///
+/// Reads all the logs in one pass, split among <jobs> threads (default: one
+/// per core).  Logs whose names don't end in .s or .f are ignored.
+///
+/// A feature is either a location ("location L was logged in the run") or a
+/// location's value bucket ("a value in magnitude_bucket() B was logged at
+/// location L in the run").  Each feature is ranked by how much it tells about
+/// the run's outcome: by mutual information between the feature and the
+/// outcome or, with -c, by the chi-square statistic of their contingency table.
+/// The top <top> features (default: 20) are printed, along with the fraction of
+/// runs with that feature that failed.
+///
+/// With -n, also writes per-location statistics as NumPy arrays:
+/// <prefix>.locs.npy holds the locations (uint64), and <prefix>.stats.npy
+/// holds a float64 row for each location with the following columns:
+///   0-1: how many .s and .f runs logged the location
+///   2-3: how many values the .s and .f runs logged there
+///   4-7: min, max, mean, and variance of the values logged in .s runs
+///   8-11: the same for .f runs
+///   12-13: the location's mutual information and chi-square
+/// and <prefix>.hist.npy holds a histogram row for each location: value counts
+/// in .s runs for magnitude buckets -65..65, then the same for .f runs.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include "logfile.hpp"
+#include "npy.hpp"
+#include "stats.hpp"
+
+using namespace ramfuzz::tools;
+using namespace std;
+
+namespace {
+
+/// Index by label: success or failure.
+using by_label = array<uint64_t, 2>;
+
+/// Statistics for one value bucket at one location.
+struct bin {
+  by_label values = {{0, 0}}; ///< How many values fell in it.
+  by_label runs = {{0, 0}};   ///< How many runs had a value in it.
+  size_t last_run = -1;       ///< Last run counted in runs.
+};
+
+/// Statistics for one location.
+struct site {
+  site_stats vals[2];
+  by_label runs = {{0, 0}};
+  size_t last_run = -1;
+  unordered_map<int, bin> bins;
+
+  void merge(const site &that) {
+    for (int l = 0; l < 2; ++l) {
+      vals[l].merge(that.vals[l]);
+      runs[l] += that.runs[l];
+    }
+    for (const auto &b : that.bins) {
+      auto &mine = bins[b.first];
+      for (int l = 0; l < 2; ++l) {
+        mine.values[l] += b.second.values[l];
+        mine.runs[l] += b.second.runs[l];
+      }
+    }
+  }
+};
+
+using site_map = unordered_map<uint64_t, site>;
+
+/// Accumulates statistics for log number run into sites.
+void scan(const string &fname, size_t run, site_map &sites) {
+  const int l = label_of(fname) == label::success ? 0 : 1;
+  logfile log(fname);
+  logfile::cursor c(log);
+  record r;
+  while (c.next(r)) {
+    const double v = r.value();
+    auto &s = sites[r.id];
+    s.vals[l].add(v);
+    if (s.last_run != run) {
+      s.last_run = run;
+      ++s.runs[l];
+    }
+    auto &b = s.bins[magnitude_bucket(v)];
+    ++b.values[l];
+    if (b.last_run != run) {
+      b.last_run = run;
+      ++b.runs[l];
+    }
+  }
+}
+
+/// Association between a binary feature and the outcome, given how many runs
+/// with the feature succeeded/failed and how many runs there are in total.
+struct association {
+  double mi = 0., chi2 = 0.;
+
+  association(const by_label &with, const by_label &total) {
+    const double n = total[0] + total[1];
+    if (!n)
+      return;
+    // Contingency table: cell[has feature][label].
+    const double cell[2][2] = {{total[0] - double(with[0]),
+                                total[1] - double(with[1])},
+                               {double(with[0]), double(with[1])}};
+    for (int f = 0; f < 2; ++f)
+      for (int l = 0; l < 2; ++l) {
+        const double row = cell[f][0] + cell[f][1], col = total[l];
+        if (cell[f][l] > 0)
+          mi += cell[f][l] / n * log2(cell[f][l] * n / (row * col));
+      }
+    const double rows = (cell[0][0] + cell[0][1]) * (cell[1][0] + cell[1][1]);
+    const double det = cell[1][0] * cell[0][1] - cell[1][1] * cell[0][0];
+    if (rows > 0 && total[0] && total[1])
+      chi2 = n * det * det / (rows * total[0] * total[1]);
+  }
+};
+
+/// A ranked feature.
+struct feature {
+  uint64_t loc;
+  bool whole_site; ///< If true, bucket is irrelevant.
+  int bucket;
+  by_label runs;
+  association assoc;
+};
+
+constexpr int max_bucket = 65; ///< Largest |magnitude_bucket()| of an integer.
+
+void usage(const char *self) {
+  fprintf(stderr,
+          "usage: %s [-j <jobs>] [-k <top>] [-c] [-n <prefix>] <log> ...\n",
+          self);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  unsigned jobs = thread::hardware_concurrency();
+  size_t top = 20;
+  bool by_chi2 = false;
+  string prefix;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:k:cn:")) != -1) {
+    switch (opt) {
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 'k':
+      top = atoi(optarg);
+      break;
+    case 'c':
+      by_chi2 = true;
+      break;
+    case 'n':
+      prefix = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  vector<string> files;
+  by_label total = {{0, 0}};
+  for (int i = optind; i < argc; ++i) {
+    const auto l = label_of(argv[i]);
+    if (l == label::unknown)
+      continue;
+    files.push_back(argv[i]);
+    ++total[l == label::success ? 0 : 1];
+  }
+  if (files.empty()) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  // Each thread accumulates into its own map; the maps are merged at the end.
+  vector<site_map> partial(max(1u, jobs));
+  atomic<size_t> next(0);
+  mutex errmx;
+  string error;
+  vector<thread> threads;
+  for (size_t t = 0; t < partial.size(); ++t)
+    threads.emplace_back([&, t] {
+      for (size_t i = next++; i < files.size(); i = next++)
+        try {
+          scan(files[i], i, partial[t]);
+        } catch (const exception &e) {
+          lock_guard<mutex> lock(errmx);
+          error = e.what();
+          next = files.size();
+        }
+    });
+  for (auto &t : threads)
+    t.join();
+  if (!error.empty()) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+  site_map sites = move(partial[0]);
+  for (size_t i = 1; i < partial.size(); ++i)
+    for (const auto &s : partial[i])
+      sites[s.first].merge(s.second);
+
+  vector<feature> ranked;
+  for (const auto &s : sites) {
+    ranked.push_back(
+        {s.first, true, 0, s.second.runs, association(s.second.runs, total)});
+    for (const auto &b : s.second.bins)
+      ranked.push_back({s.first, false, b.first, b.second.runs,
+                        association(b.second.runs, total)});
+  }
+  const auto score = [by_chi2](const feature &f) {
+    return by_chi2 ? f.assoc.chi2 : f.assoc.mi;
+  };
+  top = min(top, ranked.size());
+  partial_sort(ranked.begin(), ranked.begin() + top, ranked.end(),
+               [&](const feature &a, const feature &b) {
+                 return score(a) > score(b);
+               });
+  printf("%zu runs (%llu .s, %llu .f), %zu locations\n", files.size(),
+         static_cast<unsigned long long>(total[0]),
+         static_cast<unsigned long long>(total[1]), sites.size());
+  printf("%-20s %6s %10s %10s %8s %12s %12s\n", "location", "bucket", ".s runs",
+         ".f runs", "P(fail)", "MI", "chi2");
+  for (size_t i = 0; i < top; ++i) {
+    const auto &f = ranked[i];
+    const auto bucket = f.whole_site ? string("*") : to_string(f.bucket);
+    printf("%-20llu %6s %10llu %10llu %8.3f %12.6g %12.6g\n",
+           static_cast<unsigned long long>(f.loc), bucket.c_str(),
+           static_cast<unsigned long long>(f.runs[0]),
+           static_cast<unsigned long long>(f.runs[1]),
+           double(f.runs[1]) / (f.runs[0] + f.runs[1]), f.assoc.mi,
+           f.assoc.chi2);
+  }
+
+  if (!prefix.empty()) {
+    constexpr size_t ncols = 14, nbuckets = 2 * max_bucket + 1;
+    vector<uint64_t> locs;
+    vector<double> stats, hist;
+    for (const auto &s : sites) {
+      locs.push_back(s.first);
+      const auto &st = s.second;
+      const association a(st.runs, total);
+      const double row[ncols] = {double(st.runs[0]),
+                                 double(st.runs[1]),
+                                 double(st.vals[0].count),
+                                 double(st.vals[1].count),
+                                 st.vals[0].min,
+                                 st.vals[0].max,
+                                 st.vals[0].mean,
+                                 st.vals[0].variance(),
+                                 st.vals[1].min,
+                                 st.vals[1].max,
+                                 st.vals[1].mean,
+                                 st.vals[1].variance(),
+                                 a.mi,
+                                 a.chi2};
+      stats.insert(stats.end(), row, row + ncols);
+      const auto h = hist.size();
+      hist.resize(h + 2 * nbuckets);
+      for (const auto &b : st.bins) {
+        const int col = max(-max_bucket, min(max_bucket, b.first)) + max_bucket;
+        hist[h + col] += b.second.values[0];
+        hist[h + nbuckets + col] += b.second.values[1];
+      }
+    }
+    try {
+      write_npy(prefix + ".locs.npy", locs, locs.size());
+      write_npy(prefix + ".stats.npy", stats, locs.size(), ncols);
+      write_npy(prefix + ".hist.npy", hist, locs.size(), 2 * nbuckets);
+    } catch (const exception &e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,82 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+namespace ramfuzz {
+namespace tools {
+
+/// Running statistics of the values logged at one location.  Values can be
+/// added one at a time, and partial statistics (eg, from different threads) can
+/// be merged.
+struct site_stats {
+  uint64_t count = 0;
+  double min = std::numeric_limits<double>::infinity();
+  double max = -std::numeric_limits<double>::infinity();
+  double mean = 0.;
+  double m2 = 0.; ///< Sum of squared deviations from the mean.
+
+  /// Accounts for value x, using Welford's method.
+  void add(double x) {
+    ++count;
+    if (x < min)
+      min = x;
+    if (x > max)
+      max = x;
+    const double delta = x - mean;
+    mean += delta / count;
+    m2 += delta * (x - mean);
+  }
+
+  /// Accounts for all the values that that has accounted for.
+  void merge(const site_stats &that) {
+    if (!that.count)
+      return;
+    if (!count) {
+      *this = that;
+      return;
+    }
+    const double n = count + that.count;
+    const double delta = that.mean - mean;
+    mean += delta * that.count / n;
+    m2 += that.m2 + delta * delta * count * that.count / n;
+    count += that.count;
+    if (that.min < min)
+      min = that.min;
+    if (that.max > max)
+      max = that.max;
+  }
+
+  /// Population variance of the values.
+  double variance() const { return count ? m2 / count : 0.; }
+};
+
+/// Coarse, scale-free bucket of value x: 0 for zero, otherwise x's sign times
+/// (1 + the number of bits in |x|'s integral part).  So 1 is in bucket 2, 2 and
+/// 3 in bucket 3, -7 in bucket -4, and 0.5 in bucket 1.
+inline int magnitude_bucket(double x) {
+  if (x == 0. || std::isnan(x))
+    return 0;
+  int exp;
+  std::frexp(x, &exp);
+  const int b = exp > 0 ? exp + 1 : 1;
+  return x < 0 ? -b : b;
+}
+
+} // namespace tools
+} // namespace ramfuzz
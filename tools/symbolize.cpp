@@ -0,0 +1,294 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Turns the locations in a RamFuzz log into source code positions, offline.
+/// Usage:
+///
+/// ramfuzz-symbolize [-e <executable>] [-c <cache>] [-d] <log>
+///
+/// Prints the calling-context tree <log> defines (see ramfuzz::runtime::gen):
+/// a line per node with its location and the function and source line of its
+/// call site, children indented under their parents.  With -d, prints every
+/// record instead, like ramfuzz-logtool dump, followed by the record's whole
+/// calling context from main() inward.
+///
+/// Sites of a log written with source-position locations (see
+/// ramfuzz::runtime::gen::use_source_ids()) are named in the log itself.  Other
+/// call sites are resolved against <executable> (default: the binary the log
+/// names), which must be the build that wrote the log; a differing build ID
+/// draws a warning.  All the sites are resolved by a single run of addr2line
+/// from GNU binutils, which must be on the PATH.  With -c, resolved sites are
+/// kept in directory <cache> (created if missing), in a file per build ID, and
+/// later runs only resolve the sites that aren't there yet.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <elf.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logfile.hpp"
+#include "runner.hpp"
+
+using namespace ramfuzz::tools;
+using namespace std;
+
+namespace {
+
+/// Source positions of a call site as (function, file:line) pairs, innermost
+/// first; there's more than one where calls were inlined.
+using frames = vector<pair<string, string>>;
+
+/// Resolved call sites by virtual address.
+using symtab = map<uint64_t, frames>;
+
+string hexstr(const string &bytes) {
+  string h;
+  for (unsigned char b : bytes) {
+    char buf[3];
+    snprintf(buf, sizeof(buf), "%02x", b);
+    h += buf;
+  }
+  return h;
+}
+
+/// Returns the build ID of 64-bit ELF file fname, or an empty string if it has
+/// none or can't be read.
+string build_id(const string &fname) {
+  ifstream f(fname, ios::binary);
+  const string elf((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+  Elf64_Ehdr eh;
+  if (elf.size() < sizeof(eh) || elf.compare(0, SELFMAG, ELFMAG) ||
+      elf[EI_CLASS] != ELFCLASS64)
+    return "";
+  memcpy(&eh, elf.data(), sizeof(eh));
+  for (unsigned i = 0; i < eh.e_shnum; ++i) {
+    Elf64_Shdr sh;
+    const size_t at = eh.e_shoff + i * sizeof(sh);
+    if (at + sizeof(sh) > elf.size())
+      break;
+    memcpy(&sh, elf.data() + at, sizeof(sh));
+    if (sh.sh_type != SHT_NOTE || sh.sh_offset + sh.sh_size > elf.size())
+      continue;
+    // Notes are a header, a name, and a description, each 4-aligned.
+    const size_t end = sh.sh_offset + sh.sh_size;
+    for (size_t p = sh.sh_offset; p + sizeof(Elf64_Nhdr) <= end;) {
+      Elf64_Nhdr n;
+      memcpy(&n, elf.data() + p, sizeof(n));
+      const size_t name = p + sizeof(n), desc = name + ((n.n_namesz + 3) & ~3);
+      if (n.n_type == NT_GNU_BUILD_ID && n.n_namesz == 4 &&
+          !elf.compare(name, 4, string("GNU", 4)) && desc + n.n_descsz <= end)
+        return elf.substr(desc, n.n_descsz);
+      p = desc + ((n.n_descsz + 3) & ~3);
+    }
+  }
+  return "";
+}
+
+/// Reads cache file fname into syms.  A missing file is an empty cache.
+void load_cache(const string &fname, symtab &syms) {
+  ifstream f(fname);
+  string line;
+  while (getline(f, line)) {
+    istringstream fields(line);
+    string addr, fn, pos;
+    getline(fields, addr, '\t');
+    auto &fr = syms[strtoull(addr.c_str(), nullptr, 16)];
+    fr.clear(); // A later line for the same address wins.
+    while (getline(fields, fn, '\t') && getline(fields, pos, '\t'))
+      fr.emplace_back(fn, pos);
+  }
+}
+
+/// Resolves addrs in binary exe with addr2line, adding them to syms and, if
+/// cache isn't empty, appending them to cache file cache.  Throws
+/// std::runtime_error if addr2line fails.
+void resolve(const string &exe, const vector<uint64_t> &addrs, symtab &syms,
+             const string &cache) {
+  const temp_dir tmp("ramfuzz-symbolize");
+  const string in = tmp.path() + "/in", out = tmp.path() + "/out";
+  {
+    ofstream f(in);
+    for (const auto a : addrs)
+      f << hex << a << '\n';
+  }
+  runner r(1, 0);
+  // -a prints each address before its frames, which delimits them.
+  const auto o = r.run({{"/bin/sh", "-c",
+                         "exec addr2line -a -f -i -C -e \"$0\" <\"$1\" >\"$2\"",
+                         exe, in, out}});
+  ifstream f(out);
+  string line, pos;
+  frames *cur = nullptr;
+  while (getline(f, line)) {
+    if (!line.compare(0, 2, "0x"))
+      cur = &syms[strtoull(line.c_str(), nullptr, 16)];
+    else if (cur && getline(f, pos))
+      cur->emplace_back(line, pos);
+  }
+  if (o[0].failed())
+    throw runtime_error("addr2line failed on " + exe + " (" + o[0].str() + ")");
+  if (cache.empty())
+    return;
+  ofstream c(cache, ios::app);
+  if (!c)
+    throw runtime_error("cannot write " + cache);
+  for (const auto a : addrs) {
+    c << hex << a;
+    for (const auto &fr : syms[a])
+      c << '\t' << fr.first << '\t' << fr.second;
+    c << '\n';
+  }
+}
+
+/// Eg, "main (t.cpp:12) > f(int) (t.cpp:5)" for a site where main() calls
+/// f(), which got inlined.
+string describe(const frames &fr) {
+  string d;
+  for (auto it = fr.rbegin(); it != fr.rend(); ++it)
+    d += (d.empty() ? "" : " > ") + it->first + " (" + it->second + ")";
+  return d.empty() ? "??" : d;
+}
+
+void usage(const char *self) {
+  fprintf(stderr, "usage: %s [-e <executable>] [-c <cache>] [-d] <log>\n",
+          self);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  string exe, cachedir;
+  bool dump = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "e:c:d")) != -1) {
+    switch (opt) {
+    case 'e':
+      exe = optarg;
+      break;
+    case 'c':
+      cachedir = optarg;
+      break;
+    case 'd':
+      dump = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - optind != 1) {
+    usage(argv[0]);
+    return 2;
+  }
+  if (!cachedir.empty() && mkdir(cachedir.c_str(), 0777) && errno != EEXIST) {
+    fprintf(stderr, "cannot create %s\n", cachedir.c_str());
+    return 2;
+  }
+  try {
+    logfile log(argv[optind]);
+    logfile::cursor c(log);
+    vector<record> recs;
+    record r;
+    while (c.next(r))
+      recs.push_back(r);
+    const auto &meta = c.meta();
+    const auto &cct = meta.cct;
+
+    // Sites are return addresses; the call is the instruction before.
+    vector<uint64_t> addrs(cct.size());
+    for (size_t i = 1; i < cct.size(); ++i)
+      addrs[i] = meta.base + cct[i].site - 1;
+    symtab syms;
+    const string cache =
+        cachedir.empty() || meta.build_id.empty()
+            ? string()
+            : cachedir + "/" + hexstr(meta.build_id);
+    if (!cache.empty())
+      load_cache(cache, syms);
+    // Source-position sites are named in the log already.
+    vector<uint64_t> missing;
+    for (size_t i = 1; i < cct.size(); ++i)
+      if (!meta.sources.count(cct[i].site) && !syms.count(addrs[i]))
+        missing.push_back(addrs[i]);
+    // Many nodes can share a site; each is resolved once.
+    sort(missing.begin(), missing.end());
+    missing.erase(unique(missing.begin(), missing.end()), missing.end());
+    if (!missing.empty()) {
+      if (exe.empty())
+        exe = meta.path;
+      if (exe.empty())
+        throw runtime_error(string(argv[optind]) +
+                            " doesn't name its binary; use -e");
+      if (!meta.build_id.empty() && build_id(exe) != meta.build_id)
+        fprintf(stderr, "warning: %s isn't the build that wrote %s\n",
+                exe.c_str(), argv[optind]);
+      resolve(exe, missing, syms, cache);
+    }
+    vector<string> names(cct.size());
+    for (size_t i = 1; i < cct.size(); ++i) {
+      const auto src = meta.sources.find(cct[i].site);
+      names[i] = src != meta.sources.end() ? src->second
+                                           : describe(syms[addrs[i]]);
+    }
+
+    if (dump) {
+      map<uint64_t, uint32_t> nodes; // By location ID, for full records.
+      for (uint32_t i = 1; i < cct.size(); ++i)
+        nodes.emplace(cct[i].id, i);
+      for (size_t k = 0; k < recs.size(); ++k) {
+        const auto it = nodes.find(recs[k].id);
+        string ctx;
+        for (auto n = it == nodes.end() ? 0 : it->second; n;
+             n = cct[n].parent)
+          ctx = names[n] + (ctx.empty() ? "" : " > ") + ctx;
+        printf("%zu %s %.17g %llu %s\n", k + 1, tagname(recs[k].tag),
+               recs[k].value(), static_cast<unsigned long long>(recs[k].id),
+               ctx.empty() ? "??" : ctx.c_str());
+      }
+      return 0;
+    }
+    vector<vector<uint32_t>> kids(cct.size());
+    for (uint32_t i = 1; i < cct.size(); ++i)
+      kids[cct[i].parent].push_back(i);
+    // Depth-first, so each node's children follow it.
+    vector<pair<uint32_t, unsigned>> stack(1, make_pair(0u, 0u));
+    while (!stack.empty()) {
+      const auto n = stack.back();
+      stack.pop_back();
+      if (n.first)
+        printf("%*s%llu %s\n", 2 * (n.second - 1), "",
+               static_cast<unsigned long long>(cct[n.first].id),
+               names[n.first].c_str());
+      for (auto k = kids[n.first].rbegin(); k != kids[n.first].rend(); ++k)
+        stack.emplace_back(*k, n.second + 1);
+    }
+  } catch (const exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 2;
+  }
+  return 0;
+}
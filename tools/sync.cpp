@@ -0,0 +1,286 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Lets several fuzzing instances cooperate through a shared sync directory,
+/// in the style of AFL's parallel mode.  Usage:
+///
+/// ramfuzz-sync [-i <seconds>] [-j <jobs>] [-t <timeout>] [-1]
+///              <sync dir> <name> <executable> <corpus>
+///
+/// Runs beside one fuzzing instance, which fills directory <corpus> with .s/.f
+/// logs (eg, ../ai/gencorp.py running in <corpus>).  Each instance has its own
+/// <name> and its own subdirectory of <sync dir>, where it publishes logs for
+/// the others.  The instances may run on one machine or on many machines
+/// sharing a filesystem.  Every <seconds> (default: 30), ramfuzz-sync does a
+/// round of:
+///
+/// - publishing: every new log in <corpus> that contains a location no earlier
+///   log here contained is linked (or copied) into <sync dir>/<name>;
+///
+/// - importing: every new log in the other instances' subdirectories that
+///   contains a location unknown here is replayed with <executable> (which
+///   must replay its first argument, like tests using gen(argc, argv)), with
+///   <jobs> replays at a time (default: one per core) and a time limit of
+///   <timeout> seconds (default: 10).  If the replay succeeds or fails just
+///   like the log's .s/.f suffix says, the log is copied into <corpus> as
+///   sync-<peer>-<log>, where training, ramfuzz-distill, and so on pick it up.
+///   Logs whose replays disagree (eg, because the peer runs a different build),
+///   desync, or time out are dropped.
+///
+/// Logs that can't be parsed (eg, because they're still being written) are
+/// skipped and retried in the next round.  With -1, does one round and exits.
+/// A summary of each round goes to standard error.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logfile.hpp"
+#include "runner.hpp"
+
+using namespace ramfuzz::tools;
+using namespace std;
+
+namespace {
+
+/// Returns the sorted names of dir's entries, without hidden ones.
+vector<string> list_dir(const string &dir) {
+  vector<string> names;
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    throw runtime_error("cannot read directory " + dir);
+  while (const dirent *e = readdir(d))
+    if (e->d_name[0] != '.')
+      names.push_back(e->d_name);
+  closedir(d);
+  sort(names.begin(), names.end());
+  return names;
+}
+
+bool is_dir(const string &path) {
+  struct stat st;
+  return !stat(path.c_str(), &st) && S_ISDIR(st.st_mode);
+}
+
+/// Makes dst a copy of src.  Writes to a temporary file first, so dst never
+/// appears partially written.
+void copy_file(const string &src, const string &dst) {
+  const string tmp = dst + ".tmp";
+  {
+    ifstream in(src, ios::binary);
+    ofstream out(tmp, ios::binary);
+    out << in.rdbuf();
+    if (!in || !out)
+      throw runtime_error("cannot copy " + src + " to " + tmp);
+  }
+  if (rename(tmp.c_str(), dst.c_str()))
+    throw runtime_error("cannot rename " + tmp + " to " + dst);
+}
+
+/// Makes dst the same file as src, or a copy of it.
+void link_or_copy(const string &src, const string &dst) {
+  if (link(src.c_str(), dst.c_str()))
+    copy_file(src, dst);
+}
+
+/// Prefix of the names of logs imported into the corpus.
+const string imported = "sync-";
+
+class syncer {
+public:
+  syncer(const string &syncdir, const string &name, const string &exe,
+         const string &corpus, runner &r)
+      : syncdir(syncdir), name(name), exe(exe), corpus(corpus),
+        outdir(syncdir + "/" + name), r(r) {
+    if (!is_dir(outdir) && mkdir(outdir.c_str(), 0777))
+      throw runtime_error("cannot create " + outdir);
+  }
+
+  /// Does one round of publishing and importing.
+  void round() {
+    size_t published = 0, candidates = 0, accepted = 0, skipped = 0;
+    // Scanning the whole corpus first also accounts for imported logs.
+    for (const auto &n : list_dir(corpus)) {
+      if (label_of(n) == label::unknown || seen.count(n))
+        continue;
+      bool found;
+      try {
+        found = learn(corpus + "/" + n);
+      } catch (const log_error &) {
+        ++skipped;
+        continue;
+      }
+      seen.insert(n);
+      if (found && n.compare(0, imported.size(), imported)) {
+        const auto dst = outdir + "/" + n;
+        if (access(dst.c_str(), F_OK)) {
+          link_or_copy(corpus + "/" + n, dst);
+          ++published;
+        }
+      }
+    }
+    vector<string> logs, sources;
+    // Holds the candidates and their replay logs; whatever isn't imported is
+    // removed with it, even if this round throws.
+    const temp_dir tmp("ramfuzz-sync");
+    const auto &tmpdir = tmp.path();
+    for (const auto &peer : list_dir(syncdir)) {
+      const auto dir = syncdir + "/" + peer;
+      if (peer == name || !is_dir(dir))
+        continue;
+      for (const auto &n : list_dir(dir)) {
+        if (label_of(n) == label::unknown || seen.count(peer + "/" + n))
+          continue;
+        bool found;
+        try {
+          found = novel(dir + "/" + n);
+        } catch (const log_error &) {
+          ++skipped;
+          continue;
+        }
+        seen.insert(peer + "/" + n);
+        if (!found)
+          continue;
+        logs.push_back(tmpdir + "/" + to_string(logs.size()) +
+                       (label_of(n) == label::success ? ".s" : ".f"));
+        sources.push_back(peer + "-" + n);
+        copy_file(dir + "/" + n, logs.back());
+      }
+    }
+    candidates = logs.size();
+    const auto outcomes = r.replay(exe, logs);
+    for (size_t i = 0; i < logs.size(); ++i) {
+      const auto &o = outcomes[i];
+      // A desynced or timed-out replay doesn't reproduce the peer's run, so
+      // its exit status says nothing about the log's label.
+      if (!o.desynced() && !o.timed_out() &&
+          o.failed() != (label_of(logs[i]) == label::success)) {
+        const auto dst = corpus + "/" + imported + sources[i];
+        if (rename(logs[i].c_str(), dst.c_str())) {
+          copy_file(logs[i], dst);
+          unlink(logs[i].c_str());
+        }
+        seen.insert(imported + sources[i]);
+        try {
+          learn(dst);
+        } catch (const log_error &) {
+          // The peer rewrote it since novel(); the next round learns it.
+          seen.erase(imported + sources[i]);
+        }
+        ++accepted;
+      }
+    }
+    fprintf(stderr,
+            "%s: published %zu, imported %zu of %zu, skipped %zu unreadable, "
+            "%zu locations\n",
+            name.c_str(), published, accepted, candidates, skipped,
+            locations.size());
+  }
+
+private:
+  /// Adds the locations in log fname to the known ones.  Returns true if any
+  /// of them was new.  Throws log_error, learning nothing, if the log can't be
+  /// parsed.
+  bool learn(const string &fname) {
+    logfile log(fname);
+    logfile::cursor c(log);
+    record rec;
+    vector<uint64_t> ids;
+    while (c.next(rec))
+      ids.push_back(rec.id);
+    bool found = false;
+    for (auto id : ids)
+      found |= locations.insert(id).second;
+    return found;
+  }
+
+  /// True if log fname contains a location that isn't known.  Throws
+  /// log_error if any part of the log can't be parsed.
+  bool novel(const string &fname) const {
+    logfile log(fname);
+    logfile::cursor c(log);
+    record rec;
+    bool found = false;
+    while (c.next(rec))
+      found = found || !locations.count(rec.id);
+    return found;
+  }
+
+  const string syncdir, name, exe, corpus, outdir;
+  runner &r;
+  unordered_set<uint64_t> locations; ///< Known locations.
+  unordered_set<string> seen; ///< Logs already considered, as [peer/]name.
+};
+
+void usage(const char *self) {
+  fprintf(stderr,
+          "usage: %s [-i <seconds>] [-j <jobs>] [-t <timeout>] [-1] <sync dir> "
+          "<name> <executable> <corpus>\n",
+          self);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  unsigned interval = 30, jobs = 0, timeout = 10;
+  bool once = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:j:t:1")) != -1) {
+    switch (opt) {
+    case 'i':
+      interval = atoi(optarg);
+      break;
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 't':
+      timeout = atoi(optarg);
+      break;
+    case '1':
+      once = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - optind != 4) {
+    usage(argv[0]);
+    return 2;
+  }
+  try {
+    runner r(jobs, timeout);
+    syncer s(argv[optind], argv[optind + 1], argv[optind + 2],
+             argv[optind + 3], r);
+    for (;;) {
+      s.round();
+      if (once)
+        break;
+      sleep(interval);
+    }
+  } catch (const exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
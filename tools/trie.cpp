@@ -0,0 +1,159 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Stores a corpus as a prefix trie of log records, and replays it sharing the
+/// work of common prefixes.  Usage:
+///
+/// ramfuzz-trie build -o <trie> <log> ...
+///   Builds a trie of the logs.  Logs with identical records share one leaf.
+///
+/// ramfuzz-trie ls <trie>
+///   Lists the trie's logs: each leaf's index and names.
+///
+/// ramfuzz-trie get <trie> <index> <output>
+///   Writes the log with the given leaf index to file <output>.  It has the
+///   same records as the original, and replays the same, but its CCT nodes may
+///   be numbered differently.
+///
+/// ramfuzz-trie replay [-t <timeout>] <trie> <executable>
+///   Replays every log in the trie with <executable>, which must use
+///   gen(argc, argv): each shared prefix is replayed once, and the executable
+///   forks where logs diverge (see ramfuzz::runtime::gen).  Replays taking
+///   longer than <timeout> seconds are killed.  Prints each log's outcome,
+///   marking with "!" those that disagree with the log's .s/.f suffix or whose
+///   replays desync or time out.  Exits with 1 if there are any such logs,
+///   else with 0.
+///
+/// Since generation is sequential, logs often share long prefixes (the same
+/// constructor choice, the same first method calls); the trie stores each
+/// shared prefix once, and its replay costs roughly the trie's size rather than
+/// the sum of the logs' sizes.
+///
+/// The trie file format is described in logtrie.hpp.
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "logfile.hpp"
+#include "logtrie.hpp"
+#include "runner.hpp"
+
+using namespace ramfuzz::tools;
+using namespace std;
+
+namespace {
+
+int build(const string &out, const vector<string> &logs) {
+  trie_builder tb;
+  size_t total = 0;
+  for (const auto &l : logs) {
+    tb.add(l);
+    total += logfile(l).size();
+  }
+  const auto bytes = tb.write(out);
+  fprintf(stderr, "%zu logs, %zu distinct, %zu of %zu bytes\n", logs.size(),
+          tb.leaves(), bytes, total);
+  return 0;
+}
+
+int replay(const string &store, const string &exe, unsigned timeout) {
+  const trie_file t(store);
+  runner r(1, 0);
+  const auto outcomes = replay_tries(r, exe, {store}, timeout)[0];
+  size_t disagree = 0;
+  for (size_t i = 0; i < outcomes.size(); ++i) {
+    const auto &o = outcomes[i];
+    for (const auto &name : t.names[i]) {
+      const auto l = label_of(name);
+      // A desynced or timed-out replay doesn't reproduce the log's run, so it
+      // can't agree with any label.
+      const bool bad = !o.known || o.o.desynced() || o.o.timed_out() ||
+                       (l == label::success && o.o.failed()) ||
+                       (l == label::failure && !o.o.failed());
+      disagree += bad;
+      printf("%s%s %s\n", bad ? "!" : "", name.c_str(),
+             o.known ? o.o.str().c_str() : "unknown");
+    }
+  }
+  return disagree ? 1 : 0;
+}
+
+void usage(const char *self) {
+  fprintf(stderr,
+          "usage: %s build -o <trie> <log> ...\n"
+          "       %s ls <trie>\n"
+          "       %s get <trie> <index> <output>\n"
+          "       %s replay [-t <timeout>] <trie> <executable>\n",
+          self, self, self, self);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return 2;
+  }
+  const string cmd = argv[1];
+  string out;
+  unsigned timeout = 0;
+  int opt;
+  optind = 2;
+  while ((opt = getopt(argc, argv, "o:t:")) != -1) {
+    if (opt == 'o')
+      out = optarg;
+    else if (opt == 't')
+      timeout = atoi(optarg);
+    else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  const vector<string> args(argv + optind, argv + argc);
+  try {
+    if (cmd == "build" && !out.empty() && !args.empty())
+      return build(out, args);
+    if (cmd == "ls" && args.size() == 1) {
+      const trie_file t(args[0]);
+      for (size_t i = 0; i < t.names.size(); ++i) {
+        printf("%zu", i);
+        for (const auto &name : t.names[i])
+          printf("\t%s", name.c_str());
+        printf("\n");
+      }
+      return 0;
+    }
+    if (cmd == "get" && args.size() == 3) {
+      const trie_file t(args[0]);
+      ofstream f(args[2], ios::binary);
+      f << t.log(atoi(args[1].c_str()));
+      if (!f)
+        throw runtime_error("cannot write " + args[2]);
+      return 0;
+    }
+    if (cmd == "replay" && args.size() == 2)
+      return replay(args[0], args[1], timeout);
+  } catch (const exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 2;
+  }
+  usage(argv[0]);
+  return 2;
+}
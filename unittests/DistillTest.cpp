@@ -0,0 +1,82 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gtest/gtest.h"
+
+#include <vector>
+
+#include "ramfuzz/tools/cover.hpp"
+
+namespace {
+
+using namespace ramfuzz::tools;
+using namespace std;
+
+TEST(FeatureIndexTest, Dense) {
+  feature_index idx;
+  EXPECT_EQ(0u, idx.get(10, 1, label::success));
+  EXPECT_EQ(1u, idx.get(10, 2, label::success));
+  EXPECT_EQ(2u, idx.get(10, 1, label::failure));
+  EXPECT_EQ(3u, idx.get(11, 1, label::success));
+  EXPECT_EQ(0u, idx.get(10, 1, label::success));
+  EXPECT_EQ(4u, idx.size());
+}
+
+TEST(FeatureSetTest, SetAndCount) {
+  feature_set s;
+  s.resize(130);
+  for (uint32_t i : {0, 63, 64, 129, 64})
+    s.set(i);
+  EXPECT_TRUE(s.test(63));
+  EXPECT_TRUE(s.test(129));
+  EXPECT_FALSE(s.test(1));
+  EXPECT_EQ(4u, s.count());
+}
+
+TEST(CoverTest, Empty) {
+  EXPECT_TRUE(cover({}, 0).empty());
+  EXPECT_TRUE(cover({{"a", {}}}, 0).empty());
+}
+
+TEST(CoverTest, BiggestFirst) {
+  EXPECT_EQ(vector<size_t>({1, 0}),
+            cover({{"a", {0, 3}}, {"b", {0, 1, 2}}}, 4));
+}
+
+TEST(CoverTest, SkipsSubsets) {
+  EXPECT_EQ(vector<size_t>({0}),
+            cover({{"a", {0, 1, 2}}, {"b", {1}}, {"c", {0, 2}}}, 3));
+}
+
+TEST(CoverTest, Greedy) {
+  // Once a is picked, c adds more than b, though b started out bigger.
+  const vector<candidate> cands = {{"a", {0, 1, 2, 3, 4}},
+                                   {"b", {0, 1, 2, 5}},
+                                   {"c", {3, 4, 6, 7}}};
+  EXPECT_EQ(vector<size_t>({0, 2, 1}), cover(cands, 8));
+}
+
+TEST(CoverTest, CoversEverything) {
+  vector<candidate> cands;
+  for (uint32_t i = 0; i < 50; ++i)
+    cands.push_back({"", {i % 7, 7 + i % 11, 18 + i % 13}});
+  feature_set covered;
+  covered.resize(31);
+  for (auto i : cover(cands, 31))
+    for (auto f : cands[i].features)
+      covered.set(f);
+  EXPECT_EQ(31u, covered.count());
+}
+
+} // anonymous namespace
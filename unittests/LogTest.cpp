@@ -0,0 +1,280 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gtest/gtest.h"
+
+#include <string>
+#include <vector>
+
+#include "TestFiles.hpp"
+#include "ramfuzz/tools/logfile.hpp"
+
+namespace {
+
+using namespace ramfuzz::test;
+using namespace ramfuzz::tools;
+using namespace std;
+
+/// A log with given bytes, written to a file and read back.
+struct readback {
+  scratch_dir dir;
+  logfile log;
+  vector<record> recs; ///< Valid while log is.
+  log_meta meta;
+
+  explicit readback(const string &bytes) : log(dir.write("log", bytes)) {
+    logfile::cursor c(log);
+    record r;
+    while (c.next(r))
+      recs.push_back(r);
+    meta = c.meta();
+  }
+};
+
+TEST(LogTest, Empty) { EXPECT_TRUE(readback("").recs.empty()); }
+
+TEST(LogTest, FullRecords) {
+  const readback rb(log_builder().value(5, 42, 7).value(12, -1.5, 8).bytes());
+  const auto &recs = rb.recs;
+  ASSERT_EQ(2u, recs.size());
+  EXPECT_EQ(5, recs[0].tag);
+  EXPECT_EQ(42., recs[0].value());
+  EXPECT_EQ(7u, recs[0].id);
+  EXPECT_EQ(0u, recs[0].node);
+  EXPECT_EQ(0u, recs[0].offset);
+  EXPECT_EQ(1 + sizeof(int) + 8, recs[0].size());
+  EXPECT_EQ(12, recs[1].tag);
+  EXPECT_EQ(-1.5, recs[1].value());
+  EXPECT_EQ(8u, recs[1].id);
+  EXPECT_EQ(recs[0].size(), recs[1].offset);
+}
+
+TEST(LogTest, CompactRecords) {
+  const readback rb(log_builder()
+                        .node(0, 100)
+                        .compact(3, short(-3), 1)
+                        .node(1, 200)
+                        .compact(0, true, 2)
+                        .compact(3, short(4), 1)
+                        .bytes());
+  const auto &recs = rb.recs;
+  ASSERT_EQ(3u, recs.size());
+  const auto outer = cct_id(0, 100), inner = cct_id(outer, 200);
+  EXPECT_EQ(outer, recs[0].id);
+  EXPECT_EQ(1u, recs[0].node);
+  EXPECT_EQ(-3., recs[0].value());
+  EXPECT_EQ(inner, recs[1].id);
+  EXPECT_EQ(1., recs[1].value());
+  EXPECT_EQ(outer, recs[2].id);
+}
+
+TEST(LogTest, BytesAreFullRecords) {
+  const readback rb(
+      log_builder().node(0, 100).compact(5, 9, 1).value(5, 9, 3).bytes());
+  const auto &recs = rb.recs;
+  ASSERT_EQ(2u, recs.size());
+  EXPECT_EQ(log_builder().value(5, 9, cct_id(0, 100)).bytes(),
+            recs[0].bytes());
+  EXPECT_EQ(log_builder().value(5, 9, 3).bytes(), recs[1].bytes());
+  EXPECT_TRUE(recs[0].same_value(recs[1]));
+}
+
+TEST(LogTest, Metadata) {
+  const string module = log_builder::encode(uint64_t(0x400000)) +
+                        log_builder::encode(uint32_t(2)) + "ID/bin/test";
+  const readback rb(
+      log_builder()
+          .meta(0x41, module)
+          .meta(0x42, log_builder::encode(uint64_t(5)) + "main (t.cpp:3)")
+          .meta(0x7f, "unknown tags are skipped")
+          .value(1, 'x', 5)
+          .bytes());
+  const auto &meta = rb.meta;
+  EXPECT_EQ(1u, rb.recs.size());
+  EXPECT_EQ(0x400000u, meta.base);
+  EXPECT_EQ("ID", meta.build_id);
+  EXPECT_EQ("/bin/test", meta.path);
+  EXPECT_EQ("main (t.cpp:3)", meta.sources.at(5));
+  EXPECT_FALSE(meta.seeded);
+  EXPECT_FALSE(meta.streams);
+}
+
+TEST(LogTest, TruncatedRecord) {
+  const auto b = log_builder().value(5, 1, 1).value(5, 2, 2).bytes();
+  EXPECT_THROW(readback{b.substr(0, b.size() - 1)}, log_error);
+}
+
+TEST(LogTest, TruncatedMetadata) {
+  const auto b = log_builder().node(0, 1).bytes();
+  EXPECT_THROW(readback{b.substr(0, b.size() - 1)}, log_error);
+}
+
+TEST(LogTest, UnknownTag) {
+  EXPECT_THROW(readback{log_builder().value(13, 0, 0).bytes()}, log_error);
+}
+
+TEST(LogTest, UnknownNode) {
+  EXPECT_THROW(readback{log_builder().compact(5, 1, 1).bytes()}, log_error);
+  EXPECT_THROW(readback{log_builder().node(1, 1).bytes()}, log_error);
+}
+
+TEST(LogTest, MissingFile) {
+  EXPECT_THROW(logfile("/nonexistent/ramfuzz.log"), log_error);
+}
+
+TEST(LogTest, SeedAndSkips) {
+  const readback rb(log_builder()
+                        .seed(42)
+                        .value(5, 1, 7)
+                        .skip(2)
+                        .skip(1)
+                        .value(5, 2, 7)
+                        .value(5, 3, 7)
+                        .bytes());
+  const auto &recs = rb.recs;
+  ASSERT_EQ(3u, recs.size());
+  EXPECT_EQ(0u, recs[0].skipped);
+  EXPECT_EQ(3u, recs[1].skipped);
+  EXPECT_EQ(0u, recs[2].skipped);
+  EXPECT_TRUE(rb.meta.seeded);
+  EXPECT_EQ(42u, rb.meta.seed);
+  EXPECT_FALSE(rb.meta.streams);
+}
+
+TEST(LogTest, Streams) {
+  const readback rb(log_builder()
+                        .seed(42)
+                        .stream(0)
+                        .value(5, 1, 7)
+                        .stream(9)
+                        .value(5, 2, 7)
+                        .value(5, 3, 7)
+                        .stream(0)
+                        .value(5, 4, 7)
+                        .bytes());
+  const auto &recs = rb.recs;
+  ASSERT_EQ(4u, recs.size());
+  EXPECT_EQ(0u, recs[0].stream);
+  EXPECT_EQ(9u, recs[1].stream);
+  EXPECT_EQ(9u, recs[2].stream);
+  EXPECT_EQ(0u, recs[3].stream);
+  EXPECT_TRUE(rb.meta.streams);
+}
+
+/// Bytes of the log re-encoded with log_encoder.
+string reencode(const string &bytes) {
+  const readback rb(bytes);
+  log_encoder enc;
+  string out;
+  for (const auto &r : rb.recs)
+    enc.add(r, rb.meta, out);
+  enc.end(rb.meta, out);
+  return out;
+}
+
+TEST(LogTest, EncoderIgnoresNumbering) {
+  const auto a = log_builder()
+                     .node(0, 100)
+                     .node(1, 200)
+                     .compact(5, 1, 2)
+                     .compact(5, 2, 1)
+                     .bytes();
+  const auto b = log_builder()
+                     .node(0, 7)
+                     .node(0, 100)
+                     .node(2, 200)
+                     .compact(5, 1, 3)
+                     .compact(5, 2, 2)
+                     .bytes();
+  const auto enc = reencode(a);
+  EXPECT_EQ(enc, reencode(b));
+  EXPECT_EQ(enc, reencode(enc));
+  const readback ra(a), re(enc);
+  ASSERT_EQ(ra.recs.size(), re.recs.size());
+  for (size_t i = 0; i < ra.recs.size(); ++i)
+    EXPECT_EQ(ra.recs[i].bytes(), re.recs[i].bytes());
+}
+
+TEST(LogTest, EncoderKeepsSeedAndSkips) {
+  const readback rb(reencode(log_builder()
+                                 .seed(42)
+                                 .node(0, 100)
+                                 .compact(5, 1, 1)
+                                 .skip(3)
+                                 .compact(5, 2, 1)
+                                 .bytes()));
+  ASSERT_EQ(2u, rb.recs.size());
+  EXPECT_EQ(3u, rb.recs[1].skipped);
+  EXPECT_TRUE(rb.meta.seeded);
+  EXPECT_EQ(42u, rb.meta.seed);
+  // Even without records.
+  EXPECT_TRUE(readback(reencode(log_builder().seed(42).bytes())).meta.seeded);
+}
+
+TEST(LogTest, EncoderKeepsStreams) {
+  const readback rb(reencode(log_builder()
+                                 .seed(42)
+                                 .stream(1)
+                                 .node(0, 100)
+                                 .compact(5, 1, 1)
+                                 .stream(9)
+                                 .skip(3)
+                                 .compact(5, 2, 1)
+                                 .bytes()));
+  ASSERT_EQ(2u, rb.recs.size());
+  EXPECT_EQ(1u, rb.recs[0].stream);
+  EXPECT_EQ(9u, rb.recs[1].stream);
+  EXPECT_EQ(3u, rb.recs[1].skipped);
+  // Even without records.
+  const readback empty(reencode(log_builder().seed(42).stream(0).bytes()));
+  EXPECT_TRUE(empty.meta.seeded);
+  EXPECT_TRUE(empty.meta.streams);
+}
+
+TEST(LogTest, EncoderKeepsModuleAndSources) {
+  const string module = log_builder::encode(uint64_t(0x400000)) +
+                        log_builder::encode(uint32_t(2)) + "ID/bin/test";
+  const auto enc =
+      reencode(log_builder()
+                   .meta(0x42, log_builder::encode(uint64_t(300)) + "unused")
+                   .meta(0x41, module)
+                   .meta(0x42, log_builder::encode(uint64_t(100)) + "f (t:1)")
+                   .node(0, 100)
+                   .node(1, 200)
+                   .compact(5, 1, 2)
+                   .bytes());
+  EXPECT_EQ(enc, reencode(enc));
+  const readback rb(enc);
+  ASSERT_EQ(1u, rb.recs.size());
+  EXPECT_EQ(0x400000u, rb.meta.base);
+  EXPECT_EQ("ID", rb.meta.build_id);
+  EXPECT_EQ("/bin/test", rb.meta.path);
+  // Only the names of sites the output has nodes at.
+  ASSERT_EQ(1u, rb.meta.sources.size());
+  EXPECT_EQ("f (t:1)", rb.meta.sources.at(100));
+}
+
+TEST(LogTest, Labels) {
+  EXPECT_EQ(label::success, label_of("dir/1.s"));
+  EXPECT_EQ(label::failure, label_of("dir/1.f"));
+  EXPECT_EQ(label::unknown, label_of("fuzzlog"));
+}
+
+TEST(LogTest, TagNames) {
+  EXPECT_STREQ("int", tagname(5));
+  EXPECT_STREQ("double", tagname(12));
+  EXPECT_STREQ("?", tagname(13));
+}
+
+} // anonymous namespace
@@ -0,0 +1,615 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "TestFiles.hpp"
+#include "ramfuzz/runtime/ramfuzz-rt.hpp"
+
+unsigned ramfuzz::runtime::spinlimit = 3;
+
+namespace {
+
+using namespace ramfuzz::runtime;
+using namespace ramfuzz::test;
+using namespace std;
+
+/// A value record as log sinks receive it.
+struct sunk {
+  char tag;
+  string val; ///< Raw bytes.
+  uint64_t id;
+};
+
+/// Keeps every record it receives.
+class recording_sink : public log_sink {
+public:
+  void write(const char *rec, size_t len) override {
+    recs.push_back(sunk{rec[0], string(rec + 1, len - 1 - sizeof(uint64_t)),
+                        0});
+    memcpy(&recs.back().id, rec + len - sizeof(uint64_t), sizeof(uint64_t));
+  }
+
+  vector<sunk> recs;
+};
+
+/// Makes values of a few kinds.
+void exercise(gen &g) {
+  for (int i = 0; i < 10; ++i)
+    g.make<int>();
+  g.between(-1.5, 2.5);
+  g.make<bool>();
+  g.make<unsigned long>();
+}
+
+/// Generates a log with body and replays it, with gen configured by setup in
+/// both runs.  Returns the log's and the replay's bytes.
+pair<string, string> generate_and_replay(
+    const function<void(gen &)> &setup,
+    const function<void(gen &)> &body = exercise) {
+  scratch_dir dir;
+  // One call site for both runs keeps their locations the same.
+  for (const bool replay : {false, true}) {
+    unique_ptr<gen> g(replay ? new gen(dir.path("log"), dir.path("replay"))
+                             : new gen(dir.path("log")));
+    setup(*g);
+    body(*g);
+  }
+  return {dir.read("log"), dir.read("replay")};
+}
+
+/// The consumer's side of a shared-memory ring.  Must match shm_sink::ring in
+/// ../runtime/ramfuzz-rt.cpp (and ../pymod/ramfuzzmodule.cpp).
+class shm_consumer {
+public:
+  struct slot {
+    atomic<uint64_t> seq;
+    uint32_t pid;
+    unsigned char kind;
+    char tag;
+    uint16_t pad;
+    uint64_t id;
+    double value;
+  };
+
+  shm_consumer(const string &name, uint64_t capacity) : name(name) {
+    size = sizeof(ring) + capacity * sizeof(slot);
+    shm_unlink(name.c_str());
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, size))
+      throw runtime_error("cannot create " + name);
+    r = static_cast<ring *>(
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    close(fd);
+    r->capacity = capacity;
+    r->head = 0;
+    r->tail = 0;
+    for (uint64_t i = 0; i < capacity; ++i)
+      r->slots()[i].seq = i;
+    r->magic = 0x31676e6972667172; // "rqfring1"
+  }
+
+  ~shm_consumer() {
+    munmap(r, size);
+    shm_unlink(name.c_str());
+  }
+
+  /// Consumes the next slot into s.  Returns false if there's none.
+  bool next(slot &s) {
+    slot &at = r->slots()[r->tail & (r->capacity - 1)];
+    if (at.seq.load() != r->tail + 1)
+      return false;
+    s.pid = at.pid;
+    s.kind = at.kind;
+    s.tag = at.tag;
+    s.id = at.id;
+    s.value = at.value;
+    at.seq.store(r->tail + r->capacity);
+    ++r->tail;
+    return true;
+  }
+
+private:
+  struct ring {
+    uint64_t magic;
+    uint64_t capacity;
+    alignas(64) atomic<uint64_t> head;
+    alignas(64) uint64_t tail;
+    slot *slots() { return reinterpret_cast<slot *>(this + 1); }
+  };
+
+  string name;
+  size_t size;
+  ring *r;
+};
+
+/// Publishes guidance file name in dir with advice, replacing any previous
+/// one.  Returns its path.
+string publish_guidance(scratch_dir &dir, const string &name,
+                        vector<guidance::advice> advice) {
+  sort(advice.begin(), advice.end(),
+       [](const guidance::advice &a, const guidance::advice &b) {
+         return a.id < b.id;
+       });
+  const uint64_t hdr[] = {0x3165646975676672, 1, advice.size(), 0};
+  string b(reinterpret_cast<const char *>(hdr), sizeof(hdr));
+  b.append(reinterpret_cast<const char *>(advice.data()),
+           advice.size() * sizeof(advice[0]));
+  dir.write(name + ".tmp", b);
+  rename(dir.path(name + ".tmp").c_str(), dir.path(name).c_str());
+  return dir.path(name);
+}
+
+/// Writes value table name in dir with distributions, which must be sorted by
+/// location.  Returns its path.
+string write_table(
+    scratch_dir &dir, const string &name,
+    const vector<pair<uint64_t, vector<value_table::entry>>> &dists) {
+  vector<value_table::site> sites;
+  vector<value_table::entry> entries;
+  for (const auto &d : dists) {
+    sites.push_back({d.first, uint32_t(entries.size()),
+                     uint32_t(d.second.size())});
+    entries.insert(entries.end(), d.second.begin(), d.second.end());
+  }
+  const uint64_t hdr[] = {0x3173747369646672, 0, sites.size(),
+                          entries.size()};
+  string b(reinterpret_cast<const char *>(hdr), sizeof(hdr));
+  b.append(reinterpret_cast<const char *>(sites.data()),
+           sites.size() * sizeof(sites[0]));
+  b.append(reinterpret_cast<const char *>(entries.data()),
+           entries.size() * sizeof(entries[0]));
+  return dir.write(name, b);
+}
+
+TEST(ShmSinkTest, PublishesRun) {
+  const string name = "/ramfuzz-test-" + to_string(getpid());
+  shm_consumer ring(name, 64);
+  const auto rec = make_shared<recording_sink>();
+  {
+    gen g(rec);
+    g.add_sink(make_shared<shm_sink>(name));
+    exercise(g);
+  }
+  shm_consumer::slot s;
+  ASSERT_TRUE(ring.next(s));
+  EXPECT_EQ(1, s.kind);
+  EXPECT_EQ(uint32_t(getpid()), s.pid);
+  for (const auto &r : rec->recs) {
+    ASSERT_TRUE(ring.next(s));
+    EXPECT_EQ(0, s.kind);
+    EXPECT_EQ(r.tag, s.tag);
+    EXPECT_EQ(r.id, s.id);
+  }
+  ASSERT_TRUE(ring.next(s));
+  EXPECT_EQ(2, s.kind);
+  EXPECT_FALSE(ring.next(s));
+}
+
+TEST(ShmSinkTest, Values) {
+  const string name = "/ramfuzz-test-" + to_string(getpid());
+  shm_consumer ring(name, 8);
+  {
+    gen g(make_shared<shm_sink>(name));
+    const auto d = g.between(-1.5, 2.5);
+    g.between(-7, -7);
+    shm_consumer::slot s;
+    ASSERT_TRUE(ring.next(s));
+    ASSERT_TRUE(ring.next(s));
+    EXPECT_EQ(d, s.value);
+    ASSERT_TRUE(ring.next(s));
+    EXPECT_EQ(-7., s.value);
+  }
+}
+
+TEST(ShmSinkTest, WaitsWhenFull) {
+  const string name = "/ramfuzz-test-" + to_string(getpid());
+  shm_consumer ring(name, 2);
+  atomic<bool> done(false);
+  size_t consumed = 0;
+  thread consumer([&] {
+    shm_consumer::slot s;
+    for (;;)
+      if (ring.next(s))
+        ++consumed;
+      else if (done)
+        break;
+      else
+        this_thread::yield();
+  });
+  const auto rec = make_shared<recording_sink>();
+  {
+    gen g(rec);
+    g.add_sink(make_shared<shm_sink>(name));
+    exercise(g);
+  }
+  done = true;
+  consumer.join();
+  // The run's beginning and end, and every value.
+  EXPECT_EQ(2 + rec->recs.size(), consumed);
+}
+
+TEST(ShmSinkTest, NoRing) {
+  EXPECT_THROW(shm_sink("/ramfuzz-test-nonexistent"), file_error);
+}
+
+TEST(GuidanceTest, Find) {
+  scratch_dir dir;
+  const guidance g(
+      publish_guidance(dir, "g", {{7, 1., 2., .5}, {3, -1., 1., 1.}}));
+  EXPECT_EQ(1u, g.version());
+  ASSERT_NE(nullptr, g.find(3));
+  EXPECT_EQ(-1., g.find(3)->lo);
+  ASSERT_NE(nullptr, g.find(7));
+  EXPECT_EQ(.5, g.find(7)->weight);
+  EXPECT_EQ(nullptr, g.find(5));
+}
+
+TEST(GuidanceTest, BadFiles) {
+  scratch_dir dir;
+  EXPECT_THROW(guidance(dir.path("none")), file_error);
+  EXPECT_THROW(guidance(dir.write("short", "rfguide1")), file_error);
+  EXPECT_THROW(guidance(dir.write("other", string(32, 'x'))), file_error);
+  publish_guidance(dir, "g", {{1, 0., 0., 1.}});
+  const auto b = dir.read("g");
+  EXPECT_THROW(guidance(dir.write("cut", b.substr(0, b.size() - 1))),
+               file_error);
+}
+
+TEST(GuidanceTest, HotReload) {
+  scratch_dir dir;
+  const auto rec = make_shared<recording_sink>();
+  gen g(rec);
+  g.use_source_ids();
+  g.guide(dir.path("g")); // Not published yet.
+  const auto draw = [&g] { return g.between(0, 1000000); };
+  draw();
+  const auto id = rec->recs.back().id;
+
+  publish_guidance(dir, "g", {{id, 7., 7., 1.}});
+  g.refresh_guidance();
+  for (int i = 0; i < 10; ++i)
+    EXPECT_EQ(7, draw());
+
+  publish_guidance(dir, "g", {{id, 9., 9., 1.}});
+  g.refresh_guidance();
+  EXPECT_EQ(9, draw());
+
+  // Picked up automatically within refresh_interval values.
+  g.refresh_interval = 4;
+  publish_guidance(dir, "g", {{id, 11., 11., 1.}});
+  for (int i = 0; i < 4; ++i)
+    draw();
+  EXPECT_EQ(11, draw());
+
+  // Without a file, the last guidance stays.
+  unlink(dir.path("g").c_str());
+  g.refresh_guidance();
+  EXPECT_EQ(11, draw());
+}
+
+TEST(GuidanceTest, Weight) {
+  scratch_dir dir;
+  const auto rec = make_shared<recording_sink>();
+  gen g(rec);
+  g.use_source_ids();
+  const auto draw = [&g] { return g.between(0, 1000000); };
+  draw();
+  g.guide(publish_guidance(dir, "g", {{rec->recs.back().id, 7., 7., 0.}}));
+  int sevens = 0;
+  for (int i = 0; i < 100; ++i)
+    sevens += draw() == 7;
+  EXPECT_GT(3, sevens);
+}
+
+const auto inf = numeric_limits<double>::infinity();
+
+TEST(ConstraintsTest, SingleLocation) {
+  scratch_dir dir;
+  const constraints c(dir.write("c", "# x5 in [-3, 5]\n"
+                                     "2 5 <= 10\n"
+                                     "\n"
+                                     "-1 5 <= 3\n"
+                                     "1 5 1 5 <= 12\n"));
+  EXPECT_EQ(0u, c.size());
+  EXPECT_EQ(make_pair(-3., 5.), c.bounds(5));
+  EXPECT_EQ(make_pair(-inf, inf), c.bounds(6));
+}
+
+TEST(ConstraintsTest, Propagates) {
+  scratch_dir dir;
+  constraints c(dir.write("c", "1 1 1 2 <= 10\n"
+                               "1 1 >= 0\n"
+                               "-1 2 <= 0\n"));
+  EXPECT_EQ(1u, c.size());
+  EXPECT_EQ(make_pair(0., 10.), c.bounds(1));
+  EXPECT_EQ(make_pair(0., 10.), c.bounds(2));
+  c.assign(1, 4);
+  EXPECT_EQ(make_pair(0., 6.), c.bounds(2));
+  c.assign(1, -5);
+  EXPECT_EQ(make_pair(0., 15.), c.bounds(2));
+}
+
+TEST(ConstraintsTest, NoBoundWithoutOthers) {
+  scratch_dir dir;
+  constraints c(dir.write("c", "1 1 1 2 <= 10\n"));
+  EXPECT_EQ(make_pair(-inf, inf), c.bounds(2));
+  c.assign(1, 3);
+  EXPECT_EQ(make_pair(-inf, 7.), c.bounds(2));
+}
+
+TEST(ConstraintsTest, Pruning) {
+  scratch_dir dir;
+  // Always satisfied, given the single-location bounds.
+  EXPECT_EQ(0u, constraints(dir.write("c1", "1 1 1 2 <= 10\n"
+                                            "1 1 <= 2\n"
+                                            "1 2 <= 3\n"))
+                    .size());
+  // Multiples of one another; only the tightest stays.
+  const constraints c(dir.write("c2", "2 1 2 2 <= 8\n"
+                                      "1 1 1 2 <= 6\n"
+                                      "1 1 >= 0\n"
+                                      "1 2 >= 0\n"));
+  EXPECT_EQ(1u, c.size());
+  EXPECT_EQ(make_pair(0., 4.), c.bounds(1));
+  // Terms cancelling out.
+  EXPECT_EQ(0u, constraints(dir.write("c3", "1 1 -1 1 <= 4\n")).size());
+}
+
+TEST(ConstraintsTest, BadFiles) {
+  scratch_dir dir;
+  EXPECT_THROW(constraints(dir.path("none")), file_error);
+  for (const char *bad : {"x 1 <= 2", "1 <= 2", "1", "1 1", "1 1 1 2",
+                          "1 1 <=", "1 1 < 2", "1 1 <= x"})
+    EXPECT_THROW(constraints(dir.write("c", bad)), file_error) << bad;
+}
+
+TEST(ConstraintsTest, Gen) {
+  scratch_dir dir;
+  const auto rec = make_shared<recording_sink>();
+  gen g(rec);
+  g.use_source_ids();
+  const auto x = [&g] { return g.between(0, 100); };
+  const auto y = [&g] { return g.between(0, 100); };
+  x();
+  y();
+  const auto xid = to_string(rec->recs[0].id), yid = to_string(rec->recs[1].id);
+  g.constrain(dir.write("c", "1 " + xid + " 1 " + yid + " <= 50\n" +
+                                 "1 " + xid + " >= 0\n" + "1 " + yid +
+                                 " >= 0\n"));
+  for (int i = 0; i < 100; ++i) {
+    const int a = x(), b = y();
+    EXPECT_LE(a + b, 50);
+    EXPECT_GE(b, 0);
+  }
+}
+
+
+TEST(FailureModelTest, Add) {
+  scratch_dir dir;
+  failure_model m(dir.write("m", "bias -2\n"
+                                 "# location bucket weight\n"
+                                 "7 0 1\n"
+                                 "7 3 0.5\n"
+                                 "8 -2 4\n"));
+  const auto sigmoid = [](double x) { return 1. / (1. + exp(-x)); };
+  EXPECT_DOUBLE_EQ(sigmoid(-2), m.add(99, 0));
+  EXPECT_DOUBLE_EQ(sigmoid(-1), m.add(7, 0));
+  EXPECT_DOUBLE_EQ(sigmoid(-.5), m.add(7, 2.5));
+  EXPECT_DOUBLE_EQ(sigmoid(-.5), m.add(7, 5));
+  EXPECT_DOUBLE_EQ(sigmoid(3.5), m.add(8, -1));
+}
+
+TEST(FailureModelTest, BadFiles) {
+  scratch_dir dir;
+  EXPECT_THROW(failure_model(dir.path("none")), file_error);
+  for (const char *bad : {"bias", "bias x", "7 0", "7 x 1", "x 0 1"})
+    EXPECT_THROW(failure_model(dir.write("m", bad)), file_error) << bad;
+}
+
+TEST(FailureModelTest, AbandonsDoomedRun) {
+  scratch_dir dir;
+  const auto doomed = dir.write("doomed", "bias 5\n");
+  EXPECT_EXIT(
+      {
+        gen g(dir.path("log"));
+        g.predict(doomed);
+        g.make<int>();
+      },
+      ::testing::ExitedWithCode(predicted_failure_exit), "");
+  // Replays are never abandoned.  (One call site for both runs keeps their
+  // locations the same.)
+  for (const bool replay : {false, true}) {
+    unique_ptr<gen> g(replay ? new gen(dir.path("log"), dir.path("replay"))
+                             : new gen(dir.path("log")));
+    if (replay)
+      g->predict(doomed);
+    exercise(*g);
+  }
+  EXPECT_EQ(dir.read("log"), dir.read("replay"));
+}
+
+TEST(ValueTableTest, Pick) {
+  scratch_dir dir;
+  const value_table t(write_table(
+      dir, "t", {{5, {{1., 1., .5, 1, 0}, {2., 3., 1., 1, 0}}},
+                 {9, {{7., 7., 1., 0, 0}}}}));
+  ASSERT_NE(nullptr, t.pick(5, .1));
+  EXPECT_EQ(1., t.pick(5, .1)->lo);
+  // Column 0's alias.
+  ASSERT_NE(nullptr, t.pick(5, .4));
+  EXPECT_EQ(3., t.pick(5, .4)->hi);
+  ASSERT_NE(nullptr, t.pick(5, .75));
+  EXPECT_EQ(2., t.pick(5, .75)->lo);
+  ASSERT_NE(nullptr, t.pick(9, .99));
+  EXPECT_EQ(7., t.pick(9, .99)->lo);
+  EXPECT_EQ(nullptr, t.pick(6, .5));
+  EXPECT_EQ(nullptr, t.pick(10, .5));
+}
+
+TEST(ValueTableTest, BadFiles) {
+  scratch_dir dir;
+  EXPECT_THROW(value_table(dir.path("none")), file_error);
+  EXPECT_THROW(value_table(dir.write("short", "rfdists1")), file_error);
+  EXPECT_THROW(value_table(dir.write("other", string(32, 'x'))), file_error);
+  EXPECT_THROW(value_table(write_table(dir, "empty", {{5, {}}})), file_error);
+  write_table(dir, "t", {{5, {{1., 1., 1., 0, 0}}}});
+  const auto b = dir.read("t");
+  EXPECT_THROW(value_table(dir.write("cut", b.substr(0, b.size() - 1))),
+               file_error);
+}
+
+TEST(ValueTableTest, SampleFrom) {
+  scratch_dir dir;
+  const auto rec = make_shared<recording_sink>();
+  gen g(rec);
+  g.use_source_ids();
+  const auto draw = [&g] { return g.between(0, 1000000); };
+  draw();
+  const auto id = rec->recs.back().id;
+  g.sample_from(write_table(dir, "t", {{id, {{7., 8., 1., 0, 0}}}}), 0.);
+  for (int i = 0; i < 20; ++i) {
+    const auto v = draw();
+    EXPECT_LE(7, v);
+    EXPECT_GE(8, v);
+  }
+  // Always exploring.
+  g.sample_from(dir.path("t"), 1.);
+  int sampled = 0;
+  for (int i = 0; i < 20; ++i) {
+    const auto v = draw();
+    sampled += v == 7 || v == 8;
+  }
+  EXPECT_GT(2, sampled);
+}
+
+TEST(ReplayTest, Desync) {
+  scratch_dir dir;
+  const auto log = dir.write("log", log_builder().value(5, 7, 1).bytes());
+  EXPECT_EXIT(
+      {
+        gen g(log, dir.path("out"));
+        g.between(0, 10);
+        g.between(0, 10);
+      },
+      ::testing::ExitedWithCode(replay_desync_exit), "log ended");
+  EXPECT_EXIT(
+      {
+        gen g(log, dir.path("out"));
+        g.between(0., 10.);
+      },
+      ::testing::ExitedWithCode(replay_desync_exit), "type 5");
+  gen g(log, dir.path("out"));
+  EXPECT_EQ(7, g.between(0, 10));
+}
+
+TEST(ReplayTest, SourceIds) {
+  const auto logs = generate_and_replay([](gen &g) { g.use_source_ids(); });
+  EXPECT_NE(string::npos, logs.first.find("RuntimeTest.cpp"));
+  EXPECT_EQ(logs.first, logs.second);
+}
+
+/// Like generate_and_replay(), but also expects the replay to make the same
+/// values as the run did.
+pair<string, string>
+expect_same_values(const function<void(gen &)> &setup,
+                   const function<void(gen &)> &body = exercise) {
+  vector<shared_ptr<recording_sink>> sinks;
+  const auto logs = generate_and_replay(
+      [&](gen &g) {
+        sinks.push_back(make_shared<recording_sink>());
+        g.add_sink(sinks.back());
+        setup(g);
+      },
+      body);
+  const auto &run = sinks[0]->recs, &replay = sinks[1]->recs;
+  EXPECT_EQ(run.size(), replay.size());
+  for (size_t i = 0; i < min(run.size(), replay.size()); ++i) {
+    EXPECT_EQ(run[i].tag, replay[i].tag) << i;
+    EXPECT_EQ(run[i].val, replay[i].val) << i;
+    EXPECT_EQ(run[i].id, replay[i].id) << i;
+  }
+  return logs;
+}
+
+TEST(ReplayTest, Sparse) {
+  // Nothing logged, everything regenerated.
+  const auto none =
+      expect_same_values([](gen &g) { g.filter_sites({}, true); });
+  EXPECT_LT(none.first.size(), none.second.size());
+  // Nothing left out; the replay doesn't log the seed.
+  const auto all =
+      expect_same_values([](gen &g) { g.filter_sites({}, false); });
+  EXPECT_LT(all.second.size(), all.first.size());
+}
+
+TEST(ReplayTest, Streams) {
+  const auto logs = expect_same_values(
+      [](gen &g) {
+        g.use_source_ids(); // Quicker than unwinding for every character.
+        g.use_streams();
+      },
+      [](gen &g) {
+        g.make<string>();
+        exercise(g);
+        g.make<string>();
+      });
+  EXPECT_EQ(logs.first, logs.second);
+}
+
+TEST(ReplayTest, Async) {
+  // A tiny ring keeps the writer thread busy.
+  for (const size_t ring : {size_t(64), size_t(1) << 20}) {
+    const auto logs = generate_and_replay(
+        [ring](gen &g) { g.write_async(ring); });
+    EXPECT_EQ(logs.first, logs.second) << ring;
+  }
+}
+
+TEST(ReplayTest, AsyncLogCompleteAtExit) {
+  scratch_dir dir;
+  EXPECT_EXIT(
+      {
+        gen g(dir.path("log"));
+        g.use_source_ids();
+        g.write_async(64);
+        exercise(g);
+        exit(3);
+      },
+      ::testing::ExitedWithCode(3), "");
+  {
+    gen g(dir.path("log"), dir.path("replay"));
+    g.use_source_ids();
+    exercise(g);
+  }
+  EXPECT_EQ(dir.read("log"), dir.read("replay"));
+}
+
+} // anonymous namespace
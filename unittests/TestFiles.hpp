@@ -0,0 +1,123 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include <dirent.h>
+#include <unistd.h>
+
+namespace ramfuzz {
+namespace test {
+
+/// A temporary directory for a test's files, removed along with them on
+/// destruction.
+class scratch_dir {
+public:
+  scratch_dir() : dir("/tmp/ramfuzz-test.XXXXXX") {
+    if (!mkdtemp(&dir[0]))
+      throw std::runtime_error("cannot create a temporary directory");
+  }
+
+  ~scratch_dir() {
+    if (DIR *d = opendir(dir.c_str())) {
+      while (const dirent *e = readdir(d))
+        if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+          unlink(path(e->d_name).c_str());
+      closedir(d);
+    }
+    rmdir(dir.c_str());
+  }
+
+  scratch_dir(const scratch_dir &) = delete;
+  scratch_dir &operator=(const scratch_dir &) = delete;
+
+  /// Full path of the file named name in the directory.
+  std::string path(const std::string &name) const { return dir + "/" + name; }
+
+  /// Writes contents to the file named name.  Returns its full path.
+  std::string write(const std::string &name, const std::string &contents) {
+    const auto p = path(name);
+    std::ofstream(p, std::ios::binary) << contents;
+    return p;
+  }
+
+  /// Contents of the file named name.
+  std::string read(const std::string &name) const {
+    std::ifstream f(path(name), std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(f),
+                       std::istreambuf_iterator<char>());
+  }
+
+private:
+  std::string dir;
+};
+
+/// Builds a RamFuzz log byte by byte, in the format described in
+/// ../runtime/ramfuzz-rt.hpp.
+class log_builder {
+public:
+  /// Appends a full value record: tag, val, and location ID id.
+  template <typename T> log_builder &value(char tag, T val, uint64_t id) {
+    raw(tag).raw(val).raw(id);
+    return *this;
+  }
+
+  /// Appends a compact value record: tag, val, and CCT node node.
+  template <typename T> log_builder &compact(char tag, T val, uint32_t node) {
+    raw(char(tag | 0x20)).raw(val).raw(node);
+    return *this;
+  }
+
+  /// Appends a metadata record with tag tag and body body.
+  log_builder &meta(unsigned char tag, const std::string &body) {
+    raw(tag).raw(uint32_t(body.size()));
+    bytes_ += body;
+    return *this;
+  }
+
+  /// Appends a metadata record defining the next CCT node.
+  log_builder &node(uint32_t parent, uint64_t site) {
+    return meta(0x40, encode(parent) + encode(site));
+  }
+
+  log_builder &seed(uint64_t s) { return meta(0x43, encode(s)); }
+  log_builder &skip(uint32_t n) { return meta(0x44, encode(n)); }
+  log_builder &stream(uint64_t id) { return meta(0x45, encode(id)); }
+
+  const std::string &bytes() const { return bytes_; }
+
+  /// The bytes of val.
+  template <typename T> static std::string encode(T val) {
+    return std::string(reinterpret_cast<const char *>(&val), sizeof(val));
+  }
+
+private:
+  template <typename T> log_builder &raw(T val) {
+    bytes_ += encode(val);
+    return *this;
+  }
+
+  std::string bytes_;
+};
+
+} // namespace test
+} // namespace ramfuzz
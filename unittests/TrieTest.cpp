@@ -0,0 +1,147 @@
+// Copyright 2016-2018 The RamFuzz contributors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "TestFiles.hpp"
+#include "ramfuzz/tools/logfile.hpp"
+#include "ramfuzz/tools/logtrie.hpp"
+
+namespace {
+
+using namespace ramfuzz::test;
+using namespace ramfuzz::tools;
+using namespace std;
+
+/// What replaying a record depends on.
+using summary = tuple<char, double, uint64_t, uint64_t, uint64_t>;
+
+/// Summaries of the records in log file fname.
+vector<summary> records_of(const string &fname) {
+  logfile log(fname);
+  logfile::cursor c(log);
+  record r;
+  vector<summary> recs;
+  while (c.next(r))
+    recs.emplace_back(r.tag, r.value(), r.id, r.stream, r.skipped);
+  return recs;
+}
+
+/// The leaf of t holding log name, or -1.
+int32_t leaf_of(const trie_file &t, const string &name) {
+  for (size_t i = 0; i < t.names.size(); ++i)
+    if (count(t.names[i].begin(), t.names[i].end(), name))
+      return i;
+  return -1;
+}
+
+/// Three logs: b branches off a after one record, and c has a's records with
+/// its CCT numbered differently.
+struct three_logs {
+  scratch_dir dir;
+  const string a = dir.write("a", log_builder()
+                                      .node(0, 100)
+                                      .compact(5, 1, 1)
+                                      .compact(5, 2, 1)
+                                      .bytes());
+  const string b = dir.write("b", log_builder()
+                                      .node(0, 100)
+                                      .compact(5, 1, 1)
+                                      .compact(5, 3, 1)
+                                      .bytes());
+  const string c = dir.write("c", log_builder()
+                                      .node(0, 7)
+                                      .node(0, 100)
+                                      .compact(5, 1, 2)
+                                      .compact(5, 2, 2)
+                                      .bytes());
+};
+
+TEST(TrieTest, RoundTrip) {
+  three_logs logs;
+  trie_builder tb;
+  tb.add(logs.a);
+  tb.add(logs.b);
+  tb.add(logs.c);
+  EXPECT_EQ(2u, tb.leaves());
+  tb.write(logs.dir.path("trie"));
+  const trie_file t(logs.dir.path("trie"));
+  ASSERT_EQ(2u, t.names.size());
+  const auto a = leaf_of(t, logs.a), b = leaf_of(t, logs.b);
+  ASSERT_LE(0, a);
+  ASSERT_LE(0, b);
+  EXPECT_NE(a, b);
+  EXPECT_EQ(a, leaf_of(t, logs.c));
+  EXPECT_EQ(records_of(logs.a), records_of(logs.dir.write("la", t.log(a))));
+  EXPECT_EQ(records_of(logs.b), records_of(logs.dir.write("lb", t.log(b))));
+  EXPECT_EQ(-1, t.sole_leaf(0));
+}
+
+TEST(TrieTest, SharedPrefix) {
+  three_logs logs;
+  trie_builder one, two;
+  one.add(logs.a);
+  two.add(logs.a);
+  two.add(logs.b);
+  const auto single = one.write(logs.dir.path("one"));
+  EXPECT_LT(two.write(logs.dir.path("two")), 2 * single);
+  EXPECT_EQ(0, trie_file(logs.dir.path("one")).sole_leaf(0));
+}
+
+TEST(TrieTest, Streams) {
+  scratch_dir dir;
+  const auto log = dir.write("log", log_builder()
+                                        .seed(42)
+                                        .node(0, 100)
+                                        .compact(5, 1, 1)
+                                        .stream(9)
+                                        .skip(2)
+                                        .compact(5, 2, 1)
+                                        .stream(0)
+                                        .compact(5, 3, 1)
+                                        .bytes());
+  trie_builder tb;
+  tb.add(log);
+  tb.write(dir.path("trie"));
+  const trie_file t(dir.path("trie"));
+  const auto got = dir.write("got", t.log(0));
+  EXPECT_EQ(records_of(log), records_of(got));
+  logfile l(got);
+  logfile::cursor c(l);
+  record r;
+  while (c.next(r))
+    ;
+  EXPECT_TRUE(c.meta().seeded);
+  EXPECT_EQ(42u, c.meta().seed);
+  EXPECT_TRUE(c.meta().streams);
+}
+
+TEST(TrieTest, BadFiles) {
+  scratch_dir dir;
+  EXPECT_THROW(trie_file(dir.path("none")), runtime_error);
+  EXPECT_THROW(trie_file(dir.write("short", string(8, '\0'))), runtime_error);
+  EXPECT_THROW(trie_file(dir.write("other", string(64, 'x'))), runtime_error);
+  trie_builder tb;
+  EXPECT_THROW(tb.add(dir.write("cut", log_builder().node(0, 1).bytes().substr(
+                                           0, 5))),
+               log_error);
+}
+
+} // anonymous namespace